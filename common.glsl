@@ -0,0 +1,30 @@
+// shared by every shader, pulled in with #include "common.glsl"
+
+#define PI 3.14159265358979
+
+struct SphParticle {
+	vec3 pos;
+	float density;
+	vec3 vel;
+	float interior; // 1 once the density pass found fluid all around, see compute-density.glsl
+};
+
+// shared simulation parameters, mirrors SimParams in final.cc (std140)
+layout(std140, binding = 0) uniform SimParams {
+	vec3  _bbox_size;
+	float _sph_mass;
+	float _sph_radius;
+	float _target_density;
+	float _pressure_mul;
+	float _particle_count;
+	float _kernel_norm;     // 6 / (PI * r^4)
+	float _kernel_der_norm; // 12 / (PI * r^4)
+};
+
+// compile-time constants, normally injected by the host (see simDefines())
+#ifndef PARTICLE_COUNT
+#define PARTICLE_COUNT int(_particle_count)
+#endif
+#ifndef WORKGROUP_SIZE
+#define WORKGROUP_SIZE 64
+#endif
@@ -1,19 +1,8 @@
 #version 430
 
-#define WORKGROUP_SIZE 2
-layout (local_size_x = WORKGROUP_SIZE, local_size_y = WORKGROUP_SIZE, local_size_z = WORKGROUP_SIZE) in;
+#include "sph.glsl"
 
-
-
-struct SphParticle {
-	vec3 pos;
-	float density;
-	vec3 vel;
-	float _pad2;
-};
-
-uniform float _particle_count;
-uniform vec3  _bbox_size;
+layout (local_size_x = WORKGROUP_SIZE) in;
 
 layout(std140, binding = 0) buffer Ssbo0 {
   SphParticle particle[];
@@ -23,61 +12,56 @@ layout(std140, binding = 1) buffer Ssbo1 {
   SphParticle particle[];
 } state_out;
 
-// int linearId(uvec3 v) {
-// 	return v.x +
-// }
-
 #define DT (1.0/120.0)
-#define PI 3.14159265358979
-
-uniform float _sph_mass;
-uniform float _sph_radius;
-uniform float _target_density;
-uniform float _pressure_mul;
-
-float crappyDensityToPressure(float density) {
-	float error = density - _target_density;
-	return error * _pressure_mul;
-}
-
-float smoothingFunc(float dst) {
-	if (dst >= _sph_radius) return 0.;
 
-	float vol = (PI * pow(_sph_radius, 4.0)) / 6.0;
-	return (_sph_radius - dst) * (_sph_radius - dst) / vol;
-}
-
-float smoothingFuncDer(float dst) {
-	if (dst >= _sph_radius) return 0.;
-
-	float scale = 12.0 / (pow(_sph_radius, 4.0) * PI);
-	return (dst - _sph_radius) * scale;
-}
-
-
-float computeDensity(int i) {
+// Surface classification, from the same neighbour loop. The kernel weighted
+// mean of the neighbours' offsets (the colour field gradient, up to a
+// factor) is zero deep inside and about a quarter radius at a flat surface,
+// falling off over one radius below it. At SURFACE_OFFSET or above, or with
+// too few neighbours to tell, it's surface. Drawn spheres leave gaps, so the
+// shell is grown by another radius: a particle is only interior once no
+// neighbour was surface in the previous step.
+//  interior 0:   surface
+//           0.5: within a radius of the surface
+//           1:   interior, not drawn
+#define SURFACE_OFFSET 0.05 // of the kernel radius
+#define SURFACE_MIN_NEIGHBOURS 16
+
+float computeDensity(int i, out float interior) {
 	SphParticle p = state_in.particle[i];
 	float density = 0.0;
-	for (int x = 0; x < _particle_count; ++x) {
+	vec3 offset = vec3(0);
+	float weight = 0.0;
+	int neighbours = -1; // itself
+	bool near_surface = false;
+	for (int x = 0; x < PARTICLE_COUNT; ++x) {
 		// if (x == i) continue;
 		SphParticle pi = state_in.particle[x];
 
-		float dist = distance(pi.pos + pi.vel * DT, p.pos + p.vel * DT);
-		density += _sph_mass * smoothingFunc(dist);
+		vec3 delta = minImage((pi.pos + pi.vel * DT) - (p.pos + p.vel * DT));
+		float w = smoothingFunc(length(delta));
+		density += _sph_mass * w;
+		offset += delta * w;
+		weight += w;
+		neighbours += w > 0.0 ? 1 : 0;
+		near_surface = near_surface || (w > 0.0 && pi.interior == 0.0);
 	}
+	if (neighbours < SURFACE_MIN_NEIGHBOURS || length(offset) >= SURFACE_OFFSET * KERNEL_RADIUS * weight)
+		interior = 0.0;
+	else
+		interior = near_surface ? 0.5 : 1.0;
 	return density;
 }
 
 uint linearId() {
-	return gl_GlobalInvocationID.x; // + gl_GlobalInvocationID.y * WORKGROUP_SIZE + gl_GlobalInvocationID.z * WORKGROUP_SIZE * WORKGROUP_SIZE;
+	return gl_GlobalInvocationID.x;
 }
 
 void main() {
 	uint linear_id = linearId();
-	if (linear_id < _particle_count) {
+	if (linear_id < PARTICLE_COUNT) {
 		SphParticle p = state_in.particle[linear_id];
-		p.density = computeDensity(int(linear_id));
+		p.density = computeDensity(int(linear_id), p.interior);
 		state_out.particle[linear_id] = p;
 	}
 }
-
@@ -3,7 +3,7 @@
 uniform mat4 _proj;
 uniform mat4 _view;
 
-uniform vec3 _bbox_size;
+#include "common.glsl"
 
 void main() {
 	vec3 pos = vec3(0);
@@ -0,0 +1,26 @@
+#version 430
+
+// One level of the Hi-Z pyramid (see hiz.h): the farthest depth of the 2x2
+// texels below, of the depth buffer copy for level 0. Coordinates past the
+// edge of the source clamp to it.
+
+uniform int _level;
+
+layout(binding = 0) uniform sampler2D _depth;
+layout(binding = 0, r32f) uniform readonly image2D _src;
+layout(binding = 1, r32f) uniform writeonly image2D _dst;
+
+layout (local_size_x = 8, local_size_y = 8) in;
+
+void main() {
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, imageSize(_dst)))) return;
+
+	ivec2 size = _level == 0 ? textureSize(_depth, 0) : imageSize(_src);
+	float d = 0.0;
+	for (int i = 0; i < 4; ++i) {
+		ivec2 q = min(p * 2 + ivec2(i & 1, i >> 1), size - 1);
+		d = max(d, _level == 0 ? texelFetch(_depth, q, 0).r : imageLoad(_src, q).r);
+	}
+	imageStore(_dst, p, vec4(d));
+}
@@ -0,0 +1,33 @@
+#version 430
+
+uniform mat4 _proj;
+uniform mat4 _view;
+
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS 0.3
+#endif
+
+in vec3 v_color;
+in vec3 v_center;
+in vec3 v_quad;
+
+out vec3 color;
+
+// the sphere is always in front of the quad through its center
+layout(depth_less) out float gl_FragDepth;
+
+void main() {
+	// eye at the origin, nearest hit of the ray through v_quad
+	vec3 dir = normalize(v_quad);
+	float b = dot(dir, v_center);
+	float h = b * b - dot(v_center, v_center) + PARTICLE_RADIUS * PARTICLE_RADIUS;
+	if (h < 0.0) discard;
+	vec3 hit = dir * (b - sqrt(h));
+
+	vec4 clip = vec4(hit,1) * _proj;
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+	// world space normal, lit like the sphere mesh in vertex.glsl
+	vec3 n = mat3(_view) * ((hit - v_center) / PARTICLE_RADIUS);
+	color = max(dot(n, normalize(vec3(1))), 0.1) * v_color;
+}
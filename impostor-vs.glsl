@@ -0,0 +1,49 @@
+#version 430
+
+uniform mat4 _proj;
+uniform mat4 _view;
+
+#include "common.glsl"
+
+// radius of the drawn spheres, injected by the host
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS 0.3
+#endif
+
+layout(std140, binding = 1) buffer Ssbo {
+  SphParticle particle[];
+} ssbo;
+
+#ifdef ALL_PARTICLES // no culling, for the screen-space fluid splats in ssf.h
+#define particle_id gl_InstanceID
+#else
+layout(location = 1) in uint particle_id; // from the visible list, see particle-cull.glsl
+#endif
+
+out vec3 v_color;
+out vec3 v_center; // view space
+out vec3 v_quad;   // view space point on the quad, the eye ray goes through it
+
+// One quad per visible particle (4 vertex triangle strip, instanced), facing
+// the eye and just big enough to cover the sphere's silhouette.
+// impostor-ps.glsl ray casts the actual sphere.
+void main() {
+	SphParticle p = ssbo.particle[particle_id];
+	v_color = vec3(0,0,1) + vec3(1,0,0) * length(p.vel) / 5.0;
+
+	vec3 c = (vec4(p.pos,1) * _view).xyz;
+	float d = length(c);
+	// the silhouette cone has half angle asin(r / d), this is its radius
+	// in the plane through the center
+	float half_size = PARTICLE_RADIUS * d / sqrt(max(d * d - PARTICLE_RADIUS * PARTICLE_RADIUS, 1e-6));
+
+	vec3 fwd = c / d;
+	vec3 right = normalize(cross(fwd, vec3(0,1,0)));
+	vec3 up = cross(right, fwd);
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+	vec3 q = c + (right * corner.x + up * corner.y) * half_size;
+
+	v_center = c;
+	v_quad = q;
+	gl_Position = vec4(q,1) * _proj;
+}
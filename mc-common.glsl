@@ -0,0 +1,94 @@
+// shared by the marching cubes passes, see marching_cubes.h
+
+#include "sph.glsl"
+
+#define MC_BLOCK 4             // cells per block and axis
+#define MC_MAX_CASE_TRIS 5     // per cell
+#define MC_FIXED_SCALE 65536.0 // the splats add up as integers, atomically
+#define MC_ISO (0.5 * _target_density)
+
+uniform int _cells; // per axis, over _bbox_size
+
+struct McBlock {
+	uint dirty;
+	uint tris;
+	uint offset;      // into the mesh, in triangles
+	uint prev_offset; // last frame's
+};
+
+struct McVertex {
+	vec4 pos;
+	vec4 normal;
+};
+
+layout(std430, binding = 1) buffer Density { uint density[]; };
+layout(std430, binding = 2) buffer Reference { float reference[]; };
+layout(std430, binding = 3) buffer Blocks { McBlock blocks[]; };
+layout(std430, binding = 4) buffer Command {
+	uint count;
+	uint instance_count;
+	uint first;
+	uint base_instance;
+	uint dirty_blocks;
+} command;
+layout(std430, binding = 5) readonly buffer Table {
+	uint tri_count[256];
+	int tri_edges[256 * MC_MAX_CASE_TRIS * 3];
+};
+layout(std430, binding = 6) readonly buffer VerticesIn { McVertex vertices_in[]; };
+layout(std430, binding = 7) writeonly buffer VerticesOut { McVertex vertices_out[]; };
+
+// same numbering as MC_CORNERS and MC_EDGES in marching_cubes.h
+const ivec3 CORNERS[8] = ivec3[8](
+	ivec3(0,0,0), ivec3(1,0,0), ivec3(1,1,0), ivec3(0,1,0),
+	ivec3(0,0,1), ivec3(1,0,1), ivec3(1,1,1), ivec3(0,1,1));
+const ivec2 EDGES[12] = ivec2[12](
+	ivec2(0,1), ivec2(1,2), ivec2(2,3), ivec2(3,0),
+	ivec2(4,5), ivec2(5,6), ivec2(6,7), ivec2(7,4),
+	ivec2(0,4), ivec2(1,5), ivec2(2,6), ivec2(3,7));
+
+vec3 cellSize() {
+	return _bbox_size / float(_cells);
+}
+
+int nodeIndex(ivec3 n) {
+	return n.x + (n.y + n.z * (_cells + 1)) * (_cells + 1);
+}
+
+// the outermost nodes count as empty, so the surface closes along the walls
+bool outerNode(ivec3 n) {
+	return any(lessThanEqual(n, ivec3(0))) || any(greaterThanEqual(n, ivec3(_cells)));
+}
+
+// this frame's splat
+float densityAt(ivec3 n) {
+	if (outerNode(n)) return 0.0;
+	return float(density[nodeIndex(n)]) / MC_FIXED_SCALE;
+}
+
+// what the mesh is extracted from, see mc-freeze.glsl
+float extractedAt(ivec3 n) {
+	if (outerNode(n)) return 0.0;
+	return reference[nodeIndex(n)];
+}
+
+int blocksPerAxis() {
+	return _cells / MC_BLOCK;
+}
+
+int blockIndex(ivec3 b) {
+	return b.x + (b.y + b.z * blocksPerAxis()) * blocksPerAxis();
+}
+
+ivec3 blockCoords(uint i) {
+	int n = blocksPerAxis();
+	return ivec3(int(i) % n, int(i) / n % n, int(i) / (n * n));
+}
+
+// bit per corner above the iso level
+uint cellCase(ivec3 c) {
+	uint k = 0u;
+	for (int i = 0; i < 8; ++i)
+		if (extractedAt(c + CORNERS[i]) > MC_ISO) k |= 1u << i;
+	return k;
+}
@@ -0,0 +1,22 @@
+#version 430
+
+// Triangles per dirty block, one workgroup per block and invocation per cell.
+// Clean blocks keep last frame's count.
+
+#include "mc-common.glsl"
+
+layout (local_size_x = MC_BLOCK, local_size_y = MC_BLOCK, local_size_z = MC_BLOCK) in;
+
+shared uint block_tris;
+
+void main() {
+	uint b = gl_WorkGroupID.x;
+	if (blocks[b].dirty != 0u) { // the same for the whole group
+		if (gl_LocalInvocationIndex == 0u) block_tris = 0u;
+		barrier();
+		ivec3 c = blockCoords(b) * MC_BLOCK + ivec3(gl_LocalInvocationID);
+		atomicAdd(block_tris, tri_count[cellCase(c)]);
+		barrier();
+		if (gl_LocalInvocationIndex == 0u) blocks[b].tris = block_tris;
+	}
+}
@@ -0,0 +1,24 @@
+#version 430
+
+// A node takes this frame's density as its extracted one only when every
+// block it is a cell corner in gets extracted again. Otherwise a clean block
+// next to it keeps triangles built from the old value, and the two meshes
+// would no longer meet along the face.
+
+#include "mc-common.glsl"
+
+layout (local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+
+void main() {
+	ivec3 n = ivec3(gl_GlobalInvocationID);
+	if (any(greaterThan(n, ivec3(_cells)))) return;
+
+	ivec3 lo = max(n - 1, ivec3(0)) / MC_BLOCK;
+	ivec3 hi = min(n, ivec3(_cells - 1)) / MC_BLOCK;
+	for (int z = lo.z; z <= hi.z; ++z)
+	for (int y = lo.y; y <= hi.y; ++y)
+	for (int x = lo.x; x <= hi.x; ++x)
+		if (blocks[blockIndex(ivec3(x, y, z))].dirty == 0u) return;
+
+	reference[nodeIndex(n)] = densityAt(n);
+}
@@ -0,0 +1,69 @@
+#version 430
+
+// One workgroup per block, invocation per cell. Dirty blocks write their
+// triangles at the block's offset, in whatever order the cells get there,
+// from the densities mc-freeze.glsl settled on. Clean blocks copy last
+// frame's triangles to where the scan moved them.
+
+#include "mc-common.glsl"
+
+uniform int _max_triangles;
+
+layout (local_size_x = MC_BLOCK, local_size_y = MC_BLOCK, local_size_z = MC_BLOCK) in;
+
+shared uint next_tri;
+
+vec3 gradient(ivec3 n) {
+	return vec3(extractedAt(n + ivec3(1,0,0)) - extractedAt(n - ivec3(1,0,0)),
+							extractedAt(n + ivec3(0,1,0)) - extractedAt(n - ivec3(0,1,0)),
+							extractedAt(n + ivec3(0,0,1)) - extractedAt(n - ivec3(0,0,1))) / (2.0 * cellSize());
+}
+
+// where the iso level crosses edge e of cell c, facing down the density.
+// Always from the lower node, so the cells around an edge agree to the bit.
+McVertex edgeVertex(ivec3 c, int e) {
+	ivec3 a = c + CORNERS[EDGES[e].x];
+	ivec3 b = c + CORNERS[EDGES[e].y];
+	if (any(lessThan(b, a))) {
+		ivec3 lower = b;
+		b = a;
+		a = lower;
+	}
+	float da = extractedAt(a);
+	float db = extractedAt(b);
+	float t = clamp((MC_ISO - da) / (db - da), 0.0, 1.0);
+	vec3 g = mix(gradient(a), gradient(b), t);
+	vec3 n = dot(g, g) > 0.0 ? -normalize(g) : vec3(0,1,0);
+	return McVertex(vec4(mix(vec3(a), vec3(b), t) * cellSize(), 1.0), vec4(n, 0.0));
+}
+
+void main() {
+	uint b = gl_WorkGroupID.x;
+	McBlock block = blocks[b];
+	ivec3 bc = blockCoords(b);
+	ivec3 c = bc * MC_BLOCK + ivec3(gl_LocalInvocationID);
+	uint max_verts = uint(_max_triangles) * 3u;
+
+	if (block.dirty != 0u) { // the same for the whole group
+		if (gl_LocalInvocationIndex == 0u) next_tri = 0u;
+		barrier();
+		uint k = cellCase(c);
+		uint n = tri_count[k];
+		uint first = block.offset + atomicAdd(next_tri, n);
+		for (uint i = 0u; i < n; ++i)
+			for (uint j = 0u; j < 3u; ++j) {
+				uint v = (first + i) * 3u + j;
+				if (v < max_verts) vertices_out[v] = edgeVertex(c, tri_edges[(k * MC_MAX_CASE_TRIS + i) * 3u + j]);
+			}
+	} else {
+		for (uint i = gl_LocalInvocationIndex; i < block.tris * 3u; i += MC_BLOCK * MC_BLOCK * MC_BLOCK) {
+			uint src = block.prev_offset * 3u + i;
+			uint dst = block.offset * 3u + i;
+			if (src >= max_verts || dst >= max_verts) break;
+			vertices_out[dst] = vertices_in[src];
+		}
+	}
+
+	barrier();
+	if (gl_LocalInvocationIndex == 0u) blocks[b].dirty = 0u;
+}
@@ -0,0 +1,25 @@
+#version 430
+
+// A node whose density moved more than _threshold (of the iso level) since
+// it was last extracted flags every block it is a cell corner in.
+
+#include "mc-common.glsl"
+
+uniform int _force; // flag everything
+uniform float _threshold;
+
+layout (local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+
+void main() {
+	ivec3 n = ivec3(gl_GlobalInvocationID);
+	if (any(greaterThan(n, ivec3(_cells)))) return;
+
+	if (_force == 0 && abs(densityAt(n) - reference[nodeIndex(n)]) <= _threshold * MC_ISO) return;
+
+	ivec3 lo = max(n - 1, ivec3(0)) / MC_BLOCK;
+	ivec3 hi = min(n, ivec3(_cells - 1)) / MC_BLOCK;
+	for (int z = lo.z; z <= hi.z; ++z)
+	for (int y = lo.y; y <= hi.y; ++y)
+	for (int x = lo.x; x <= hi.x; ++x)
+		blocks[blockIndex(ivec3(x, y, z))].dirty = 1u;
+}
@@ -0,0 +1,10 @@
+#version 430
+
+in vec3 v_normal;
+
+out vec3 color;
+
+// lit like the spheres
+void main() {
+	color = max(dot(normalize(v_normal), normalize(vec3(1))), 0.1) * vec3(0.1, 0.35, 0.8);
+}
@@ -0,0 +1,59 @@
+#version 430
+
+// Exclusive prefix sum of the triangles per block, in one workgroup: every
+// invocation sums a run of blocks, the run totals are scanned in shared
+// memory, then every invocation hands out offsets along its run. Last
+// frame's offsets are kept for the clean blocks to copy from. Also writes
+// the draw for the whole mesh.
+
+#include "mc-common.glsl"
+
+uniform int _max_triangles;
+
+#define GROUP 256
+
+layout (local_size_x = GROUP) in;
+
+shared uint sums[GROUP];
+shared uint dirty;
+
+void main() {
+	uint t = gl_LocalInvocationIndex;
+	uint n = uint(blocksPerAxis() * blocksPerAxis() * blocksPerAxis());
+	uint per = (n + GROUP - 1) / GROUP;
+	uint first = min(t * per, n);
+	uint last = min(first + per, n);
+
+	uint sum = 0u;
+	uint run_dirty = 0u;
+	for (uint i = first; i < last; ++i) {
+		sum += blocks[i].tris;
+		run_dirty += blocks[i].dirty;
+	}
+	sums[t] = sum;
+	if (t == 0u) dirty = 0u;
+	barrier();
+	atomicAdd(dirty, run_dirty);
+
+	for (uint o = 1u; o < GROUP; o <<= 1) {
+		uint v = t >= o ? sums[t - o] : 0u;
+		barrier();
+		sums[t] += v;
+		barrier();
+	}
+
+	uint offset = sums[t] - sum;
+	for (uint i = first; i < last; ++i) {
+		blocks[i].prev_offset = blocks[i].offset;
+		blocks[i].offset = offset;
+		offset += blocks[i].tris;
+	}
+
+	if (t == GROUP - 1) {
+		command.count = min(sums[t], uint(_max_triangles)) * 3u;
+		command.instance_count = 1u;
+		command.first = 0u;
+		command.base_instance = 0u;
+		command.dirty_blocks = dirty;
+	}
+}
@@ -0,0 +1,28 @@
+#version 430
+
+// Every particle adds its SPH density contribution to the grid nodes within
+// a kernel radius, see marching_cubes.h.
+
+#include "mc-common.glsl"
+
+layout (local_size_x = WORKGROUP_SIZE) in;
+
+layout(std140, binding = 0) buffer State {
+	SphParticle particle[];
+} state;
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= uint(PARTICLE_COUNT)) return;
+
+	vec3 p = state.particle[i].pos;
+	vec3 h = cellSize();
+	ivec3 lo = max(ivec3(ceil((p - KERNEL_RADIUS) / h)), ivec3(0));
+	ivec3 hi = min(ivec3(floor((p + KERNEL_RADIUS) / h)), ivec3(_cells));
+	for (int z = lo.z; z <= hi.z; ++z)
+	for (int y = lo.y; y <= hi.y; ++y)
+	for (int x = lo.x; x <= hi.x; ++x) {
+		float w = _sph_mass * smoothingFunc(length(vec3(x, y, z) * h - p));
+		if (w > 0.0) atomicAdd(density[nodeIndex(ivec3(x, y, z))], uint(w * MC_FIXED_SCALE));
+	}
+}
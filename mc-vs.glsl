@@ -0,0 +1,22 @@
+#version 430
+
+uniform mat4 _proj;
+uniform mat4 _view;
+
+struct McVertex {
+	vec4 pos;
+	vec4 normal;
+};
+
+// the marching cubes mesh, see marching_cubes.h
+layout(std430, binding = 0) readonly buffer Vertices {
+	McVertex vertices[];
+};
+
+out vec3 v_normal;
+
+void main() {
+	McVertex v = vertices[gl_VertexID];
+	v_normal = v.normal.xyz;
+	gl_Position = (v.pos * _view) * _proj;
+}
@@ -0,0 +1,151 @@
+#version 430
+
+uniform mat4 _proj;
+uniform mat4 _view;
+uniform vec2 _viewport;       // pixels
+uniform vec4 _lod_min_pixels; // projected radius each LOD starts at, finest first
+uniform int _phase;
+uniform int _surface_only;
+
+#include "common.glsl"
+
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS 0.3
+#endif
+
+// impostors are one quad each, a single list and glDrawArraysIndirect
+#ifdef IMPOSTORS
+#define LOD_COUNT 1
+#else
+#define LOD_COUNT 4
+#endif
+
+layout (local_size_x = WORKGROUP_SIZE) in;
+
+layout(std140, binding = 0) buffer Ssbo0 {
+  SphParticle particle[];
+} state;
+
+// indirect draw commands, one per LOD, instance counts zeroed
+#ifdef IMPOSTORS
+struct DrawCommand { // glDrawArraysIndirect
+	uint count;
+	uint instance_count;
+	uint first;
+	uint base_instance;
+};
+#else
+struct DrawCommand { // glMultiDrawElementsIndirect
+	uint count;
+	uint instance_count;
+	uint first_index;
+	int  base_vertex;
+	uint base_instance;
+};
+#endif
+
+layout(std430, binding = 1) buffer Commands {
+	DrawCommand commands[2 * LOD_COUNT]; // per phase
+	uint surface;    // not skipped as interior
+	uint in_frustum; // of those
+};
+
+// particle ids, each LOD's list starts at its base_instance
+layout(std430, binding = 2) buffer Instances {
+	uint instances[];
+};
+
+// drawn last frame, per particle
+layout(std430, binding = 3) buffer Visibility {
+	uint visible[];
+};
+
+layout(binding = 0) uniform sampler2D _hiz;
+
+// Clip space is c = v * _proj and a point is in when -c.w <= c.xyz <= c.w,
+// so the six planes are column 3 plus or minus columns 0-2. Normalized, they
+// give the view space sphere center's distance.
+bool inFrustum(vec3 c) {
+	for (int i = 0; i < 3; ++i) {
+		for (int s = -1; s <= 1; s += 2) {
+			vec4 plane = _proj[3] + float(s) * _proj[i];
+			if (dot(vec4(c,1), plane) / length(plane.xyz) < -PARTICLE_RADIUS)
+				return false;
+		}
+	}
+	return true;
+}
+
+// True if the sphere's nearest depth is behind the farthest the pyramid has
+// anywhere in its screen rect. The rect is that of the bounding box'
+// corners, and the level the one where it overlaps at most 2x2 texels.
+bool occluded(vec3 c) {
+	const float r = PARTICLE_RADIUS;
+	if (c.z - r <= 0.0) return false;
+
+	vec2 lo = vec2(1e9), hi = vec2(-1e9);
+	for (int i = 0; i < 8; ++i) {
+		vec3 corner = c + (vec3(i & 1, (i >> 1) & 1, i >> 2) * 2.0 - 1.0) * r;
+		vec4 p = vec4(corner,1) * _proj;
+		lo = min(lo, p.xy / p.w);
+		hi = max(hi, p.xy / p.w);
+	}
+	vec4 n = vec4(c - vec3(0,0,r),1) * _proj;
+	float nearest = n.z / n.w * 0.5 + 0.5;
+
+	ivec2 p0 = ivec2(clamp((lo * 0.5 + 0.5) * _viewport, vec2(0), _viewport - 1.0));
+	ivec2 p1 = ivec2(clamp((hi * 0.5 + 0.5) * _viewport, vec2(0), _viewport - 1.0));
+	int span = max(p1.x - p0.x, p1.y - p0.y);
+	int level = clamp(findMSB(span), 0, textureQueryLevels(_hiz) - 1);
+	int s = level + 1;
+
+	float farthest = max(max(texelFetch(_hiz, ivec2(p0.x >> s, p0.y >> s), level).r,
+													 texelFetch(_hiz, ivec2(p1.x >> s, p0.y >> s), level).r),
+											 max(texelFetch(_hiz, ivec2(p0.x >> s, p1.y >> s), level).r,
+													 texelFetch(_hiz, ivec2(p1.x >> s, p1.y >> s), level).r));
+	return nearest > farthest;
+}
+
+// Two phases, see ParticleDraw. 0 lists what was drawn last frame and is
+// still in view; 1 runs after those went into the Hi-Z pyramid, tests
+// everything in view against it and lists the newly visible rest.
+void main() {
+	uint id = gl_GlobalInvocationID.x;
+	if (id >= PARTICLE_COUNT) return;
+
+	// interior particles are hidden behind the surface ones anyway, see
+	// compute-density.glsl
+	SphParticle p = state.particle[id];
+	vec3 c = (vec4(p.pos,1) * _view).xyz;
+	bool hidden = _surface_only != 0 && p.interior == 1.0;
+	if (_phase == 1 && !hidden) atomicAdd(surface, 1u);
+	if (hidden || !inFrustum(c)) {
+		if (_phase == 1) visible[id] = 0u;
+		return;
+	}
+
+	if (_phase == 0) {
+		if (visible[id] == 0u) return;
+	} else {
+		atomicAdd(in_frustum, 1u);
+		bool drawn = visible[id] != 0u;
+		bool vis = !occluded(c);
+		visible[id] = vis ? 1u : 0u;
+		if (!vis || drawn) return;
+	}
+
+	int lod = 0;
+#ifndef IMPOSTORS
+	// radius in pixels, measured vertically through the center
+	vec4 a = vec4(c,1) * _proj;
+	vec4 b = vec4(c + vec3(0, PARTICLE_RADIUS, 0),1) * _proj;
+	float pixels = a.w > 0.0 ? abs(b.y / b.w - a.y / a.w) * 0.5 * _viewport.y : 0.0;
+
+	while (lod < LOD_COUNT - 1 && pixels < _lod_min_pixels[lod])
+		lod++;
+#endif
+
+	int cmd = _phase * LOD_COUNT + lod;
+	uint slot = atomicAdd(commands[cmd].instance_count, 1u);
+	instances[commands[cmd].base_instance + slot] = id;
+}
@@ -0,0 +1,85 @@
+#version 430
+
+// Rasterizes every particle as a disk of pixels into the visibility buffer,
+// see point_raster.h. The depth per pixel is the sphere's, so overlapping
+// particles cut into each other like the impostors do. Splats are clamped
+// to POINT_MAX_RADIUS, up close the spheres get smaller than they should.
+//
+// ATOMIC_INT64: one 64-bit atomicMin of (depth << 32 | id) per pixel.
+// Otherwise the depth pass keeps the nearest depth and the ID_PASS variant
+// writes the id of whichever particle matches it. The two are separate
+// programs, so both get the depth bits from splatDepth() alone.
+
+#ifdef ATOMIC_INT64
+#extension GL_ARB_gpu_shader_int64 : require
+#extension GL_NV_shader_atomic_int64 : require
+#endif
+
+#include "common.glsl"
+
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS 0.3
+#endif
+#define POINT_MAX_RADIUS 8.0
+#define NEAR 0.1
+
+uniform mat4 _proj;
+uniform mat4 _view;
+uniform vec2 _viewport;
+uniform int _surface_only; // skip what the density pass found inside the fluid
+
+layout(std140, binding = 1) buffer State {
+	SphParticle particle[];
+} state;
+
+// both words together are a uint64_t, the depth in the high one
+#ifdef ATOMIC_INT64
+layout(std430, binding = 0) buffer Visibility { uint64_t visibility[]; };
+#else
+layout(std430, binding = 0) buffer Visibility { uvec2 visibility[]; }; // (id, depth bits)
+#endif
+
+layout (local_size_x = WORKGROUP_SIZE) in;
+
+// depth bits of the sphere at c (view space) d pixels off its center with
+// a splat radius of r pixels, ~0u where the splat doesn't cover. precise
+// here and for its inputs in main(), so no variant rounds differently.
+uint splatDepth(vec3 c, vec2 d, float r) {
+	precise float dd = dot(d, d);
+	// the pixel holding the center always counts, even for a tiny disk
+	if (dd > max(r * r, 0.5)) return ~0u;
+	precise float z = c.z - PARTICLE_RADIUS * sqrt(max(1.0 - dd / (r * r), 0.0));
+	precise vec4 zc = vec4(0, 0, z, 1) * _proj;
+	precise float depth = zc.z / zc.w * 0.5 + 0.5;
+	return floatBitsToUint(depth); // positive, orders like the float
+}
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= uint(PARTICLE_COUNT)) return;
+
+	SphParticle p = state.particle[i];
+	if (_surface_only != 0 && p.interior > 0.5) return;
+
+	precise vec3 c = (vec4(p.pos, 1) * _view).xyz;
+	if (c.z - PARTICLE_RADIUS < NEAR) return;
+	precise vec4 clip = vec4(c, 1) * _proj;
+	precise vec2 center = (clip.xy / clip.w * 0.5 + 0.5) * _viewport;
+	precise float r = min(PARTICLE_RADIUS / c.z * _proj[1][1] * 0.5 * _viewport.y, POINT_MAX_RADIUS);
+
+	ivec2 lo = max(ivec2(floor(center - r)), ivec2(0));
+	ivec2 hi = min(ivec2(ceil(center + r)), ivec2(_viewport) - 1);
+	for (int y = lo.y; y <= hi.y; ++y)
+	for (int x = lo.x; x <= hi.x; ++x) {
+		uint depth = splatDepth(c, vec2(x, y) + 0.5 - center, r);
+		if (depth == ~0u) continue;
+		uint pixel = uint(x + y * int(_viewport.x));
+#if defined(ATOMIC_INT64)
+		atomicMin(visibility[pixel], packUint2x32(uvec2(i, depth)));
+#elif defined(ID_PASS)
+		if (visibility[pixel].y == depth) visibility[pixel].x = i;
+#else
+		atomicMin(visibility[pixel].y, depth);
+#endif
+	}
+}
@@ -0,0 +1,46 @@
+#version 430
+
+// Shades the particle each pixel of the visibility buffer holds (see
+// point_raster.h), ray casting its sphere for the normal and the depth and
+// lit like impostor-ps.glsl. A ray that misses the sphere, at the rim of a
+// splat, takes the closest point on it.
+
+#include "common.glsl"
+
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS 0.3
+#endif
+
+uniform mat4 _proj;
+uniform mat4 _inv_proj;
+uniform mat4 _view;
+uniform vec2 _viewport;
+
+layout(std430, binding = 0) readonly buffer Visibility { uvec2 visibility[]; }; // (id, depth bits)
+
+layout(std140, binding = 1) readonly buffer State {
+	SphParticle particle[];
+} state;
+
+out vec3 color;
+
+void main() {
+	ivec2 t = ivec2(gl_FragCoord.xy);
+	uvec2 v = visibility[t.x + t.y * int(_viewport.x)];
+	if (v.y == ~0u || v.x >= uint(PARTICLE_COUNT)) discard; // empty, or no id matched the depth
+
+	SphParticle p = state.particle[v.x];
+	vec3 c = (vec4(p.pos, 1) * _view).xyz;
+	vec4 r = vec4(gl_FragCoord.xy / _viewport * 2.0 - 1.0, 1.0, 1.0) * _inv_proj;
+	vec3 dir = normalize(r.xyz / r.w);
+	float b = dot(dir, c);
+	float h = max(b * b - dot(c, c) + PARTICLE_RADIUS * PARTICLE_RADIUS, 0.0);
+	vec3 hit = dir * (b - sqrt(h));
+
+	vec4 clip = vec4(hit, 1) * _proj;
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+	vec3 n = mat3(_view) * normalize(hit - c);
+	vec3 albedo = vec3(0,0,1) + vec3(1,0,0) * length(p.vel) / 5.0;
+	color = max(dot(n, normalize(vec3(1))), 0.1) * albedo;
+}
@@ -0,0 +1,56 @@
+// SPH kernels and boundary helpers shared by the density and force passes
+
+#include "common.glsl"
+
+// set per axis to wrap instead of clamp-and-reflect
+#ifndef PERIODIC_X
+#define PERIODIC_X 0
+#endif
+#ifndef PERIODIC_Y
+#define PERIODIC_Y 0
+#endif
+#ifndef PERIODIC_Z
+#define PERIODIC_Z 0
+#endif
+
+// specialized variants bake the radius in, otherwise it comes from SimParams
+#ifdef KERNEL_RADIUS
+#define KERNEL_NORM     (6.0 / (PI * KERNEL_RADIUS * KERNEL_RADIUS * KERNEL_RADIUS * KERNEL_RADIUS))
+#define KERNEL_DER_NORM (12.0 / (PI * KERNEL_RADIUS * KERNEL_RADIUS * KERNEL_RADIUS * KERNEL_RADIUS))
+#else
+#define KERNEL_RADIUS   _sph_radius
+#define KERNEL_NORM     _kernel_norm
+#define KERNEL_DER_NORM _kernel_der_norm
+#endif
+
+// minimum image convention: on periodic axes take the nearest copy of the
+// neighbour across the box
+vec3 minImage(vec3 d) {
+#if PERIODIC_X
+	d.x -= _bbox_size.x * round(d.x / _bbox_size.x);
+#endif
+#if PERIODIC_Y
+	d.y -= _bbox_size.y * round(d.y / _bbox_size.y);
+#endif
+#if PERIODIC_Z
+	d.z -= _bbox_size.z * round(d.z / _bbox_size.z);
+#endif
+	return d;
+}
+
+float crappyDensityToPressure(float density) {
+	float error = density - _target_density;
+	return error * _pressure_mul;
+}
+
+float smoothingFunc(float dst) {
+	if (dst >= KERNEL_RADIUS) return 0.;
+
+	return (KERNEL_RADIUS - dst) * (KERNEL_RADIUS - dst) * KERNEL_NORM;
+}
+
+float smoothingFuncDer(float dst) {
+	if (dst >= KERNEL_RADIUS) return 0.;
+
+	return (dst - KERNEL_RADIUS) * KERNEL_DER_NORM;
+}
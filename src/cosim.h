@@ -0,0 +1,317 @@
+#pragma once
+
+// CPU+GPU co-simulation. The box is split along x: particles below split are
+// stepped by CpuSph on the job system, the rest by the compute shaders, both
+// at the same time. Like the slabs in distributed.h each side also gets
+// copies (ghosts) of the other side's particles near the split. Unlike
+// there, both sides work out the ghosts' densities themselves, so a step
+// needs no exchange between its density and force passes. That takes two
+// layers of ghosts: the ones an owned particle's force sees, and everything
+// that counts towards their densities. Both passes look for neighbours at
+// positions predicted up to a dt ahead, so the layers are worked out from
+// where along x each particle can be predicted at, a kernel radius around
+// the owned particles' and then around the first layer's. Particles that
+// are fast along x widen the halo only as far as they get. Ghosts get
+// stepped too and are thrown away.
+//
+// --headless --cosim checks the last step against the same step on CpuSph
+// alone, and fails past COSIM_MAX_ERROR.
+//
+// Once both sides are done the GPU part is read back and merged into the
+// full state, which goes into the Sim's state ring for drawing, and the split
+// moves towards where both would have taken equally long.
+//
+// Needs Sim, CpuSph and simDefines() from final.cc.
+
+#define COSIM_BINS 256         // histogram over x for placing the split
+#define COSIM_SPLIT_RATE 0.25f // share of the way to the balanced split per step
+#define COSIM_MIN_SHARE 0.02f  // neither side ever runs out of particles
+#define COSIM_MAX_GHOSTS 0.6f  // per particle, above this --headless --cosim fails
+#define COSIM_GHOST_CHECK_STEPS 50 // the initial block is narrower than the halo until it spreads
+#define COSIM_MAX_ERROR 1e-4f  // velocity error per unit of the largest change, likewise
+
+struct CoSim {
+	SimParams params; // the Sim's, but particle_count is what the GPU steps
+	Buffer<GL_UNIFORM_BUFFER> params_buf;
+	GpuScope scope;
+	Buffer<GL_SHADER_STORAGE_BUFFER> gpu_in;      // GPU owned, then ghosts
+	Buffer<GL_SHADER_STORAGE_BUFFER> gpu_density; // density pass output
+	Buffer<GL_SHADER_STORAGE_BUFFER> gpu_out;
+
+	u32 params_res;
+	u32 in_res;
+	u32 density_res;
+	u32 out_res;
+
+	SphParticle* all;     // merged state, by particle id
+	SphParticle* staging; // what goes to and comes back from the GPU
+	u32* cpu_ids;         // of the owned particles, per side
+	u32* gpu_ids;
+	u32 cpu_owned, gpu_owned;
+	u32 cpu_ghosts, gpu_ghosts;
+	CpuSph cpu; // owned, then ghosts
+
+	f32 split;     // along x, the CPU has everything below
+	f32 cpu_share; // of the particles, smoothed
+	f64 cpu_ms, gpu_ms; // last finished step
+
+	bool in_flight;
+	Job* cpu_job;
+	GLsync fence;
+	GLuint queries[2]; // timestamps around the GPU passes
+	u64 steps;
+
+	static CoSim make(FrameGraph& fg, SphParticle* init, const SimParams& p) {
+		CoSim co = {};
+		co.params = p;
+		co.params_buf = Buffer<GL_UNIFORM_BUFFER>::make(&co.params, sizeof(co.params));
+
+		co.scope = gpu_arena.pushScope();
+		co.gpu_in      = Buffer<GL_SHADER_STORAGE_BUFFER>::make(init, sizeof(SphParticle) * PARTICLE_COUNT);
+		co.gpu_density = Buffer<GL_SHADER_STORAGE_BUFFER>::make(init, sizeof(SphParticle) * PARTICLE_COUNT);
+		co.gpu_out     = Buffer<GL_SHADER_STORAGE_BUFFER>::make(init, sizeof(SphParticle) * PARTICLE_COUNT);
+
+		co.params_res  = fg.addBuffer("cosim_params", co.params_buf.range());
+		co.in_res      = fg.addBuffer("cosim_in", co.gpu_in.range());
+		co.density_res = fg.addBuffer("cosim_density", co.gpu_density.range());
+		co.out_res     = fg.addBuffer("cosim_out", co.gpu_out.range());
+
+		co.all     = (SphParticle*)calloc(PARTICLE_COUNT, sizeof(SphParticle));
+		co.staging = (SphParticle*)calloc(PARTICLE_COUNT, sizeof(SphParticle));
+		co.cpu_ids = (u32*)calloc(PARTICLE_COUNT, sizeof(u32));
+		co.gpu_ids = (u32*)calloc(PARTICLE_COUNT, sizeof(u32));
+		memcpy(co.all, init, sizeof(SphParticle) * PARTICLE_COUNT);
+		co.cpu = CpuSph::make(PARTICLE_COUNT);
+
+		co.cpu_share = 0.5f;
+		co.split = co.splitAt(co.cpu_share);
+		GL(glGenQueries(2, co.queries));
+		return co;
+	}
+
+	// x below which share of the particles are
+	f32 splitAt(f32 share) {
+		const f32 box = params.bbox_size.x;
+		u32 hist[COSIM_BINS] = {};
+		for (u32 i = 0; i < PARTICLE_COUNT; ++i)
+			hist[clamp((i32)(all[i].pos.x / box * COSIM_BINS), 0, COSIM_BINS - 1)]++;
+
+		const f32 want = share * PARTICLE_COUNT;
+		f32 below = 0.0f;
+		for (u32 b = 0; b < COSIM_BINS; ++b) {
+			if (below + hist[b] >= want)
+				return box * (b + (want - below) / max(hist[b], 1u)) / COSIM_BINS;
+			below += hist[b];
+		}
+		return box;
+	}
+
+	void cpuPut(u32 i, const SphParticle& p) {
+		for (u32 k = 0; k < 3; ++k) {
+			cpu.pos[k][i] = (&p.pos.x)[k];
+			cpu.vel[k][i] = (&p.vel.x)[k];
+		}
+		cpu.density[i] = p.density;
+	}
+
+	// Along x, where p's predicted positions can be during this step, with
+	// the side being filled below the split: the GPU's is mirrored.
+	void span(const SphParticle& p, bool to_cpu, f32* lo, f32* hi) {
+		const f32 dt = max(CPU_SPH_DENSITY_DT, CPU_SPH_FORCE_DT);
+		const f32 x = to_cpu ? p.pos.x : params.bbox_size.x - p.pos.x;
+		const f32 to = x + (to_cpu ? p.vel.x : -p.vel.x) * dt;
+		*lo = min(x, to);
+		*hi = max(x, to);
+	}
+
+	// Ghosts for one side: the other side's particles whose span comes within
+	// a kernel radius of an owned particle's (layer 1) or of a layer 1 ghost's
+	// (layer 2). near is how far up the owned side, then layer 1, reaches;
+	// far how far down, for the other side's particles across a periodic wrap.
+	void addGhosts(bool to_cpu, bool periodic_x) {
+		const f32 r = params.sph_radius;
+		const f32 box = params.bbox_size.x;
+		const u32* own = to_cpu ? cpu_ids : gpu_ids;
+		const u32* other = to_cpu ? gpu_ids : cpu_ids;
+		const u32 num_own = to_cpu ? cpu_owned : gpu_owned;
+		const u32 num_other = to_cpu ? gpu_owned : cpu_owned;
+
+		f32 near = -1e30f, far = 1e30f;
+		for (u32 j = 0; j < num_own; ++j) {
+			f32 lo, hi;
+			span(all[own[j]], to_cpu, &lo, &hi);
+			near = max(near, hi);
+			far = min(far, lo);
+		}
+		f32 layer_near = near, layer_far = far;
+		for (u32 j = 0; j < num_other; ++j) {
+			f32 lo, hi;
+			span(all[other[j]], to_cpu, &lo, &hi);
+			if (lo < near + r) layer_near = max(layer_near, hi);
+			if (periodic_x && hi - box > far - r) layer_far = min(layer_far, lo - box);
+		}
+		for (u32 j = 0; j < num_other; ++j) {
+			const SphParticle& p = all[other[j]];
+			f32 lo, hi;
+			span(p, to_cpu, &lo, &hi);
+			if (!(lo < layer_near + r) && !(periodic_x && hi - box > layer_far - r)) continue;
+			if (to_cpu)
+				cpuPut(cpu_owned + cpu_ghosts++, p);
+			else
+				staging[gpu_owned + gpu_ghosts++] = p;
+		}
+	}
+
+	// Owned particles first on both sides, then the other side's ghosts.
+	void partition(bool periodic_x) {
+		cpu_owned = gpu_owned = 0;
+		for (u32 i = 0; i < PARTICLE_COUNT; ++i) {
+			if (all[i].pos.x < split)
+				cpu_ids[cpu_owned++] = i;
+			else
+				gpu_ids[gpu_owned++] = i;
+		}
+		for (u32 j = 0; j < cpu_owned; ++j)
+			cpuPut(j, all[cpu_ids[j]]);
+		for (u32 j = 0; j < gpu_owned; ++j)
+			staging[j] = all[gpu_ids[j]];
+
+		cpu_ghosts = gpu_ghosts = 0;
+		addGhosts(true, periodic_x);
+		addGhosts(false, periodic_x);
+		cpu.count = cpu_owned + cpu_ghosts;
+	}
+
+	// the split goes where both sides would take equally long, assuming
+	// each keeps its particles per ms of this step; ghosts cost the same
+	// as owned particles, so they count
+	void rebalance() {
+		if (cpu_ms <= 0.0 || gpu_ms <= 0.0) return;
+		const f64 cpu_rate = (cpu_owned + cpu_ghosts) / cpu_ms;
+		const f64 gpu_rate = (gpu_owned + gpu_ghosts) / gpu_ms;
+		const f32 target = clamp((f32)(cpu_rate / max(cpu_rate + gpu_rate, 1e-9)),
+														 COSIM_MIN_SHARE, 1.0f - COSIM_MIN_SHARE);
+		cpu_share += COSIM_SPLIT_RATE * (target - cpu_share);
+		split = splitAt(cpu_share);
+	}
+
+	// never blocks
+	bool ready() {
+		if (!in_flight) return true;
+		if (!jobs.done(cpu_job)) return false;
+		const GLenum res = glClientWaitSync(fence, 0, 0);
+		return res == GL_ALREADY_SIGNALED || res == GL_CONDITION_SATISFIED;
+	}
+
+	// for batch runs, nothing else to do meanwhile
+	void wait() {
+		if (!in_flight) return;
+		jobs.wait(cpu_job);
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	}
+
+	// Only once ready(). Merges the last step into sim's next ring slot,
+	// splits the state again and starts the next step on both sides.
+	void addStepPasses(FrameGraph& fg, Sim* sim, Shader* density, Shader* force, bool push, Vec3 push_at) {
+		assert(ready());
+		const u32 slot = sim->ring.next();
+		CoSim* c = this;
+
+		fg.addPass("cosim exchange", [=]() {
+			if (c->in_flight) {
+				c->gpu_out.read(c->staging);
+				for (u32 j = 0; j < c->gpu_owned; ++j)
+					c->all[c->gpu_ids[j]] = c->staging[j];
+				for (u32 j = 0; j < c->cpu_owned; ++j) {
+					SphParticle& p = c->all[c->cpu_ids[j]];
+					p.pos = v3(c->cpu.pos[0][j], c->cpu.pos[1][j], c->cpu.pos[2][j]);
+					p.vel = v3(c->cpu.vel[0][j], c->cpu.vel[1][j], c->cpu.vel[2][j]);
+					p.density = c->cpu.density[j];
+					p.interior = 0.0f; // CpuSph doesn't classify, draw it
+				}
+
+				GLuint64 begin = 0, end = 0;
+				GL(glGetQueryObjectui64v(c->queries[0], GL_QUERY_RESULT, &begin));
+				GL(glGetQueryObjectui64v(c->queries[1], GL_QUERY_RESULT, &end));
+				c->gpu_ms = (end - begin) / 1e6;
+				glDeleteSync(c->fence);
+				c->in_flight = false;
+				c->steps++;
+				c->rebalance();
+
+				sim->ring.slots[slot].write(c->all);
+				sim->ring.advance();
+			}
+
+			if (push) pushParticles(c->all, push_at);
+			const bool periodic[3] = { config._periodic[0], config._periodic[1], config._periodic[2] };
+			c->params = sim->params;
+			c->split = min(c->split, c->params.bbox_size.x);
+			c->partition(periodic[0]);
+			c->params.particle_count = c->gpu_owned + c->gpu_ghosts;
+			c->params_buf.write(&c->params);
+			c->gpu_in.write(c->staging);
+
+			const SimParams p = sim->params;
+			c->cpu_job = jobs.create([c, p, periodic]() {
+				const u64 t0 = jobNowNs();
+				c->cpu.step(p, periodic);
+				c->cpu_ms = (jobNowNs() - t0) / 1e6;
+			});
+			jobs.run(c->cpu_job);
+			c->in_flight = true;
+		})
+		.access(out_res, FG_CPU_READ, 0)
+		.access(sim->state_res[slot], FG_CPU_WRITE, 0)
+		.access(params_res, FG_CPU_WRITE, 0)
+		.access(in_res, FG_CPU_WRITE, 0);
+
+		fg.addPass("cosim density", [=]() {
+			GL(glQueryCounter(c->queries[0], GL_TIMESTAMP));
+			density->execute((c->params.particle_count + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(in_res, FG_SSBO_READ, 0)
+		.writes(density_res, 1);
+
+		fg.addPass("cosim force", [=]() {
+			force->execute((c->params.particle_count + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+			GL(glQueryCounter(c->queries[1], GL_TIMESTAMP));
+			c->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(density_res, FG_SSBO_READ, 0)
+		.writes(out_res, 1);
+	}
+
+	// After wait(): the largest velocity difference between the step in
+	// flight and reference, the same step from all on a single solver
+	f32 velocityError(const SphParticle* reference) {
+		GL(glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT));
+		gpu_out.read(staging);
+		f32 err = 0.0f;
+		for (u32 j = 0; j < cpu_owned; ++j) {
+			const Vec3 v = v3(cpu.vel[0][j], cpu.vel[1][j], cpu.vel[2][j]);
+			err = max(err, length(v - reference[cpu_ids[j]].vel));
+		}
+		for (u32 j = 0; j < gpu_owned; ++j)
+			err = max(err, length(staging[j].vel - reference[gpu_ids[j]].vel));
+		return err;
+	}
+
+	void destroy() {
+		wait();
+		if (in_flight) glDeleteSync(fence);
+		GL(glDeleteQueries(2, queries));
+		cpu.destroy();
+		free(all);
+		free(staging);
+		free(cpu_ids);
+		free(gpu_ids);
+		gpu_out.destroy();
+		gpu_density.destroy();
+		gpu_in.destroy();
+		gpu_arena.popScope(scope);
+		params_buf.destroy();
+	}
+};
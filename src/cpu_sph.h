@@ -0,0 +1,295 @@
+#pragma once
+
+// CPU mirror of compute-density.glsl + compute.glsl, for machines without
+// compute shaders. Same kernels, pressure and boundary handling (see
+// sph.glsl), but neighbours come from a uniform cell grid instead of a loop
+// over every particle: cells are at least a kernel radius wide, so the 3x3x3
+// block around a particle's cell holds everything the kernel can reach.
+// State is SoA, both passes run in parallel over cells on the job system, and
+// the pair loops go through the widest SIMD kernels the CPU has (maths.h).
+//
+// Needs SphParticle, SimParams and PARTICLE_COUNT from final.cc.
+
+#include "jobs.h"
+
+// must match the DTs in compute-density.glsl and compute.glsl
+#define CPU_SPH_DENSITY_DT (1.0f / 120.0f)
+#define CPU_SPH_FORCE_DT   (1.0f / 60.0f)
+
+#define CPU_SPH_MAX_CELLS (1u << 20)
+#define CPU_SPH_CELL_GRAIN 16 // cells per parallelFor chunk
+
+struct CpuSph {
+	u32 count; // may be lowered below what make() allocated
+
+	f32* pos[3];
+	f32* vel[3];
+	f32* density;
+
+	// cell grid over the predicted positions of the pass being run
+	u32 dims[3];
+	f32 inv_cell[3];
+	u32 num_cells;
+	u32 cell_cap;
+	u32* cell_start;   // num_cells + 1 offsets into sorted
+	u32* cell_cursor;
+	u32* cell_of;      // per particle
+	u32* sorted;       // particle ids in cell order
+	f32* unsorted[3];  // predicted positions by particle id
+	f32* pred[3];      // predicted positions in cell order
+	f32* pred_density; // density in cell order
+
+	SimParams params;
+	bool periodic[3];
+	SphKernelParams kernel_params;
+	const SimdKernels* simd;
+
+	static CpuSph make(u32 count) {
+		CpuSph sim = {};
+		sim.count = count;
+		sim.simd = simdKernels(simdBestIsa());
+		for (u32 k = 0; k < 3; ++k) {
+			sim.pos[k]      = (f32*)calloc(count, sizeof(f32));
+			sim.vel[k]      = (f32*)calloc(count, sizeof(f32));
+			sim.unsorted[k] = (f32*)calloc(count, sizeof(f32));
+			sim.pred[k]     = (f32*)calloc(count, sizeof(f32));
+		}
+		sim.density      = (f32*)calloc(count, sizeof(f32));
+		sim.pred_density = (f32*)calloc(count, sizeof(f32));
+		sim.cell_of      = (u32*)calloc(count, sizeof(u32));
+		sim.sorted       = (u32*)calloc(count, sizeof(u32));
+		return sim;
+	}
+
+	void load(const SphParticle* particles) {
+		for (u32 i = 0; i < count; ++i) {
+			pos[0][i] = particles[i].pos.x;
+			pos[1][i] = particles[i].pos.y;
+			pos[2][i] = particles[i].pos.z;
+			vel[0][i] = particles[i].vel.x;
+			vel[1][i] = particles[i].vel.y;
+			vel[2][i] = particles[i].vel.z;
+			density[i] = particles[i].density;
+		}
+	}
+
+	void store(SphParticle* particles) {
+		for (u32 i = 0; i < count; ++i) {
+			particles[i].pos = v3(pos[0][i], pos[1][i], pos[2][i]);
+			particles[i].vel = v3(vel[0][i], vel[1][i], vel[2][i]);
+			particles[i].density = density[i];
+		}
+	}
+
+	u32 cellCoord(u32 axis, f32 x) {
+		const i32 n = dims[axis];
+		f32 f = floorf(x * inv_cell[axis]);
+		f = f > -1e9f ? min(f, 1e9f) : -1e9f; // keeps the cast defined, NaN included
+		i32 c = (i32)f;
+		if (periodic[axis]) return (u32)(((c % n) + n) % n);
+		return (u32)clamp(c, 0, n - 1);
+	}
+
+	// neighbouring cell coords along one axis, each listed once
+	u32 axisNeighbours(u32 axis, u32 c, u32* out) {
+		const u32 n = dims[axis];
+		if (periodic[axis]) {
+			if (n < 3) {
+				for (u32 i = 0; i < n; ++i) out[i] = i;
+				return n;
+			}
+			out[0] = (c + n - 1) % n;
+			out[1] = c;
+			out[2] = (c + 1) % n;
+			return 3;
+		}
+		u32 k = 0;
+		if (c > 0) out[k++] = c - 1;
+		out[k++] = c;
+		if (c + 1 < n) out[k++] = c + 1;
+		return k;
+	}
+
+	// Predicts positions dt ahead (like the shaders do) and buckets them.
+	// Particles outside a non-periodic box go to the edge cells, which only
+	// ever merges neighbours, never separates them.
+	void buildGrid(f32 dt) {
+		num_cells = 1;
+		for (u32 k = 0; k < 3; ++k) {
+			const f32 box = (&params.bbox_size.x)[k];
+			dims[k] = max(1u, (u32)(box / params.sph_radius));
+		}
+		while ((u64)dims[0] * dims[1] * dims[2] > CPU_SPH_MAX_CELLS)
+			for (u32 k = 0; k < 3; ++k) dims[k] = max(1u, dims[k] / 2);
+		for (u32 k = 0; k < 3; ++k) {
+			inv_cell[k] = dims[k] / (&params.bbox_size.x)[k];
+			num_cells *= dims[k];
+		}
+
+		if (num_cells > cell_cap) {
+			cell_cap = num_cells;
+			cell_start  = (u32*)realloc(cell_start, (cell_cap + 1) * sizeof(u32));
+			cell_cursor = (u32*)realloc(cell_cursor, cell_cap * sizeof(u32));
+		}
+
+		jobs.parallelFor(count, 1024, [&](u32 begin, u32 end) {
+			for (u32 i = begin; i < end; ++i) {
+				u32 c[3];
+				for (u32 k = 0; k < 3; ++k) {
+					unsorted[k][i] = pos[k][i] + vel[k][i] * dt;
+					c[k] = cellCoord(k, unsorted[k][i]);
+				}
+				cell_of[i] = (c[2] * dims[1] + c[1]) * dims[0] + c[0];
+			}
+		});
+
+		// counting sort, serial but O(particles + cells)
+		memset(cell_start, 0, (num_cells + 1) * sizeof(u32));
+		for (u32 i = 0; i < count; ++i)
+			cell_start[cell_of[i] + 1]++;
+		for (u32 c = 0; c < num_cells; ++c) {
+			cell_start[c + 1] += cell_start[c];
+			cell_cursor[c] = cell_start[c];
+		}
+		for (u32 i = 0; i < count; ++i)
+			sorted[cell_cursor[cell_of[i]]++] = i;
+
+		jobs.parallelFor(count, 1024, [&](u32 begin, u32 end) {
+			for (u32 s = begin; s < end; ++s) {
+				const u32 i = sorted[s];
+				for (u32 k = 0; k < 3; ++k)
+					pred[k][s] = unsorted[k][i];
+				pred_density[s] = density[i];
+			}
+		});
+	}
+
+	// the up to 27 cells around cell, each listed once
+	u32 neighbourCells(u32 cell, u32* out) {
+		const u32 cx = cell % dims[0];
+		const u32 cy = (cell / dims[0]) % dims[1];
+		const u32 cz = cell / (dims[0] * dims[1]);
+		u32 nx[3], ny[3], nz[3];
+		const u32 kx = axisNeighbours(0, cx, nx);
+		const u32 ky = axisNeighbours(1, cy, ny);
+		const u32 kz = axisNeighbours(2, cz, nz);
+
+		u32 n = 0;
+		for (u32 z = 0; z < kz; ++z)
+			for (u32 y = 0; y < ky; ++y)
+				for (u32 x = 0; x < kx; ++x)
+					out[n++] = (nz[z] * dims[1] + ny[y]) * dims[0] + nx[x];
+		return n;
+	}
+
+	// compute-density.glsl
+	void densityPass() {
+		buildGrid(CPU_SPH_DENSITY_DT);
+		jobs.parallelFor(num_cells, CPU_SPH_CELL_GRAIN, [&](u32 begin, u32 end) {
+			u32 cells[27];
+			for (u32 cell = begin; cell < end; ++cell) {
+				if (cell_start[cell] == cell_start[cell + 1]) continue;
+				const u32 num = neighbourCells(cell, cells);
+
+				for (u32 s = cell_start[cell]; s < cell_start[cell + 1]; ++s) {
+					const f32 q[3] = { pred[0][s], pred[1][s], pred[2][s] };
+					f32 sum = 0.0f;
+					for (u32 c = 0; c < num; ++c)
+						sum += simd->sphDensityRow(kernel_params, pred, cell_start[cells[c]], cell_start[cells[c] + 1], q);
+					density[sorted[s]] = sum;
+				}
+			}
+		});
+	}
+
+	// compute.glsl
+	void forcePass() {
+		const f32 dt = CPU_SPH_FORCE_DT;
+		buildGrid(dt);
+		jobs.parallelFor(num_cells, CPU_SPH_CELL_GRAIN, [&](u32 begin, u32 end) {
+			u32 cells[27];
+			for (u32 cell = begin; cell < end; ++cell) {
+				if (cell_start[cell] == cell_start[cell + 1]) continue;
+				const u32 num = neighbourCells(cell, cells);
+
+				for (u32 s = cell_start[cell]; s < cell_start[cell + 1]; ++s) {
+					const f32 q[3] = { pred[0][s], pred[1][s], pred[2][s] };
+					const f32 pres = (pred_density[s] - params.target_density) * params.pressure_mul;
+					f32 f[3] = {};
+					for (u32 c = 0; c < num; ++c) {
+						const u32 begin = cell_start[cells[c]];
+						const u32 end = cell_start[cells[c] + 1];
+						if (s >= begin && s < end) { // skip s itself
+							simd->sphForceRow(kernel_params, pred, pred_density, begin, s, q, pres, f);
+							simd->sphForceRow(kernel_params, pred, pred_density, s + 1, end, q, pres, f);
+						} else {
+							simd->sphForceRow(kernel_params, pred, pred_density, begin, end, q, pres, f);
+						}
+					}
+					integrate(sorted[s], pred_density[s], f, dt);
+				}
+			}
+		});
+	}
+
+	void integrate(u32 i, f32 d, const f32* f, f32 dt) {
+		for (u32 k = 0; k < 3; ++k)
+			vel[k][i] += f[k] / d * dt;
+		vel[1][i] += -10.0f * dt;
+
+		for (u32 k = 0; k < 3; ++k) {
+			const f32 box = (&params.bbox_size.x)[k];
+			if (!periodic[k]) {
+				if (pos[k][i] < 0.0f) {
+					pos[k][i] = 0.0f;
+					vel[k][i] = fabsf(vel[k][i]) * 0.5f;
+				}
+				if (pos[k][i] > box) {
+					pos[k][i] = box;
+					vel[k][i] = -fabsf(vel[k][i]) * 0.5f;
+				}
+			}
+			pos[k][i] += vel[k][i] * dt;
+			if (periodic[k]) // GLSL mod(), not fmodf
+				pos[k][i] -= box * floorf(pos[k][i] / box);
+		}
+	}
+
+	void setParams(const SimParams& p, const bool* periodic_axes) {
+		params = p;
+		for (u32 k = 0; k < 3; ++k) periodic[k] = periodic_axes[k];
+
+		kernel_params = {};
+		kernel_params.radius = p.sph_radius;
+		kernel_params.norm = p.kernel_norm;
+		kernel_params.der_norm = p.kernel_der_norm;
+		kernel_params.mass = p.sph_mass;
+		kernel_params.target_density = p.target_density;
+		kernel_params.pressure_mul = p.pressure_mul;
+		for (u32 k = 0; k < 3; ++k) {
+			kernel_params.box[k] = (&p.bbox_size.x)[k];
+			kernel_params.periodic[k] = periodic[k];
+		}
+	}
+
+	void step(const SimParams& p, const bool* periodic_axes) {
+		setParams(p, periodic_axes);
+		densityPass();
+		forcePass();
+	}
+
+	void destroy() {
+		for (u32 k = 0; k < 3; ++k) {
+			free(pos[k]);
+			free(vel[k]);
+			free(unsorted[k]);
+			free(pred[k]);
+		}
+		free(density);
+		free(pred_density);
+		free(cell_of);
+		free(sorted);
+		free(cell_start);
+		free(cell_cursor);
+	}
+};
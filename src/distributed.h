@@ -0,0 +1,919 @@
+#pragma once
+
+// Distributed CPU solver. The box is cut into slabs along x, one process
+// (rank) per slab, each running its own CpuSph. Every step each rank
+//  1. hands particles that left its slab to the neighbour they moved into
+//  2. tells its neighbours its particle count, slab and fastest particle
+//  3. sends the particles within a halo of each edge to that neighbour,
+//     which simulates them as ghosts
+//  4. runs the density pass, then sends the densities of the particles it
+//     sent in 3, so its neighbours' ghosts are right for the force pass
+//  5. runs the force pass and drops its ghosts
+// Every DIST_BALANCE_INTERVAL steps, after 5., the two ranks sharing a slab
+// boundary both move it towards the side with fewer particles, from the same numbers,
+// so they agree without a coordinator. The boundary across the periodic wrap
+// stays put. With a periodic x and two ranks both links lead to the same
+// rank, which then gets every ghost only once, whichever edge it is near.
+//
+// --check runs a few steps on slabs two kernel radii wide, then compares
+// every particle against the same steps in a single CpuSph.
+//
+// Neighbours talk over Links: shared memory rings between processes forked
+// on one machine, or TCP (between hosts, or over localhost for testing).
+// All traffic goes through exchange(), which moves both directions at once,
+// so no pair can deadlock whatever the message sizes.
+//
+// POSIX only. Needs CpuSph, config, buildSimParams and initParticles from
+// final.cc.
+
+#if defined(__unix__)
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#endif
+
+#define DIST_LEFT  0
+#define DIST_RIGHT 1
+#define DIST_MAX_RANKS 64
+#define DIST_PORT 47000
+#define DIST_BALANCE_INTERVAL 10
+#define DIST_BALANCE_RATE 0.5f // share of the imbalance fixed per balancing step
+#define DIST_CHECK_STEPS 10
+#define DIST_CHECK_TOLERANCE 1e-3f // largest velocity error, per unit of the largest velocity change
+#define SHM_RING_SIZE (1u << 20)
+
+enum DistTransport {
+	DIST_SHM,
+	DIST_TCP,
+};
+
+struct DistOptions {
+	u32 ranks;           // local ranks to fork, 0 = no distributed run
+	i32 rank;            // >= 0: just this rank, one of hosts
+	const char* hosts;   // comma separated, one per rank
+	u16 port;            // rank r listens on port + r
+	DistTransport transport;
+	u32 steps;
+	bool scaling;        // strong and weak scaling tables instead of one run
+	bool check;          // compare against one CpuSph instead of timing
+};
+
+DistOptions defaultDistOptions() {
+	DistOptions o = {};
+	o.rank = -1;
+	o.port = DIST_PORT;
+	o.transport = DIST_SHM;
+	o.steps = 100;
+	return o;
+}
+
+bool distRequested(const DistOptions& o) {
+	return o.ranks || o.hosts || o.scaling || o.check;
+}
+
+// one distributed command line flag at argv[*i], false if it isn't one
+bool parseDistArg(int argc, char** argv, int* i, DistOptions* o) {
+	const char* arg = argv[*i];
+	const bool has_value = *i + 1 < argc;
+	if (!strcmp(arg, "--ranks") && has_value) {
+		o->ranks = clamp(atoi(argv[++*i]), 1, DIST_MAX_RANKS);
+	} else if (!strcmp(arg, "--rank") && has_value) {
+		o->rank = atoi(argv[++*i]);
+	} else if (!strcmp(arg, "--hosts") && has_value) {
+		o->hosts = argv[++*i];
+		o->transport = DIST_TCP;
+	} else if (!strcmp(arg, "--port") && has_value) {
+		o->port = (u16)atoi(argv[++*i]);
+	} else if (!strcmp(arg, "--transport") && has_value) {
+		o->transport = !strcmp(argv[++*i], "tcp") ? DIST_TCP : DIST_SHM;
+	} else if (!strcmp(arg, "--steps") && has_value) {
+		o->steps = (u32)atoi(argv[++*i]);
+	} else if (!strcmp(arg, "--scaling")) {
+		o->scaling = true;
+	} else if (!strcmp(arg, "--check")) {
+		o->check = true;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+#if defined(__unix__)
+
+// growable message buffer, read back front to back with get()
+struct Bytes {
+	u8* data;
+	u64 size;
+	u64 cap;
+	u64 at;
+
+	u8* push(u64 n) {
+		if (size + n > cap) {
+			cap = max<u64>(max<u64>(cap * 2, size + n), 4096);
+			data = (u8*)realloc(data, cap);
+		}
+		u8* p = data + size;
+		size += n;
+		return p;
+	}
+
+	template<typename T>
+	void put(const T& v) {
+		memcpy(push(sizeof(T)), &v, sizeof(T));
+	}
+
+	template<typename T>
+	T get() {
+		T v;
+		assert(at + sizeof(T) <= size);
+		memcpy(&v, data + at, sizeof(T));
+		at += sizeof(T);
+		return v;
+	}
+
+	void clear() {
+		size = 0;
+		at = 0;
+	}
+
+	void destroy() {
+		free(data);
+		*this = {};
+	}
+};
+
+// single producer, single consumer byte ring in memory shared between two
+// processes
+struct ShmRing {
+	std::atomic<u64> head; // bytes written, moved by the sender
+	std::atomic<u64> tail; // bytes read, moved by the receiver
+	u8 data[SHM_RING_SIZE];
+};
+
+// One end of a connection to a neighbouring rank. Both calls are
+// non-blocking and return the bytes moved, or -1 once the peer is gone.
+struct Link {
+	i64 (*trySend)(Link* link, const u8* data, u64 size);
+	i64 (*tryRecv)(Link* link, u8* data, u64 size);
+
+	ShmRing* tx; // shm
+	ShmRing* rx;
+	int fd;      // tcp
+};
+
+i64 shmSend(Link* link, const u8* data, u64 size) {
+	ShmRing* r = link->tx;
+	const u64 head = r->head.load(std::memory_order_relaxed);
+	const u64 n = min<u64>(size, SHM_RING_SIZE - (head - r->tail.load(std::memory_order_acquire)));
+	const u64 at = head % SHM_RING_SIZE;
+	const u64 first = min<u64>(n, SHM_RING_SIZE - at);
+	memcpy(r->data + at, data, first);
+	memcpy(r->data, data + first, n - first);
+	r->head.store(head + n, std::memory_order_release);
+	return n;
+}
+
+i64 shmRecv(Link* link, u8* data, u64 size) {
+	ShmRing* r = link->rx;
+	const u64 tail = r->tail.load(std::memory_order_relaxed);
+	const u64 n = min<u64>(size, r->head.load(std::memory_order_acquire) - tail);
+	const u64 at = tail % SHM_RING_SIZE;
+	const u64 first = min<u64>(n, SHM_RING_SIZE - at);
+	memcpy(data, r->data + at, first);
+	memcpy(data + first, r->data, n - first);
+	r->tail.store(tail + n, std::memory_order_release);
+	return n;
+}
+
+Link shmLink(ShmRing* tx, ShmRing* rx) {
+	Link link = {};
+	link.trySend = shmSend;
+	link.tryRecv = shmRecv;
+	link.tx = tx;
+	link.rx = rx;
+	link.fd = -1;
+	return link;
+}
+
+i64 tcpSend(Link* link, const u8* data, u64 size) {
+	const ssize_t n = send(link->fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n >= 0) return n;
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+}
+
+i64 tcpRecv(Link* link, u8* data, u64 size) {
+	const ssize_t n = recv(link->fd, data, size, MSG_DONTWAIT);
+	if (n > 0) return n;
+	if (n == 0) return -1; // closed
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+}
+
+Link tcpLink(int fd) {
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	Link link = {};
+	link.trySend = tcpSend;
+	link.tryRecv = tcpRecv;
+	link.fd = fd;
+	return link;
+}
+
+int tcpListen(u16 port) {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+		printf("Can't listen on port %u: %s\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// retries for a while, the peer may not be listening yet
+int tcpConnect(const char* host, u16 port) {
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	for (u32 attempt = 0; attempt < 300; ++attempt) {
+		addrinfo* res = NULL;
+		if (getaddrinfo(host, service, &hints, &res) == 0) {
+			for (addrinfo* a = res; a; a = a->ai_next) {
+				const int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+				if (fd < 0) continue;
+				if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+					freeaddrinfo(res);
+					return fd;
+				}
+				close(fd);
+			}
+			freeaddrinfo(res);
+		}
+		usleep(100 * 1000);
+	}
+	printf("Can't connect to %s:%u\n", host, port);
+	return -1;
+}
+
+// Sends out[d] over links[d] and fills in[d] from it, both directions at
+// once. Messages are a u64 size (host byte order) and the payload. NULL
+// links are skipped. False if a peer went away.
+bool exchange(Link** links, Bytes* out, Bytes* in) {
+	u64 sent[2] = {};
+	u64 got[2] = {};
+	u64 in_size[2] = {};
+	u8 header[2][8];
+
+	for (;;) {
+		bool done = true;
+		bool progress = false;
+		for (u32 d = 0; d < 2; ++d) {
+			Link* link = links[d];
+			if (!link) continue;
+
+			const u64 size = out[d].size;
+			if (sent[d] < 8 + size) {
+				const i64 n = sent[d] < 8
+					? link->trySend(link, (const u8*)&size + sent[d], 8 - sent[d])
+					: link->trySend(link, out[d].data + sent[d] - 8, size - (sent[d] - 8));
+				if (n < 0) return false;
+				sent[d] += n;
+				progress |= n > 0;
+				done &= sent[d] == 8 + size;
+			}
+
+			if (got[d] < 8) {
+				const i64 n = link->tryRecv(link, header[d] + got[d], 8 - got[d]);
+				if (n < 0) return false;
+				got[d] += n;
+				progress |= n > 0;
+				if (got[d] == 8) {
+					memcpy(&in_size[d], header[d], 8);
+					in[d].clear();
+					in[d].push(in_size[d]);
+				}
+			}
+			if (got[d] >= 8 && got[d] - 8 < in_size[d]) {
+				const i64 n = link->tryRecv(link, in[d].data + got[d] - 8, in_size[d] - (got[d] - 8));
+				if (n < 0) return false;
+				got[d] += n;
+				progress |= n > 0;
+			}
+			done &= got[d] >= 8 && got[d] - 8 == in_size[d];
+		}
+		if (done) return true;
+		if (!progress) sched_yield();
+	}
+}
+
+struct DistRun {
+	u32 ranks;
+	u32 particles; // in total
+	Vec3 box;
+	Vec3 extent;   // the initial particles fill [0, extent)
+	u32 steps;
+	u32 threads;   // job system threads per rank
+};
+
+// what each rank reports back
+struct DistResult {
+	bool ok;
+	u32 threads;
+	f32 lo, hi; // final slab
+	u32 min_owned, max_owned, owned;
+	f64 step_ms; // per step
+	f64 comm_ms; // per step, waiting in exchange() included
+};
+
+// sent to both neighbours after migration, see balance()
+struct DistStatus {
+	u32 owned;
+	f32 lo, hi;
+	f32 vmax; // fastest particle along x
+};
+
+struct DistRank {
+	u32 rank;
+	u32 ranks;
+	SimParams params;
+	bool periodic[3];
+	f32 lo, hi; // owned slab along x
+	Link* links[2]; // NULL at a wall
+
+	CpuSph cpu; // owned particles first, then ghosts
+	u32* ids;   // of the owned particles, for tracking them across ranks
+	u32 owned;
+	u32* halo[2]; // owned particles sent to each side as ghosts
+	u32 num_halo[2];
+	u32 ghost_begin[2];
+	u32 num_ghosts[2];
+	f32 vmax;             // fastest owned particle along x, this step
+	DistStatus status[2]; // the neighbours'
+
+	Bytes out[2];
+	Bytes in[2];
+
+	static DistRank make(u32 rank, const DistRun& run, Link* left, Link* right) {
+		DistRank r = {};
+		r.rank = rank;
+		r.ranks = run.ranks;
+		r.params = buildSimParams(run.box);
+		for (u32 k = 0; k < 3; ++k) r.periodic[k] = config._periodic[k];
+		r.lo = run.box.x * rank / run.ranks;
+		r.hi = run.box.x * (rank + 1) / run.ranks;
+		r.links[DIST_LEFT] = left;
+		r.links[DIST_RIGHT] = right;
+
+		// owned + ghosts can't exceed twice the total
+		r.cpu = CpuSph::make(run.particles * 2);
+		r.ids = (u32*)calloc(run.particles, sizeof(u32));
+		for (u32 d = 0; d < 2; ++d)
+			r.halo[d] = (u32*)calloc(run.particles, sizeof(u32));
+
+		// every rank makes the same initial state and keeps its slab
+		SphParticle* all = (SphParticle*)calloc(run.particles, sizeof(SphParticle));
+		srand(1);
+		initParticles(all, run.particles, run.extent);
+		for (u32 i = 0; i < run.particles; ++i) {
+			const f32 x = all[i].pos.x;
+			if (x < r.lo || (x >= r.hi && rank != run.ranks - 1)) continue;
+			r.ids[r.owned] = i;
+			r.put(r.owned++, &all[i].pos.x, &all[i].vel.x, all[i].density);
+		}
+		free(all);
+		r.cpu.count = r.owned;
+		return r;
+	}
+
+	void put(u32 i, const f32* pos, const f32* vel, f32 density) {
+		for (u32 k = 0; k < 3; ++k) {
+			cpu.pos[k][i] = pos[k];
+			cpu.vel[k][i] = vel[k];
+		}
+		cpu.density[i] = density;
+	}
+
+	void copy(u32 dst, u32 src) {
+		for (u32 k = 0; k < 3; ++k) {
+			cpu.pos[k][dst] = cpu.pos[k][src];
+			cpu.vel[k][dst] = cpu.vel[k][src];
+		}
+		cpu.density[dst] = cpu.density[src];
+		ids[dst] = ids[src];
+	}
+
+	f32 wrapX(f32 d) {
+		if (periodic[0]) d -= params.bbox_size.x * roundf(d / params.bbox_size.x);
+		return d;
+	}
+
+	// DIST_LEFT/RIGHT for a particle that left the slab, -1 if it stays
+	i32 destination(f32 x) {
+		if (x >= lo && x < hi) return -1;
+		const i32 side = wrapX(x - (lo + hi) * 0.5f) < 0.0f ? DIST_LEFT : DIST_RIGHT;
+		return links[side] ? side : -1;
+	}
+
+	// 1. particles that left go to the neighbour on that side
+	bool migrate() {
+		for (u32 d = 0; d < 2; ++d) {
+			out[d].clear();
+			out[d].put<u32>(0); // count, patched below
+		}
+		u32 count[2] = {};
+		u32 kept = 0;
+		for (u32 i = 0; i < owned; ++i) {
+			const i32 d = destination(cpu.pos[0][i]);
+			if (d < 0) {
+				copy(kept++, i);
+				continue;
+			}
+			out[d].put(ids[i]);
+			for (u32 k = 0; k < 3; ++k) out[d].put(cpu.pos[k][i]);
+			for (u32 k = 0; k < 3; ++k) out[d].put(cpu.vel[k][i]);
+			out[d].put(cpu.density[i]);
+			count[d]++;
+		}
+		for (u32 d = 0; d < 2; ++d)
+			memcpy(out[d].data, &count[d], sizeof(u32));
+		owned = kept;
+
+		if (!exchange(links, out, in)) return false;
+		for (u32 d = 0; d < 2; ++d) {
+			if (!links[d]) continue;
+			const u32 n = in[d].get<u32>();
+			for (u32 j = 0; j < n; ++j) {
+				f32 pos[3], vel[3];
+				ids[owned] = in[d].get<u32>();
+				for (u32 k = 0; k < 3; ++k) pos[k] = in[d].get<f32>();
+				for (u32 k = 0; k < 3; ++k) vel[k] = in[d].get<f32>();
+				put(owned++, pos, vel, in[d].get<f32>());
+			}
+		}
+		return true;
+	}
+
+	// 2. counts and slabs for balancing, speeds for the halo width
+	bool exchangeStatus() {
+		vmax = 0.0f;
+		for (u32 i = 0; i < owned; ++i)
+			vmax = max(vmax, fabsf(cpu.vel[0][i]));
+		const DistStatus self = { owned, lo, hi, vmax };
+		for (u32 d = 0; d < 2; ++d) {
+			out[d].clear();
+			out[d].put(self);
+		}
+		if (!exchange(links, out, in)) return false;
+		for (u32 d = 0; d < 2; ++d) {
+			status[d] = self; // walls look like a copy of this rank
+			if (links[d]) status[d] = in[d].get<DistStatus>();
+		}
+		return true;
+	}
+
+	// where the boundary between the slabs [left_lo, b) and [b, right_hi)
+	// goes; both ranks sharing it call this with the same numbers
+	f32 balancedBoundary(u32 n_left, f32 left_lo, f32 b, u32 n_right, f32 right_hi) {
+		const f32 min_width = 2.0f * params.sph_radius;
+		if (right_hi - left_lo < 2.0f * min_width) return b;
+		const f32 imbalance = ((f32)n_right - (f32)n_left) / max(n_left + n_right, 1u);
+		const f32 width = min(b - left_lo, right_hi - b);
+		return clamp(b + DIST_BALANCE_RATE * imbalance * width, left_lo + min_width, right_hi - min_width);
+	}
+
+	void balance() {
+		// the wrap-around boundary of a periodic x stays where it is
+		f32 new_lo = lo, new_hi = hi;
+		if (links[DIST_LEFT] && rank > 0)
+			new_lo = balancedBoundary(status[DIST_LEFT].owned, status[DIST_LEFT].lo, lo, owned, hi);
+		if (links[DIST_RIGHT] && rank < ranks - 1)
+			new_hi = balancedBoundary(owned, lo, hi, status[DIST_RIGHT].owned, status[DIST_RIGHT].hi);
+		lo = new_lo;
+		hi = new_hi;
+	}
+
+	// 3. owned particles near an edge become the neighbour's ghosts. A ghost
+	// matters if its position predicted dt ahead comes within a kernel radius
+	// of one of ours, so the halo grows with both sides' fastest particle.
+	bool exchangeGhosts() {
+		const f32 dt = max(CPU_SPH_DENSITY_DT, CPU_SPH_FORCE_DT);
+		f32 width[2];
+		for (u32 d = 0; d < 2; ++d) {
+			width[d] = params.sph_radius + dt * (vmax + status[d].vmax);
+			num_halo[d] = 0;
+		}
+		// two ranks around a periodic x: the same neighbour on both sides,
+		// which must not get a particle near both edges twice
+		const bool same_neighbour = ranks == 2 && links[DIST_LEFT] && links[DIST_RIGHT];
+		for (u32 i = 0; i < owned; ++i) {
+			const f32 x = cpu.pos[0][i];
+			const bool left = links[DIST_LEFT] && x - lo < width[DIST_LEFT];
+			if (left)
+				halo[DIST_LEFT][num_halo[DIST_LEFT]++] = i;
+			if (links[DIST_RIGHT] && hi - x < width[DIST_RIGHT] && !(left && same_neighbour))
+				halo[DIST_RIGHT][num_halo[DIST_RIGHT]++] = i;
+		}
+
+		for (u32 d = 0; d < 2; ++d) {
+			out[d].clear();
+			out[d].put(num_halo[d]);
+			for (u32 j = 0; j < num_halo[d]; ++j) {
+				const u32 i = halo[d][j];
+				for (u32 k = 0; k < 3; ++k) out[d].put(cpu.pos[k][i]);
+				for (u32 k = 0; k < 3; ++k) out[d].put(cpu.vel[k][i]);
+			}
+		}
+		if (!exchange(links, out, in)) return false;
+
+		u32 n = owned;
+		for (u32 d = 0; d < 2; ++d) {
+			ghost_begin[d] = n;
+			num_ghosts[d] = links[d] ? in[d].get<u32>() : 0;
+			for (u32 j = 0; j < num_ghosts[d]; ++j, ++n) {
+				f32 pos[3], vel[3];
+				for (u32 k = 0; k < 3; ++k) pos[k] = in[d].get<f32>();
+				for (u32 k = 0; k < 3; ++k) vel[k] = in[d].get<f32>();
+				put(n, pos, vel, 0.0f);
+			}
+		}
+		cpu.count = n;
+		return true;
+	}
+
+	// 4. our densities for the neighbours' copies of our halo
+	bool exchangeDensities() {
+		for (u32 d = 0; d < 2; ++d) {
+			out[d].clear();
+			for (u32 j = 0; j < num_halo[d]; ++j)
+				out[d].put(cpu.density[halo[d][j]]);
+		}
+		if (!exchange(links, out, in)) return false;
+		for (u32 d = 0; d < 2; ++d) {
+			if (!links[d]) continue;
+			assert(in[d].size == num_ghosts[d] * sizeof(f32));
+			for (u32 j = 0; j < num_ghosts[d]; ++j)
+				cpu.density[ghost_begin[d] + j] = in[d].get<f32>();
+		}
+		return true;
+	}
+
+	void destroy() {
+		cpu.destroy();
+		free(ids);
+		for (u32 d = 0; d < 2; ++d) {
+			free(halo[d]);
+			out[d].destroy();
+			in[d].destroy();
+		}
+	}
+};
+
+// gathered, if any, gets this rank's particles at the end, by id
+DistResult runRank(u32 rank, const DistRun& run, Link* left, Link* right, SphParticle* gathered) {
+	const f64 ticks_to_ms = 1000.0 / SDL_GetPerformanceFrequency();
+	DistRank r = DistRank::make(rank, run, left, right);
+
+	DistResult res = {};
+	res.ok = true;
+	res.threads = jobs.threads();
+	res.min_owned = r.owned;
+	u64 step_ticks = 0, comm_ticks = 0;
+	for (u32 step = 0; step < run.steps && res.ok; ++step) {
+		const u64 t0 = SDL_GetPerformanceCounter();
+		res.ok = r.migrate() && r.exchangeStatus() && r.exchangeGhosts();
+		const u64 t1 = SDL_GetPerformanceCounter();
+		if (res.ok) {
+			r.cpu.setParams(r.params, r.periodic);
+			r.cpu.densityPass();
+		}
+		const u64 t2 = SDL_GetPerformanceCounter();
+		res.ok = res.ok && r.exchangeDensities();
+		const u64 t3 = SDL_GetPerformanceCounter();
+		if (res.ok) r.cpu.forcePass();
+		r.cpu.count = r.owned; // ghosts were moved too, but only for nothing
+		// after the step, so the next migration puts everything in its new
+		// slab before anything goes by slab edges again
+		if (res.ok && step % DIST_BALANCE_INTERVAL == 0) r.balance();
+		const u64 t4 = SDL_GetPerformanceCounter();
+
+		step_ticks += t4 - t0;
+		comm_ticks += (t1 - t0) + (t3 - t2);
+		res.min_owned = min(res.min_owned, r.owned);
+		res.max_owned = max(res.max_owned, r.owned);
+	}
+	res.lo = r.lo;
+	res.hi = r.hi;
+	res.owned = r.owned;
+	if (gathered) {
+		for (u32 i = 0; i < r.owned; ++i) {
+			SphParticle& p = gathered[r.ids[i]];
+			p.pos = v3(r.cpu.pos[0][i], r.cpu.pos[1][i], r.cpu.pos[2][i]);
+			p.vel = v3(r.cpu.vel[0][i], r.cpu.vel[1][i], r.cpu.vel[2][i]);
+			p.density = r.cpu.density[i];
+		}
+	}
+	res.step_ms = step_ticks * ticks_to_ms / max(run.steps, 1u);
+	res.comm_ms = comm_ticks * ticks_to_ms / max(run.steps, 1u);
+	r.destroy();
+	return res;
+}
+
+// Forks one process per rank on this machine. Ranks r and r+1 (and the
+// last and first with a periodic x) are linked by a pair of shm rings, or
+// by TCP over localhost. gathered, if any, gets every particle at the end.
+bool runLocalRanks(const DistRun& run, const DistOptions& o, DistResult* results, SphParticle* gathered = NULL) {
+	const bool wrap = config._periodic[0] && run.ranks > 1;
+	const u64 results_size = (sizeof(DistResult) * DIST_MAX_RANKS + 63) & ~63ull;
+	const u64 gathered_size = gathered ? (sizeof(SphParticle) * run.particles + 63) & ~63ull : 0;
+	const u64 shm_size = results_size + gathered_size +
+											 (o.transport == DIST_SHM ? 2 * run.ranks * sizeof(ShmRing) : 0);
+	u8* shm = (u8*)mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		printf("Can't map %llu bytes of shared memory\n", (unsigned long long)shm_size);
+		return false;
+	}
+	DistResult* shared = (DistResult*)shm;
+	SphParticle* shared_particles = gathered ? (SphParticle*)(shm + results_size) : NULL;
+	ShmRing* rings = (ShmRing*)(shm + results_size + gathered_size); // 2 per edge, r -> r+1 then back
+
+	fflush(stdout);
+	pid_t pids[DIST_MAX_RANKS];
+	for (u32 r = 0; r < run.ranks; ++r) {
+		pids[r] = fork();
+		if (pids[r] != 0) continue;
+
+		// rank r from here on
+		const bool has_left = r > 0 || wrap;
+		const bool has_right = r + 1 < run.ranks || wrap;
+		const u32 left_edge = (r + run.ranks - 1) % run.ranks;
+		Link links[2] = {};
+		bool ok = true;
+		if (o.transport == DIST_SHM) {
+			if (has_left)  links[DIST_LEFT]  = shmLink(&rings[2 * left_edge + 1], &rings[2 * left_edge]);
+			if (has_right) links[DIST_RIGHT] = shmLink(&rings[2 * r], &rings[2 * r + 1]);
+		} else {
+			const int listen_fd = has_left ? tcpListen(o.port + r) : -1;
+			if (has_right) {
+				const int fd = tcpConnect("127.0.0.1", o.port + (r + 1) % run.ranks);
+				ok &= fd >= 0;
+				if (fd >= 0) links[DIST_RIGHT] = tcpLink(fd);
+			}
+			if (has_left) {
+				const int fd = listen_fd >= 0 ? accept(listen_fd, NULL, NULL) : -1;
+				ok &= fd >= 0;
+				if (fd >= 0) links[DIST_LEFT] = tcpLink(fd);
+				if (listen_fd >= 0) close(listen_fd);
+			}
+		}
+		if (ok) {
+			jobs.init(run.threads);
+			shared[r] = runRank(r, run, has_left ? &links[DIST_LEFT] : NULL,
+													has_right ? &links[DIST_RIGHT] : NULL, shared_particles);
+			jobs.destroy();
+		}
+		fflush(stdout);
+		_exit(ok && shared[r].ok ? 0 : 1);
+	}
+
+	// one failed rank leaves its neighbours waiting forever, so take them down too
+	bool ok = true;
+	for (u32 done = 0; done < run.ranks; ++done) {
+		int status = 0;
+		const pid_t pid = wait(&status);
+		if (pid < 0) break;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			if (ok) {
+				printf("A rank failed, stopping the rest\n");
+				for (u32 r = 0; r < run.ranks; ++r)
+					if (pids[r] != pid) kill(pids[r], SIGTERM);
+			}
+			ok = false;
+		}
+	}
+	memcpy(results, shared, sizeof(DistResult) * run.ranks);
+	if (gathered)
+		memcpy(gathered, shared_particles, sizeof(SphParticle) * run.particles);
+	munmap(shm, shm_size);
+	return ok;
+}
+
+// time of the run, the slowest rank's
+f64 distStepMs(const DistRun& run, const DistResult* results) {
+	f64 ms = 0;
+	for (u32 r = 0; r < run.ranks; ++r)
+		ms = max(ms, results[r].step_ms);
+	return ms;
+}
+
+void printDistResults(const DistRun& run, const char* transport, const DistResult* results) {
+	printf("%u ranks over %s, %u particles, %u steps, %u threads per rank\n",
+				 run.ranks, transport, run.particles, run.steps, results[0].threads);
+	printf("  rank  slab x             particles min / max / end   ms/step  comm ms/step\n");
+	for (u32 r = 0; r < run.ranks; ++r) {
+		const DistResult& res = results[r];
+		printf("  %4u  %6.2f .. %6.2f  %9u / %5u / %5u   %7.2f  %12.2f\n", r, res.lo, res.hi,
+					 res.min_owned, res.max_owned, res.owned, res.step_ms, res.comm_ms);
+	}
+	const f64 ms = distStepMs(run, results);
+	printf("  %.2f ms/step (slowest rank), %.1f steps/s\n", ms, 1000.0 / max(ms, 1e-3));
+}
+
+// Strong scaling: the same particles over more ranks. Weak scaling: the
+// same particles per rank, box and initial block stretched along x.
+int runScaling(DistRun base, const DistOptions& o) {
+	const char* transport = o.transport == DIST_SHM ? "shm" : "tcp";
+	const u32 max_ranks = o.ranks ? o.ranks : 4;
+	DistResult results[DIST_MAX_RANKS];
+
+	for (u32 weak = 0; weak < 2; ++weak) {
+		printf("%s scaling over %s, %u steps, %u particles%s:\n", weak ? "weak" : "strong", transport,
+					 base.steps, base.particles, weak ? " per rank" : "");
+		printf("  ranks  particles   ms/step  comm %%  %s\n", weak ? "efficiency" : "speedup  efficiency");
+		f64 single_ms = 0;
+		for (u32 ranks = 1; ranks <= max_ranks; ranks *= 2) {
+			DistRun run = base;
+			run.ranks = ranks;
+			if (weak) {
+				run.particles = base.particles * ranks;
+				run.box.x = base.box.x * ranks;
+				run.extent.x = base.extent.x * ranks;
+			}
+			if (!runLocalRanks(run, o, results)) return 1;
+
+			const f64 ms = distStepMs(run, results);
+			f64 comm = 0;
+			for (u32 r = 0; r < ranks; ++r)
+				comm = max(comm, results[r].comm_ms / max(results[r].step_ms, 1e-6));
+			if (ranks == 1) single_ms = ms;
+			if (weak)
+				printf("  %5u  %9u  %8.2f  %5.1f  %9.2f\n", ranks, run.particles, ms, comm * 100.0,
+							 single_ms / ms);
+			else
+				printf("  %5u  %9u  %8.2f  %5.1f  %6.2fx  %9.2f\n", ranks, run.particles, ms, comm * 100.0,
+							 single_ms / ms, single_ms / (ms * ranks));
+		}
+	}
+	printf("(%u hardware threads here)\n", std::thread::hardware_concurrency());
+	return 0;
+}
+
+// this process is rank o.rank of the comma separated o.hosts, over TCP
+int runHostRank(DistRun run, const DistOptions& o) {
+	char hosts[DIST_MAX_RANKS][256];
+	u32 num_hosts = 0;
+	for (const char* h = o.hosts; *h && num_hosts < DIST_MAX_RANKS; ) {
+		const char* comma = strchr(h, ',');
+		const u32 len = min<u32>(comma ? comma - h : strlen(h), 255);
+		memcpy(hosts[num_hosts], h, len);
+		hosts[num_hosts++][len] = 0;
+		h = comma ? comma + 1 : h + len;
+	}
+	if (o.rank < 0 || (u32)o.rank >= num_hosts) {
+		printf("--rank has to pick one of the %u --hosts\n", num_hosts);
+		return 1;
+	}
+	const u32 r = o.rank;
+	run.ranks = num_hosts;
+	const bool wrap = config._periodic[0] && run.ranks > 1;
+	const bool has_left = r > 0 || wrap;
+	const bool has_right = r + 1 < run.ranks || wrap;
+
+	Link links[2] = {};
+	const int listen_fd = has_left ? tcpListen(o.port + r) : -1;
+	if (has_left && listen_fd < 0) return 1;
+	if (has_right) {
+		const u32 right = (r + 1) % run.ranks;
+		const int fd = tcpConnect(hosts[right], o.port + right);
+		if (fd < 0) return 1;
+		links[DIST_RIGHT] = tcpLink(fd);
+	}
+	if (has_left) {
+		const int fd = accept(listen_fd, NULL, NULL);
+		close(listen_fd);
+		if (fd < 0) return 1;
+		links[DIST_LEFT] = tcpLink(fd);
+	}
+
+	jobs.init(run.threads);
+	DistResult res = runRank(r, run, has_left ? &links[DIST_LEFT] : NULL, has_right ? &links[DIST_RIGHT] : NULL,
+													 NULL);
+	jobs.destroy();
+	if (!res.ok) {
+		printf("Lost a neighbour\n");
+		return 1;
+	}
+	printf("rank %u of %u: slab %.2f .. %.2f, particles %u / %u / %u (min / max / end), %.2f ms/step, %.2f comm\n",
+				 r, run.ranks, res.lo, res.hi, res.min_owned, res.max_owned, res.owned, res.step_ms, res.comm_ms);
+	return 0;
+}
+
+// Slabs two kernel radii wide, the narrowest balance() allows, filled with
+// particles, so ghosts come from both edges of every slab and across the
+// periodic wrap if x has one. The ranks have to match one CpuSph up to
+// rounding: every particle owned exactly once, velocities within
+// DIST_CHECK_TOLERANCE of the biggest change in the run.
+int runDistCheck(DistRun run, const DistOptions& o) {
+	run.steps = DIST_CHECK_STEPS;
+	run.box.x = 2.0f * config._sph_radius * run.ranks;
+	run.extent = run.box;
+
+	SphParticle* initial = (SphParticle*)calloc(run.particles, sizeof(SphParticle));
+	SphParticle* gathered = (SphParticle*)calloc(run.particles, sizeof(SphParticle));
+	SphParticle* reference = (SphParticle*)calloc(run.particles, sizeof(SphParticle));
+	srand(1); // as in DistRank::make()
+	initParticles(initial, run.particles, run.extent);
+	for (u32 i = 0; i < run.particles; ++i)
+		gathered[i].pos = v3(NAN, NAN, NAN); // stays NaN unless some rank owns it
+
+	DistResult results[DIST_MAX_RANKS];
+	bool ok = runLocalRanks(run, o, results, gathered);
+
+	jobs.init(run.threads);
+	CpuSph cpu = CpuSph::make(run.particles);
+	cpu.load(initial);
+	const SimParams params = buildSimParams(run.box);
+	for (u32 step = 0; step < run.steps; ++step)
+		cpu.step(params, config._periodic);
+	cpu.store(reference);
+	cpu.destroy();
+	jobs.destroy();
+
+	u32 owned = 0;
+	for (u32 r = 0; r < run.ranks; ++r)
+		owned += results[r].owned;
+	u32 missing = 0;
+	f32 change = 0.0f, vel_err = 0.0f, pos_err = 0.0f;
+	for (u32 i = 0; i < run.particles; ++i) {
+		change = max(change, length(reference[i].vel - initial[i].vel));
+		if (isnan(gathered[i].pos.x)) {
+			missing++;
+			continue;
+		}
+		vel_err = max(vel_err, length(gathered[i].vel - reference[i].vel));
+		pos_err = max(pos_err, length(gathered[i].pos - reference[i].pos));
+	}
+
+	printf("%u ranks over %s against one solver, %u particles, %u steps, box x %.2f%s\n", run.ranks,
+				 o.transport == DIST_SHM ? "shm" : "tcp", run.particles, run.steps, run.box.x,
+				 config._periodic[0] ? " (periodic)" : "");
+	printf("  owned %u, missing %u\n", owned, missing);
+	printf("  max error: velocity %g, position %g (largest velocity change %g)\n", vel_err, pos_err, change);
+	if (owned != run.particles || missing) {
+		printf("Particles got lost or duplicated between the ranks!\n");
+		ok = false;
+	}
+	if (!(vel_err <= DIST_CHECK_TOLERANCE * change)) {
+		printf("Distributed run doesn't match the single solver!\n");
+		ok = false;
+	}
+	free(initial);
+	free(gathered);
+	free(reference);
+	return ok ? 0 : 1;
+}
+
+int runDistributed(const DistOptions& o, u32 threads) {
+	DistRun run = {};
+	run.ranks = o.ranks ? o.ranks : 1;
+	run.particles = PARTICLE_COUNT;
+	run.box = v3(10, 10, 10);
+	run.extent = v3(4, 4, 4);
+	run.steps = o.steps;
+	run.threads = threads;
+
+	if (o.hosts)
+		return runHostRank(run, o);
+	if (o.scaling)
+		return runScaling(run, o);
+	if (o.check)
+		return runDistCheck(run, o);
+
+	DistResult results[DIST_MAX_RANKS];
+	const bool ok = runLocalRanks(run, o, results);
+	printDistResults(run, o.transport == DIST_SHM ? "shm" : "tcp", results);
+	return ok ? 0 : 1;
+}
+
+#else
+
+int runDistributed(const DistOptions& o, u32 threads) {
+	printf("Distributed runs need POSIX processes and sockets\n");
+	return 1;
+}
+
+#endif
@@ -1,6 +1,16 @@
 #include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
 
 #include <SDL2/SDL.h>
+#ifdef __linux__
+#include <EGL/egl.h> // headless mode
+#include <EGL/eglext.h>
+#endif
 #include "ext/glad/glad.h"
 
 #include "ext/glad.c"
@@ -22,8 +32,36 @@
 #include "ext/imgui/backends/imgui_impl_opengl3.h"
 
 
-#define GL(x) do { { x; } assert(glGetError() == 0); } while(0);
-#define WORKGROUP_SIZE 8
+#include "gl_debug.h"
+#include "jobs.h"
+
+// KHR_parallel_shader_compile isn't in our glad build, so it's loaded by hand
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+bool has_parallel_shader_compile = false;
+
+bool hasGlExtension(const char* name) {
+	GLint count = 0;
+	GL(glGetIntegerv(GL_NUM_EXTENSIONS, &count));
+	for (GLint i = 0; i < count; ++i)
+		if (!strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name))
+			return true;
+	return false;
+}
+
+void initParallelShaderCompile(void* (*getProc)(const char*)) {
+	if (!hasGlExtension("GL_KHR_parallel_shader_compile")) {
+		printf("No KHR_parallel_shader_compile, shaders build one per frame\n");
+		return;
+	}
+	auto maxThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)getProc("glMaxShaderCompilerThreadsKHR");
+	if (maxThreads)
+		GL(maxThreads(0xFFFFFFFF)); // let the driver pick
+	has_parallel_shader_compile = true;
+}
+#define WORKGROUP_SIZE 64 // injected into the compute shaders, see simDefines()
 
 char* loadTextFile(const char* path) {
 	FILE* f = fopen(path, "rb");
@@ -41,154 +79,827 @@ char* loadTextFile(const char* path) {
 	return mem;
 }
 
+#include "preprocess.h"
+#include "gpu_arena.h"
+
+
+// Thin cache of the GL binding state we touch, so redundant binds and
+// program switches never reach the driver. Everything in this file binds
+// through gl_state; ImGui's GL3 backend saves and restores what it changes,
+// so the cache stays valid across ImGui_ImplOpenGL3_RenderDrawData().
+#define MAX_TRACKED_BINDINGS 8
+
+struct GlState {
+	u32 program;
+	u32 vao;
+	u32 array_buffer;
+	u32 indirect_buffer;
+	GpuRange ssbo[MAX_TRACKED_BINDINGS];
+	GpuRange ubo[MAX_TRACKED_BINDINGS];
+
+	struct {
+		GLenum cap;
+		bool on;
+	} caps[8];
+	u32 num_caps;
+
+	struct {
+		u32 issued;
+		u32 elided;
+	} frame, last_frame;
+
+	// true if the call has to be issued
+	bool track(u32* slot, u32 value) {
+		if (*slot == value) {
+			frame.elided++;
+			return false;
+		}
+		*slot = value;
+		frame.issued++;
+		return true;
+	}
+
+	void useProgram(u32 id) {
+		if (track(&program, id)) GL(glUseProgram(id));
+	}
+
+	void bindVertexArray(u32 id) {
+		if (track(&vao, id)) GL(glBindVertexArray(id));
+	}
+
+	// element arrays are VAO state, see glVertexArrayElementBuffer()
+	void bindBuffer(GLenum type, u32 id) {
+		assert(type == GL_ARRAY_BUFFER || type == GL_DRAW_INDIRECT_BUFFER);
+		if (track(type == GL_ARRAY_BUFFER ? &array_buffer : &indirect_buffer, id)) GL(glBindBuffer(type, id));
+	}
+
+	bool track(GpuRange* slot, GpuRange value) {
+		if (!memcmp(slot, &value, sizeof(value))) {
+			frame.elided++;
+			return false;
+		}
+		*slot = value;
+		frame.issued++;
+		return true;
+	}
+
+	// buffers live in arena blocks, so indexed binds are always ranges
+	void bindBufferRange(GLenum type, u32 index, GpuRange r) {
+		assert(type == GL_SHADER_STORAGE_BUFFER || type == GL_UNIFORM_BUFFER);
+		GpuRange* slots = type == GL_SHADER_STORAGE_BUFFER ? ssbo : ubo;
+		if (index >= MAX_TRACKED_BINDINGS) { // untracked, always issue
+			frame.issued++;
+			GL(glBindBufferRange(type, index, r.id, r.offset, r.size));
+			return;
+		}
+		if (track(&slots[index], r)) GL(glBindBufferRange(type, index, r.id, r.offset, r.size));
+	}
+
+	void enable(GLenum cap, bool on) {
+		u32 i = 0;
+		while (i < num_caps && caps[i].cap != cap) ++i;
+
+		if (i < num_caps && caps[i].on == on) {
+			frame.elided++;
+			return;
+		}
+		if (i == num_caps) {
+			assert(num_caps < ARRAY_SIZE(caps));
+			num_caps++;
+		}
+		caps[i].cap = cap;
+		caps[i].on = on;
+
+		frame.issued++;
+		if (on) {
+			GL(glEnable(cap));
+		} else {
+			GL(glDisable(cap));
+		}
+	}
+
+	// deleted names are implicitly unbound, forget them too
+	void forgetBuffer(u32 id) {
+		if (array_buffer == id) array_buffer = 0;
+		if (indirect_buffer == id) indirect_buffer = 0;
+		for (u32 i = 0; i < MAX_TRACKED_BINDINGS; ++i) {
+			if (ssbo[i].id == id) ssbo[i] = {};
+			if (ubo[i].id == id) ubo[i] = {};
+		}
+	}
+
+	void forgetProgram(u32 id) {
+		if (program == id) program = 0;
+	}
+
+	void endFrame() {
+		last_frame = frame;
+		frame.issued = frame.elided = 0;
+	}
+};
+
+GlState gl_state;
+
+void forgetBufferBindings(u32 id) {
+	gl_state.forgetBuffer(id);
+}
+
 
+// A range of one of gpu_arena's blocks. Several Buffers share a GL name, so
+// anything that takes raw offsets (attrib pointers, copies) must add offset.
 template<GLuint Type>
 struct Buffer {
 	static_assert(Type == GL_ARRAY_BUFFER ||
-							  Type == GL_SHADER_STORAGE_BUFFER);
+							  Type == GL_ELEMENT_ARRAY_BUFFER ||
+							  Type == GL_DRAW_INDIRECT_BUFFER ||
+							  Type == GL_SHADER_STORAGE_BUFFER ||
+							  Type == GL_UNIFORM_BUFFER);
 	u32 id;
+	u32 offset;
 	size_t size;
 
 	static Buffer<Type> make(void* data, size_t size) {
+		GpuRange r = gpu_arena.alloc(size, data);
 		Buffer<Type> buf;
+		buf.id = r.id;
+		buf.offset = r.offset;
 		buf.size = size;
-		glCreateBuffers(1, &buf.id);
-		glNamedBufferStorage(buf.id, size, data, GL_DYNAMIC_STORAGE_BIT);
 		return buf;
 	}
 
+	GpuRange range() {
+		return { id, offset, (u32)size };
+	}
+
 	void read(void* data) {
-		glGetNamedBufferSubData(id, 0, size, data);
+		GL(glGetNamedBufferSubData(id, offset, size, data));
 	}
 
 	void write(void* data) {
-		glNamedBufferSubData(id, 0, size, data);
+		gpu_arena.upload(range(), data);
 	}
 
 	void bind() {
-		GL(glBindBuffer(Type, id));
+		gl_state.bindBuffer(Type, id);
 	}
 
 	void bindSsbo(uint32_t index) {
 		static_assert(Type == GL_SHADER_STORAGE_BUFFER);
-		GL(glBindBufferBase(Type, index, id));
+		gl_state.bindBufferRange(Type, index, range());
 	}
 
+	void bindUbo(uint32_t index) {
+		static_assert(Type == GL_UNIFORM_BUFFER);
+		gl_state.bindBufferRange(Type, index, range());
+	}
+
+	// the block itself stays alive, see GpuArena::free()
 	void destroy() {
-		GL(glDeleteBuffers(1, &id));
+		gpu_arena.free(range());
+	}
+};
+
+
+
+// On-disk cache of linked program binaries, so warm starts skip compiling.
+// Keyed by the fully preprocessed stage sources (covers includes and
+// defines) plus the GL vendor/renderer/version strings, since a binary is
+// only valid for the driver that produced it. Anything the driver rejects
+// just falls back to compiling from source.
+#define PROGRAM_CACHE_DIR "shader-cache"
+
+struct ProgramBinaryCache {
+	bool enabled;
+	u64 driver_hash;
+	GLint formats[8];
+	GLint num_formats;
+
+	// since startup
+	u32 hits;
+	u32 misses;
+	u32 rejected;
+
+	void init() {
+		hits = misses = rejected = 0;
+
+		GL(glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats));
+		num_formats = min<GLint>(num_formats, ARRAY_SIZE(formats));
+		if (num_formats > 0)
+			GL(glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats));
+
+		enabled = num_formats > 0;
+		if (!enabled) {
+			printf("Driver has no program binary formats, binary cache disabled\n");
+			return;
+		}
+
+		driver_hash = HASH_SEED;
+		driver_hash = ShaderDefines::hashStr(driver_hash, (const char*)glGetString(GL_VENDOR));
+		driver_hash = ShaderDefines::hashStr(driver_hash, (const char*)glGetString(GL_RENDERER));
+		driver_hash = ShaderDefines::hashStr(driver_hash, (const char*)glGetString(GL_VERSION));
+
+		makeDir(PROGRAM_CACHE_DIR);
+	}
+
+	static void makeDir(const char* path) {
+#ifdef _WIN32
+		_mkdir(path);
+#else
+		mkdir(path, 0755);
+#endif
+	}
+
+	void path(u64 key, char* out, size_t out_len) {
+		snprintf(out, out_len, PROGRAM_CACHE_DIR "/%016llx.bin", (unsigned long long)key);
+	}
+
+	struct Header {
+		u32 magic;
+		u32 format;
+		u32 length;
+		u32 _pad;
+		u64 key;
+	};
+	static constexpr u32 MAGIC = 0x50524f47; // 'PROG'
+
+	// true if program is now linked from the cached binary
+	bool load(u64 key, u32 program) {
+		if (!enabled) return false;
+
+		char file_path[128];
+		path(key, file_path, sizeof(file_path));
+		FILE* f = fopen(file_path, "rb");
+		if (!f) {
+			misses++;
+			return false;
+		}
+
+		fseek(f, 0, SEEK_END);
+		const long file_size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		// the length has to account for the rest of the file exactly, a
+		// truncated or corrupt one must not pick the allocation size
+		Header hdr;
+		void* blob = NULL;
+		bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+							hdr.magic == MAGIC && hdr.key == key &&
+							hdr.length > 0 && file_size == (long)(sizeof(hdr) + hdr.length);
+
+		bool known_format = false;
+		for (GLint i = 0; ok && i < num_formats; ++i)
+			known_format |= (GLint)hdr.format == formats[i];
+		ok = ok && known_format;
+
+		if (ok) {
+			blob = malloc(hdr.length);
+			ok = fread(blob, 1, hdr.length, f) == hdr.length;
+		}
+		fclose(f);
+
+		if (ok) {
+			// a stale binary is allowed to fail here, the link status says so
+			GL_QUIET_BEGIN("program binary");
+			glProgramBinary(program, hdr.format, blob, hdr.length);
+			GL_QUIET_END();
+
+			GLint status = 0;
+			GL(glGetProgramiv(program, GL_LINK_STATUS, &status));
+			ok = status == GL_TRUE;
+		}
+		free(blob);
+
+		if (ok) {
+			hits++;
+		} else {
+			rejected++;
+			remove(file_path);
+		}
+		return ok;
+	}
+
+	void store(u64 key, u32 program) {
+		if (!enabled) return;
+
+		GLint length = 0;
+		GL(glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length));
+		if (length <= 0) return;
+
+		void* blob = malloc(length);
+		GLenum format;
+		GL(glGetProgramBinary(program, length, NULL, &format, blob));
+
+		char file_path[128];
+		path(key, file_path, sizeof(file_path));
+		FILE* f = fopen(file_path, "wb");
+		if (f) {
+			Header hdr = { MAGIC, format, (u32)length, 0, key };
+			fwrite(&hdr, sizeof(hdr), 1, f);
+			fwrite(blob, 1, length, f);
+			fclose(f);
+		}
+		free(blob);
 	}
 };
 
+ProgramBinaryCache program_cache;
+
 
+#define MAX_SHADER_UNIFORMS 16
+#define MAX_SHADER_STAGES 2
 
 struct Shader {
 	u32 id;
 
+	// preprocessed sources queued by addStage(), compiled in link() unless
+	// the binary cache already has this program
+	struct {
+		GLenum type;
+		char* src;
+		u32 part; // shader object while a link is in flight
+	} stages[MAX_SHADER_STAGES];
+	u32 num_stages;
+
+	u64 key;
+	bool compiled; // compile + link calls issued, result not collected yet
+	bool pending;  // startLink() called, program not usable yet
+	bool failed;   // linking failed, the program is never usable
+
+	// plain (non-block) uniform locations, resolved once in link()
+	struct {
+		char name[32];
+		i32 loc;
+	} uniforms[MAX_SHADER_UNIFORMS];
+	u32 num_uniforms;
+
 	static Shader make() {
 		Shader shader;
+		shader.num_stages = 0;
+		shader.num_uniforms = 0;
+		shader.compiled = false;
+		shader.pending = false;
+		shader.failed = false;
 		GL(shader.id = glCreateProgram());
 		return shader;
 	}
 
 	template<GLuint ShaderType>
-	Shader& addStage(const char* path) {
+	Shader& addStage(const char* path, const ShaderDefines* defines = NULL) {
 		static_assert(ShaderType == GL_VERTEX_SHADER ||
 									ShaderType == GL_FRAGMENT_SHADER ||
 									ShaderType == GL_COMPUTE_SHADER);
-		char* shader_code = loadTextFile(path);
+		assert(num_stages < MAX_SHADER_STAGES);
+		char* shader_code = preprocessShader(path, defines);
 		if (!shader_code) {
 			printf("Failed to add shader!\n");
-			free(shader_code);
 			return *this;
 		}
 
-		u32 shader_part;
-		GL(shader_part = glCreateShader(ShaderType));
-		GL(glShaderSource(shader_part, 1, &shader_code, NULL));
-		GL(glCompileShader(shader_part));
-		free(shader_code);
+		stages[num_stages].type = ShaderType;
+		stages[num_stages].src = shader_code;
+		num_stages++;
 
+		return *this;
+	}
+
+	u64 sourceHash() {
+		u64 h = program_cache.driver_hash;
+		for (u32 i = 0; i < num_stages; ++i) {
+			char type[16];
+			snprintf(type, sizeof(type), "%x:", stages[i].type);
+			h = ShaderDefines::hashStr(h, type);
+			h = ShaderDefines::hashStr(h, stages[i].src);
+		}
+		return h;
+	}
+
+	// Issues compile + link without asking for any results, so with
+	// KHR_parallel_shader_compile the driver does the work on its own threads.
+	void compileAndLink() {
+		for (u32 i = 0; i < num_stages; ++i) {
+			GL(stages[i].part = glCreateShader(stages[i].type));
+			GL(glShaderSource(stages[i].part, 1, &stages[i].src, NULL));
+			GL(glCompileShader(stages[i].part));
+			GL(glAttachShader(id, stages[i].part));
+		}
+		GL(glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+		GL(glLinkProgram(id));
+		compiled = true;
+	}
+
+	// Collects logs and link status, blocks if the driver isn't done yet.
+	void finishLink() {
+		if (!compiled) compileAndLink();
+
+		for (u32 i = 0; i < num_stages; ++i) {
+			char msg_buf[1024];
+			GL(glGetShaderInfoLog(stages[i].part, sizeof(msg_buf), NULL, msg_buf));
+			puts(msg_buf);
+			GL(glDetachShader(id, stages[i].part));
+			GL(glDeleteShader(stages[i].part));
+		}
 		{
 			char msg_buf[1024];
-			GL(glGetShaderInfoLog(shader_part, sizeof(msg_buf), NULL, msg_buf));
+			GL(glGetProgramInfoLog(id, sizeof(msg_buf), NULL, msg_buf));
 			puts(msg_buf);
 		}
 
-		GL(glAttachShader(id, shader_part));
-		GL(glDeleteShader(shader_part));
+		GLint status = 0;
+		GL(glGetProgramiv(id, GL_LINK_STATUS, &status));
+		failed = status != GL_TRUE;
+		if (failed)
+			printf("Failed to link shader program %u!\n", id);
+		else
+			program_cache.store(key, id);
+
+		freeStages();
+		if (!failed) resolveUniforms();
+		compiled = false;
+		pending = false;
+	}
+
+	void freeStages() {
+		for (u32 i = 0; i < num_stages; ++i)
+			free(stages[i].src);
+		num_stages = 0;
+	}
 
+	// Kicks off the build and returns right away; poll() until it's ready.
+	// A binary cache hit is ready immediately.
+	Shader& startLink() {
+		key = sourceHash();
+		pending = true;
+
+		if (program_cache.load(key, id)) {
+			freeStages();
+			resolveUniforms();
+			pending = false;
+		} else if (has_parallel_shader_compile) {
+			compileAndLink();
+		}
+		// else: compiled synchronously by the first poll(), see ShaderCache
 		return *this;
 	}
 
-	Shader& link() {
-		GL(glLinkProgram(id));
-		{
-			char msg_buf[1024];
-			GL(glGetProgramInfoLog(id, sizeof(msg_buf), NULL, msg_buf));
-			puts(msg_buf);
+	// True once the program is usable, false while building and for good if
+	// linking failed. Without the parallel compile extension this builds it
+	// right here, so callers should budget how often they ask.
+	bool poll() {
+		if (!pending) return !failed;
+
+		if (compiled && has_parallel_shader_compile) {
+			GLint done = 0;
+			GL(glGetProgramiv(id, GL_COMPLETION_STATUS_KHR, &done));
+			if (!done) return false;
 		}
+		finishLink();
+		return !failed;
+	}
 
+	// blocking build
+	Shader& link() {
+		startLink();
+		if (pending) finishLink();
 		return *this;
 	}
 
+	void resolveUniforms() {
+		i32 active = 0;
+		GL(glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &active));
+		num_uniforms = 0;
+		for (i32 i = 0; i < active; ++i) {
+			char name[32];
+			GL(glGetActiveUniformName(id, i, sizeof(name), NULL, name));
+			i32 loc;
+			GL(loc = glGetUniformLocation(id, name));
+			if (loc < 0) continue; // lives in a uniform block
+
+			if (num_uniforms == MAX_SHADER_UNIFORMS) {
+				printf("Too many uniforms, dropping %s!\n", name);
+				continue;
+			}
+			strcpy(uniforms[num_uniforms].name, name);
+			uniforms[num_uniforms].loc = loc;
+			num_uniforms++;
+		}
+	}
+
+	i32 uniformLocation(const char* uniform) {
+		for (u32 i = 0; i < num_uniforms; ++i)
+			if (!strcmp(uniforms[i].name, uniform))
+				return uniforms[i].loc;
+		return -1;
+	}
+
 	void setUniform(const char* uniform, f32 x) {
-		GL(glUseProgram(id));
-		GL(glUniform1f(glGetUniformLocation(id, uniform), x));
+		GL(glProgramUniform1f(id, uniformLocation(uniform), x));
+	}
+
+	void setUniform(const char* uniform, i32 x) {
+		GL(glProgramUniform1i(id, uniformLocation(uniform), x));
 	}
 
 	void setUniform(const char* uniform, Vec2 v) {
-		GL(glUseProgram(id));
-		GL(glUniform2f(glGetUniformLocation(id, uniform), v.x, v.y));
+		GL(glProgramUniform2f(id, uniformLocation(uniform), v.x, v.y));
 	}
 	void setUniform(const char* uniform, Vec3 v) {
-		GL(glUseProgram(id));
-		GL(glUniform3f(glGetUniformLocation(id, uniform), v.x, v.y, v.z));
+		GL(glProgramUniform3f(id, uniformLocation(uniform), v.x, v.y, v.z));
 	}
 	void setUniform(const char* uniform, Vec4 v) {
-		GL(glUseProgram(id));
-		GL(glUniform4f(glGetUniformLocation(id, uniform), v.x, v.y, v.z, v.w));
+		GL(glProgramUniform4f(id, uniformLocation(uniform), v.x, v.y, v.z, v.w));
 	}
 
 	void setUniform(const char* uniform, Mat4 m) {
-		GL(glUseProgram(id));
-		GL(glUniformMatrix4fv(glGetUniformLocation(id, uniform), 1, false, m.m));
+		GL(glProgramUniformMatrix4fv(id, uniformLocation(uniform), 1, false, m.m));
 	}
 
 
 	void destroy() {
+		if (compiled)
+			for (u32 i = 0; i < num_stages; ++i)
+				GL(glDeleteShader(stages[i].part));
+		freeStages();
+		gl_state.forgetProgram(id);
 		GL(glDeleteProgram(id));
 	}
 
 	void execute(u32 x_groups, u32 y_groups, u32 z_groups) {
-		GL(glUseProgram(id));
+		gl_state.useProgram(id);
 		GL(glDispatchCompute(x_groups, y_groups, z_groups));
 	}
 };
 
 
+// Linked programs keyed by stage paths + define set, so each specialized
+// variant is built the first time it's asked for and reused after that.
+// Builds run in the background: until a variant is ready, lookups hand back
+// whatever the caller was using before, so switching variants never stalls
+// a frame.
+#define MAX_SHADER_VARIANTS 32
+
+struct ShaderCache {
+	struct Entry {
+		u64 key;
+		u64 last_used;
+		Shader shader;
+	} entries[MAX_SHADER_VARIANTS];
+	u32 count;
+	u64 tick;
+
+	Entry* entryOf(Shader* shader) {
+		if (!shader) return NULL;
+		return (Entry*)((char*)shader - offsetof(Entry, shader));
+	}
+
+	Shader* find(u64 key) {
+		tick++;
+		for (u32 i = 0; i < count; ++i)
+			if (entries[i].key == key) {
+				entries[i].last_used = tick;
+				return &entries[i].shader;
+			}
+		return NULL;
+	}
+
+	Shader* insert(u64 key, Shader shader) {
+		u32 slot = count;
+		if (count == MAX_SHADER_VARIANTS) { // evict least recently used
+			slot = 0;
+			for (u32 i = 1; i < count; ++i)
+				if (entries[i].last_used < entries[slot].last_used) slot = i;
+			entries[slot].shader.destroy();
+		} else {
+			count++;
+		}
+
+		entries[slot].key = key;
+		entries[slot].last_used = tick;
+		entries[slot].shader = shader;
+		entries[slot].shader.startLink();
+		return &entries[slot].shader;
+	}
+
+	// requested once built, otherwise current (may be NULL), which is kept
+	// alive for as long as it's being handed back. A variant that failed to
+	// link is never switched to.
+	Shader* select(Shader* requested, Shader* current) {
+		if (!requested->pending && !requested->failed) return requested;
+		return current;
+	}
+
+	void keep(Shader* current) {
+		if (Entry* e = entryOf(current)) e->last_used = ++tick;
+	}
+
+	Shader* compute(const char* path, const ShaderDefines& defines, Shader* current) {
+		keep(current);
+		u64 key = defines.hash(ShaderDefines::hashStr(HASH_SEED, path));
+		Shader* s = find(key);
+		if (!s) {
+			s = insert(key, Shader::make()
+												.addStage<GL_COMPUTE_SHADER>(path, &defines));
+		}
+		return select(s, current);
+	}
+
+	Shader* graphics(const char* vs_path, const char* fs_path, const ShaderDefines& defines,
+									 Shader* current) {
+		keep(current);
+		u64 key = defines.hash(ShaderDefines::hashStr(ShaderDefines::hashStr(HASH_SEED, vs_path), fs_path));
+		Shader* s = find(key);
+		if (!s) {
+			s = insert(key, Shader::make()
+												.addStage<GL_VERTEX_SHADER>(vs_path, &defines)
+												.addStage<GL_FRAGMENT_SHADER>(fs_path, &defines));
+		}
+		return select(s, current);
+	}
+
+	// Once per frame. With parallel compile every finished build is collected,
+	// without it only the most recently requested one is built, synchronously.
+	void poll() {
+		Entry* newest = NULL;
+		for (u32 i = 0; i < count; ++i) {
+			Entry* e = &entries[i];
+			if (!e->shader.pending) continue;
+
+			if (has_parallel_shader_compile)
+				e->shader.poll();
+			else if (!newest || e->last_used > newest->last_used)
+				newest = e;
+		}
+		if (newest) newest->shader.poll();
+	}
+
+	// still building, failed ones are done
+	u32 pending() {
+		u32 n = 0;
+		for (u32 i = 0; i < count; ++i)
+			n += entries[i].shader.pending;
+		return n;
+	}
+
+	u32 failed() {
+		u32 n = 0;
+		for (u32 i = 0; i < count; ++i)
+			n += entries[i].shader.failed;
+		return n;
+	}
+
+	void destroy() {
+		for (u32 i = 0; i < count; ++i)
+			entries[i].shader.destroy();
+		count = 0;
+	}
+};
+
+ShaderCache shader_cache;
+
+
 struct MeshVertex {
 	Vec3 pos;
 };
 
+// one level of detail, a range of the mesh's indices
+struct MeshLod {
+	u32 first_index;
+	u32 num_indices;
+	u32 base_vertex;
+	u32 num_verts;
+};
+
+#define MAX_MESH_LODS 4
+#define VCACHE_SIZE 32 // simulated post-transform cache, see optimizeVertexCache()
+
+// Forsyth's vertex score: vertices just used or still in the cache score
+// high, and so do ones with few triangles left, so stragglers get finished
+// off instead of leaving holes that need them reloaded later
+f32 vertexCacheScore(i32 cache_pos, u32 live_tris) {
+	if (!live_tris) return -1.0f;
+	f32 score = 0.0f;
+	if (cache_pos >= 0)
+		score = cache_pos < 3 ? 0.75f : powf(1.0f - (cache_pos - 3) / (f32)(VCACHE_SIZE - 3), 1.5f);
+	return score + 2.0f / sqrtf((f32)live_tris);
+}
+
+// Reorders triangles (not vertices) greedily: the next one is the best
+// scoring triangle around the vertices in the simulated cache, so
+// neighbouring triangles come out together and reuse transformed vertices.
+void optimizeVertexCache(u32* indices, u32 num_indices, u32 num_verts) {
+	const u32 num_tris = num_indices / 3;
+	u32* live = (u32*)calloc(num_verts, sizeof(u32));
+	u32* adj_start = (u32*)calloc(num_verts + 1, sizeof(u32));
+	u32* adj = (u32*)calloc(num_indices, sizeof(u32));
+	i32* cache_pos = (i32*)malloc(num_verts * sizeof(i32));
+	f32* score = (f32*)calloc(num_verts, sizeof(f32));
+	f32* tri_score = (f32*)calloc(num_tris, sizeof(f32));
+	bool* emitted = (bool*)calloc(num_tris, sizeof(bool));
+	u32* out = (u32*)calloc(num_indices, sizeof(u32));
+
+	// triangles per vertex, as offsets into adj
+	for (u32 i = 0; i < num_indices; ++i) live[indices[i]]++;
+	for (u32 v = 0; v < num_verts; ++v) adj_start[v + 1] = adj_start[v] + live[v];
+	for (u32 v = 0; v < num_verts; ++v) live[v] = 0;
+	for (u32 i = 0; i < num_indices; ++i) {
+		const u32 v = indices[i];
+		adj[adj_start[v] + live[v]++] = i / 3;
+	}
+	for (u32 v = 0; v < num_verts; ++v) {
+		cache_pos[v] = -1;
+		score[v] = vertexCacheScore(-1, live[v]);
+	}
+	for (u32 t = 0; t < num_tris; ++t)
+		tri_score[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+
+	u32 cache[VCACHE_SIZE + 3];
+	u32 cache_len = 0;
+	u32 scan = 0; // no triangle before this one is left, for when the cache runs dry
+	i32 best = num_tris ? 0 : -1;
+	for (u32 n = 0; n < num_tris; ++n) {
+		if (best < 0) {
+			while (emitted[scan]) scan++;
+			best = scan;
+		}
+		const u32* tri = &indices[best * 3];
+		emitted[best] = true;
+		for (u32 k = 0; k < 3; ++k) out[n * 3 + k] = tri[k];
+
+		// emitted vertices go to the front of the LRU cache
+		u32 next[VCACHE_SIZE + 3];
+		u32 next_len = 0;
+		for (u32 k = 0; k < 3; ++k) {
+			next[next_len++] = tri[k];
+			live[tri[k]]--;
+			for (u32 a = adj_start[tri[k]]; a < adj_start[tri[k] + 1]; ++a) // move best to the end
+				if (adj[a] == (u32)best) {
+					adj[a] = adj[adj_start[tri[k]] + live[tri[k]]];
+					adj[adj_start[tri[k]] + live[tri[k]]] = best;
+					break;
+				}
+		}
+		for (u32 c = 0; c < cache_len; ++c)
+			if (cache[c] != tri[0] && cache[c] != tri[1] && cache[c] != tri[2])
+				next[next_len++] = cache[c];
+
+		// rescore everything that moved in, around or out of the cache
+		for (u32 c = 0; c < next_len; ++c) {
+			const u32 v = next[c];
+			cache_pos[v] = c < VCACHE_SIZE ? (i32)c : -1;
+			const f32 s = vertexCacheScore(cache_pos[v], live[v]);
+			const f32 delta = s - score[v];
+			score[v] = s;
+			for (u32 a = adj_start[v]; a < adj_start[v] + live[v]; ++a)
+				tri_score[adj[a]] += delta;
+		}
+		cache_len = min<u32>(next_len, VCACHE_SIZE);
+		memcpy(cache, next, cache_len * sizeof(u32));
+
+		best = -1;
+		f32 best_score = -1.0f;
+		for (u32 c = 0; c < cache_len; ++c)
+			for (u32 a = adj_start[cache[c]]; a < adj_start[cache[c]] + live[cache[c]]; ++a)
+				if (tri_score[adj[a]] > best_score) {
+					best_score = tri_score[adj[a]];
+					best = adj[a];
+				}
+	}
+
+	memcpy(indices, out, num_indices * sizeof(u32));
+	free(live);
+	free(adj_start);
+	free(adj);
+	free(cache_pos);
+	free(score);
+	free(tri_score);
+	free(emitted);
+	free(out);
+}
+
 struct Mesh {
 	u32 num_verts;
 	MeshVertex* verts;
+	u32 num_indices;
+	u32* indices;
 
+	MeshLod lods[MAX_MESH_LODS]; // finest first
+	u32 num_lods;
 
-	static Mesh make(u32 num_verts) {
-		Mesh mesh;
+	static Mesh make(u32 num_verts, u32 num_indices) {
+		Mesh mesh = {};
 		mesh.num_verts = num_verts;
 		mesh.verts = (MeshVertex*)calloc(num_verts, sizeof(MeshVertex));
+		mesh.num_indices = num_indices;
+		mesh.indices = (u32*)calloc(num_indices, sizeof(u32));
+		mesh.lods[0] = { 0, num_indices, 0, num_verts };
+		mesh.num_lods = 1;
 		return mesh;
 	}
 
-	static Mesh makeSphere(f32 radius, u32 theta_segments, u32 rho_segments) {
-		Mesh mesh = Mesh::make(theta_segments * rho_segments * 6);
-
-		u32 builder_idx = 0;
-
-		const f32 theta_step = 2 * PI / theta_segments;
-		const f32 rho_step = PI / theta_segments;
+	// UV sphere with shared vertices: a vertex per pole, segments per ring
+	// in between, triangles ordered for the vertex cache
+	static Mesh makeSphere(f32 radius, u32 rings, u32 segments) {
+		assert(rings >= 2 && segments >= 3);
+		Mesh mesh = Mesh::make(2 + (rings - 1) * segments, 6 * segments * (rings - 1));
 
 		auto sphericalToCartesian = [](f32 theta, f32 rho) -> Vec3 {
 			return Vec3 {
@@ -198,32 +909,59 @@ struct Mesh {
 			};
 		};
 
-		for (u32 theta_i = 0; theta_i < theta_segments; ++theta_i) {
-			const f32 theta[2] = { theta_i * theta_step,
-														 theta_i * theta_step + theta_step };
-
-			for (u32 rho_i = 0; rho_i < theta_segments; ++rho_i) {
-				const f32 rho[2] = { rho_i * rho_step,
-														 rho_i * rho_step + rho_step };
-				
-				Vec3 surf[4];
-				for (u32 i = 0; i < 2; ++i)
-					for (u32 j = 0; j < 2; ++j) {
-						surf[i+j*2] = sphericalToCartesian(theta[i], rho[j]) * v3(radius);
-					}
+		const u32 top = 0;
+		const u32 bottom = mesh.num_verts - 1;
+		mesh.verts[top] = { v3(0, radius, 0) };
+		mesh.verts[bottom] = { v3(0, -radius, 0) };
+		for (u32 ring = 1; ring < rings; ++ring)
+			for (u32 seg = 0; seg < segments; ++seg)
+				mesh.verts[1 + (ring - 1) * segments + seg] = {
+					sphericalToCartesian(seg * 2 * PI / segments, ring * PI / rings) * v3(radius)
+				};
 
-				mesh.verts[builder_idx++] = { surf[0] };
-				mesh.verts[builder_idx++] = { surf[1] };
-				mesh.verts[builder_idx++] = { surf[3] };
+		// vertex seg of ring (1..rings-1)
+		auto at = [&](u32 ring, u32 seg) { return 1 + (ring - 1) * segments + seg % segments; };
 
-				mesh.verts[builder_idx++] = { surf[0] };
-				mesh.verts[builder_idx++] = { surf[3] };
-				mesh.verts[builder_idx++] = { surf[2] };
+		u32 builder_idx = 0;
+		auto tri = [&](u32 a, u32 b, u32 c) {
+			mesh.indices[builder_idx++] = a;
+			mesh.indices[builder_idx++] = b;
+			mesh.indices[builder_idx++] = c;
+		};
+		for (u32 seg = 0; seg < segments; ++seg) {
+			tri(top, at(1, seg), at(1, seg + 1));
+			for (u32 ring = 1; ring + 1 < rings; ++ring) {
+				tri(at(ring, seg), at(ring + 1, seg), at(ring + 1, seg + 1));
+				tri(at(ring, seg), at(ring + 1, seg + 1), at(ring, seg + 1));
 			}
+			tri(at(rings - 1, seg), bottom, at(rings - 1, seg + 1));
 		}
+		assert(builder_idx == mesh.num_indices);
 
-		assert(builder_idx == mesh.num_verts);
+		optimizeVertexCache(mesh.indices, mesh.num_indices, mesh.num_verts);
+		return mesh;
+	}
 
+	// one mesh with each of levels as a LOD, frees levels
+	static Mesh makeLods(Mesh* levels, u32 count) {
+		assert(count <= MAX_MESH_LODS);
+		u32 num_verts = 0, num_indices = 0;
+		for (u32 i = 0; i < count; ++i) {
+			num_verts += levels[i].num_verts;
+			num_indices += levels[i].num_indices;
+		}
+		Mesh mesh = Mesh::make(num_verts, num_indices);
+		mesh.num_lods = count;
+
+		u32 first_index = 0, base_vertex = 0;
+		for (u32 i = 0; i < count; ++i) {
+			memcpy(mesh.verts + base_vertex, levels[i].verts, levels[i].num_verts * sizeof(MeshVertex));
+			memcpy(mesh.indices + first_index, levels[i].indices, levels[i].num_indices * sizeof(u32));
+			mesh.lods[i] = { first_index, levels[i].num_indices, base_vertex, levels[i].num_verts };
+			first_index += levels[i].num_indices;
+			base_vertex += levels[i].num_verts;
+			levels[i].destroy();
+		}
 		return mesh;
 	}
 
@@ -232,24 +970,179 @@ struct Mesh {
 																						 sizeof(MeshVertex) * num_verts);
 		return buf;
 	}
-};
 
+	Buffer<GL_ELEMENT_ARRAY_BUFFER> buildIbo() {
+		return Buffer<GL_ELEMENT_ARRAY_BUFFER>::make(indices, sizeof(u32) * num_indices);
+	}
 
+	void destroy() {
+		free(verts);
+		free(indices);
+	}
+};
 
+constexpr u32 PARTICLE_COUNT = 5000;
+constexpr f32 PARTICLE_DRAW_RADIUS = 0.3f; // of the drawn spheres, not the kernel
 
-void draw(Buffer<GL_ARRAY_BUFFER> vbo, Shader shader, u32 count, u32 instances) {
-	GL(glUseProgram(shader.id));
-	vbo.bind();
-	GL(glDrawArraysInstanced(GL_TRIANGLES, 0, count, instances));
-}
+#define WINDOW_WIDTH 1280
+#define WINDOW_HEIGHT 720
 
-constexpr u32 PARTICLE_COUNT = 5000;
+#include "frame_graph.h"
 
 struct SphParticle {
 	Vec3 pos;
 	float density;
 	Vec3 vel;
-	float _pad2;
+	float interior; // set by compute-density.glsl only, CPU solvers leave it 0
+};
+
+// std140 mirror of the SimParams uniform block every shader declares
+struct SimParams {
+	Vec3 bbox_size;
+	f32  sph_mass;
+	f32  sph_radius;
+	f32  target_density;
+	f32  pressure_mul;
+	f32  particle_count;
+	f32  kernel_norm;
+	f32  kernel_der_norm;
+	f32  _pad[2];
+};
+static_assert(sizeof(SimParams) == 48);
+
+#define SIM_PARAMS_BINDING 0
+
+// Simulation state ring. Every step reads the newest slot and writes the
+// next one (the density pass goes through a scratch buffer in between), and
+// leaves a fence behind its last dispatch, so it's known which slots the GPU
+// is done with without ever waiting on one.
+#define STATE_RING_SIZE 3
+
+enum PipelineMode : int {
+	PIPELINE_LATENCY,    // draw the state stepped this frame
+	PIPELINE_THROUGHPUT, // draw the newest finished state, stepping isn't waited on
+};
+
+struct StateRing {
+	Buffer<GL_SHADER_STORAGE_BUFFER> slots[STATE_RING_SIZE];
+	GLsync fences[STATE_RING_SIZE];
+	u64 steps[STATE_RING_SIZE]; // sim step each slot holds
+	u32 head;                   // newest slot written
+
+	static StateRing make(SphParticle* init, size_t size) {
+		StateRing ring;
+		for (u32 i = 0; i < STATE_RING_SIZE; ++i) {
+			ring.slots[i] = Buffer<GL_SHADER_STORAGE_BUFFER>::make(init, size);
+			ring.fences[i] = 0;
+			ring.steps[i] = 0;
+		}
+		ring.head = 0;
+		return ring;
+	}
+
+	u32 next() {
+		return (head + 1) % STATE_RING_SIZE;
+	}
+
+	// never blocks
+	bool finished(u32 slot) {
+		if (!fences[slot]) return true;
+		GLenum res = glClientWaitSync(fences[slot], 0, 0);
+		if (res != GL_ALREADY_SIGNALED && res != GL_CONDITION_SATISFIED) return false;
+		glDeleteSync(fences[slot]);
+		fences[slot] = 0;
+		return true;
+	}
+
+	// call right after the step's last dispatch into next()
+	void advance() {
+		const u32 slot = next();
+		if (fences[slot]) glDeleteSync(fences[slot]);
+		fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		steps[slot] = steps[head] + 1;
+		head = slot;
+	}
+
+	// Newest slot the GPU is done writing, next() excluded as it's about to
+	// be overwritten. False if the step before is still in flight too.
+	bool newestFinished(u32* slot) {
+		for (u32 i = 0; i < STATE_RING_SIZE - 1; ++i) {
+			const u32 s = (head + STATE_RING_SIZE - i) % STATE_RING_SIZE;
+			if (finished(s)) {
+				*slot = s;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// stable copy for CPU readers, false instead of stalling
+	bool readFinished(SphParticle* dst, u64* step) {
+		u32 slot;
+		if (!newestFinished(&slot)) return false;
+		slots[slot].read(dst);
+		*step = steps[slot];
+		return true;
+	}
+
+	// slots are in the sim scope, this only drops the fences
+	void destroy() {
+		for (u32 i = STATE_RING_SIZE; i--; ) {
+			if (fences[i]) glDeleteSync(fences[i]);
+			slots[i].destroy();
+		}
+	}
+};
+
+// Small GPU-written results (counters, indirect args) for display, read a
+// few frames late: each copy() goes into its own slot behind a fence and
+// read() takes the newest slot whose fence has passed, so it never waits.
+#define READBACK_SLOTS 3
+
+struct GpuReadback {
+	Buffer<GL_SHADER_STORAGE_BUFFER> slots[READBACK_SLOTS];
+	GLsync fences[READBACK_SLOTS];
+	u32 next;
+
+	static GpuReadback make(u32 size) {
+		GpuReadback rb;
+		for (u32 i = 0; i < READBACK_SLOTS; ++i) {
+			rb.slots[i] = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, size);
+			rb.fences[i] = 0;
+		}
+		rb.next = 0;
+		return rb;
+	}
+
+	// from a pass that has src as FG_CPU_READ, so the shader writes are visible
+	void copy(GpuRange src) {
+		Buffer<GL_SHADER_STORAGE_BUFFER>& dst = slots[next];
+		assert(src.size <= dst.size);
+		GL(glCopyNamedBufferSubData(src.id, dst.id, src.offset, dst.offset, src.size));
+		if (fences[next]) glDeleteSync(fences[next]);
+		fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		next = (next + 1) % READBACK_SLOTS;
+	}
+
+	// false until the first copy is done
+	bool read(void* dst) {
+		for (u32 i = 1; i <= READBACK_SLOTS; ++i) {
+			const u32 s = (next + READBACK_SLOTS - i) % READBACK_SLOTS;
+			if (!fences[s]) continue;
+			const GLenum res = glClientWaitSync(fences[s], 0, 0);
+			if (res != GL_ALREADY_SIGNALED && res != GL_CONDITION_SATISFIED) continue;
+			slots[s].read(dst);
+			return true;
+		}
+		return false;
+	}
+
+	void destroy() {
+		for (u32 i = READBACK_SLOTS; i--; ) {
+			if (fences[i]) glDeleteSync(fences[i]);
+			slots[i].destroy();
+		}
+	}
 };
 
 struct Camera {
@@ -271,22 +1164,842 @@ Camera camera;
 const float CAMERA_SPEED = 0.2;
 char key_state[512];
 
+enum RenderMode : int {
+	RENDER_SPHERES, // every particle, see ParticleDraw
+	RENDER_FLUID,   // one surface at reduced resolution, see ssf.h
+	RENDER_MESH,    // marching cubes over a density grid, see marching_cubes.h
+	RENDER_VOLUME,  // density grid raymarched per pixel, see volume.h
+	RENDER_POINTS,  // every particle, rasterized in compute, see point_raster.h
+};
+
 struct {
 	f32 _sph_mass = 0.5;
 	f32 _sph_radius = 1.2;
 	f32 _target_density = 4.5;
 	f32 _pressure_mul = 1000.0f;  // was 500.0f; // was 250.0;
+	bool _periodic[3] = { false, false, false }; // wrap instead of clamp-and-reflect, per axis
+	bool _specialize_radius = false; // bake _sph_radius into the kernels, recompiles on change
+	int _pipeline_mode = PIPELINE_THROUGHPUT;
+	bool _impostors = true; // ray cast spheres on one quad each instead of instancing the sphere mesh
+	bool _surface_only = true; // skip particles the density pass found deep inside the fluid
+	int _render_mode = RENDER_SPHERES;
+	f32 _ssf_scale = 0.5f; // of the window, for the screen-space fluid targets
+	int _mc_cells = 48;      // marching cubes grid, per axis
+	f32 _mc_threshold = 0.05f; // of the iso level, density change that re-extracts a block
+	int _vol_cells = 64;         // density volume grid, per axis
+	f32 _vol_extinction = 4.0f;  // per unit length at the target density
 } config;
 
-int main() {
+SimParams buildSimParams(Vec3 box_size) {
+	const f32 r4 = powf(config._sph_radius, 4.0f);
+	SimParams p = {};
+	p.bbox_size = box_size;
+	p.sph_mass = config._sph_mass;
+	p.sph_radius = config._sph_radius;
+	p.target_density = config._target_density;
+	p.pressure_mul = config._pressure_mul;
+	p.particle_count = PARTICLE_COUNT;
+	p.kernel_norm = 6.0f / (PI * r4);
+	p.kernel_der_norm = 12.0f / (PI * r4);
+	return p;
+}
+
+// set while the _sph_radius slider is held; the radius only gets baked in
+// once it's let go, a drag would compile a variant per value it passes
+bool sph_radius_dragging = false;
+
+// Compile-time constants for the current config. Each distinct set selects
+// (and on first use compiles) its own variant from shader_cache. With
+// runtime_count the particle count comes from SimParams instead, for the
+// co-simulation's GPU part, whose size changes every step.
+ShaderDefines simDefines(bool runtime_count = false) {
+	ShaderDefines d = ShaderDefines::make();
+	if (!runtime_count)
+		d.setInt("PARTICLE_COUNT", PARTICLE_COUNT);
+	d.setInt("WORKGROUP_SIZE", WORKGROUP_SIZE);
+	d.setInt("PERIODIC_X", config._periodic[0]);
+	d.setInt("PERIODIC_Y", config._periodic[1]);
+	d.setInt("PERIODIC_Z", config._periodic[2]);
+	if (config._specialize_radius && !sph_radius_dragging)
+		d.setFloat("KERNEL_RADIUS", config._sph_radius);
+	return d;
+}
+
+#include "cpu_sph.h"
+
+// the 't' key, pushes everything away from at
+void pushParticles(SphParticle* particles, Vec3 at) {
+	jobs.parallelFor(PARTICLE_COUNT, 1024, [&](u32 begin, u32 end) {
+		for (u32 i = begin; i < end; ++i) {
+			particles[i].vel += (particles[i].pos - at) / v3(dot((particles[i].pos - at),(particles[i].pos - at))) * v3(3.0);
+		}
+	});
+}
+
+void initParticles(SphParticle* particles, u32 count = PARTICLE_COUNT, Vec3 extent = v3(4, 4, 4)) {
+	auto rand01 =[]() {
+		return (rand()/float(RAND_MAX));
+	};
+
+	for (u32 idx=0; idx<count; ++idx) {
+		particles[idx] = {
+			.pos = v3(rand01(),rand01(),rand01()) * extent, // + v3(rand()%10-5,rand()%10-5,rand()%10-5)/v3(25.0),
+			.density = 0.0f,
+			.vel = v3(0,0,0),
+			.interior = 0.0f,
+		};
+	}
+}
+
+#include "distributed.h"
+
+// GPU sim state and the passes that step it, shared by the windowed and the
+// headless loop
+struct Sim {
+	SimParams params;
+	Buffer<GL_UNIFORM_BUFFER> params_buf;
+	GpuScope scope; // everything below is released as a unit
+	StateRing ring;
+	Buffer<GL_SHADER_STORAGE_BUFFER> density_buf; // density pass output, force pass input
+
+	u32 params_res;
+	u32 state_res[STATE_RING_SIZE];
+	u32 density_res;
+
+	Job* cpu_job; // CPU step in flight, see kickCpuStep()
+
+	static Sim make(FrameGraph& fg, SphParticle* init, Vec3 box_size) {
+		Sim sim;
+		sim.cpu_job = NULL;
+		sim.params = buildSimParams(box_size);
+		sim.params_buf = Buffer<GL_UNIFORM_BUFFER>::make(&sim.params, sizeof(sim.params));
+
+		sim.scope = gpu_arena.pushScope();
+		sim.ring = StateRing::make(init, sizeof(SphParticle) * PARTICLE_COUNT);
+		sim.density_buf = Buffer<GL_SHADER_STORAGE_BUFFER>::make(init, sizeof(SphParticle) * PARTICLE_COUNT);
+
+		sim.params_res = fg.addBuffer("sim_params", sim.params_buf.range());
+		for (u32 i = 0; i < STATE_RING_SIZE; ++i)
+			sim.state_res[i] = fg.addBuffer("state", sim.ring.slots[i].range());
+		sim.density_res = fg.addBuffer("density", sim.density_buf.range());
+		return sim;
+	}
+
+	// only touches the UBO when something actually changed
+	void updateParams(Vec3 box_size) {
+		SimParams p = buildSimParams(box_size);
+		if (memcmp(&p, &params, sizeof(p))) {
+			params = p;
+			params_buf.write(&params);
+		}
+	}
+
+	// one step from ring.head into ring.next()
+	void addStepPasses(FrameGraph& fg, Shader* density, Shader* force) {
+		const u32 groups = (PARTICLE_COUNT + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE;
+		const u32 in = ring.head;
+		const u32 out = ring.next();
+		StateRing* r = &ring;
+
+		fg.addPass("density", [=]() {
+			density->execute(groups, 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res[in], FG_SSBO_READ, 0)
+		.writes(density_res, 1);
+
+		fg.addPass("force", [=]() {
+			force->execute(groups, 1, 1);
+			r->advance();
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(density_res, FG_SSBO_READ, 0)
+		.writes(state_res[out], 1);
+	}
+
+	// CPU solver step, uploaded into ring.next()
+	// The CPU solver steps in a job, off the main thread, so a slow step
+	// never holds up a frame. The frame graph only uploads finished ones.
+	void kickCpuStep(CpuSph* cpu, SphParticle* staging, bool push, Vec3 push_at) {
+		if (cpu_job) return;
+		const SimParams p = params;
+		const bool periodic[3] = { config._periodic[0], config._periodic[1], config._periodic[2] };
+
+		Job* step = jobs.create([=]() {
+			cpu->step(p, periodic);
+			cpu->store(staging);
+		});
+		if (push) {
+			Job* push_job = jobs.create([=]() {
+				cpu->store(staging);
+				pushParticles(staging, push_at);
+				cpu->load(staging);
+			});
+			jobs.dependsOn(step, push_job);
+			jobs.run(push_job);
+		}
+		jobs.run(step);
+		cpu_job = step;
+	}
+
+	bool cpuStepDone() {
+		return cpu_job && jobs.done(cpu_job);
+	}
+
+	// uploads the finished step into the next ring slot
+	void addCpuStepPass(FrameGraph& fg, SphParticle* staging) {
+		assert(cpuStepDone());
+		cpu_job = NULL;
+		const u32 out = ring.next();
+		StateRing* r = &ring;
+
+		fg.addPass("cpu upload", [=]() {
+			r->slots[out].write(staging);
+			r->advance();
+		})
+		.access(state_res[out], FG_CPU_WRITE, 0);
+	}
+
+	void destroy() {
+		if (cpu_job) jobs.wait(cpu_job);
+		density_buf.destroy();
+		ring.destroy();
+		gpu_arena.popScope(scope);
+		params_buf.destroy();
+	}
+};
+
+#include "cosim.h"
+
+// GPU driven particle draws. A compute pass (particle-cull.glsl) tests each
+// particle's sphere against the view frustum and appends the visible ones
+// to an instance list, and the draw is indirect with the instance count the
+// pass wrote, so visibility never goes through the CPU.
+//  - impostors: one list, one glDrawArraysIndirect of a quad per particle
+//  - sphere mesh: the pass also picks a LOD by projected size, one list
+//    per LOD, one glMultiDrawElementsIndirect for all of them
+//
+// Occlusion is two phase, against a Hi-Z pyramid (hiz.h) of this frame:
+//  - early: cull and draw what was visible last frame, then build the
+//    pyramid from that depth
+//  - late: cull everything against the pyramid, remember what passed for
+//    the next frame and draw those the early phase didn't
+// Particles barely move between frames, so the early phase draws nearly
+// all occluders and the late one little more than what came into view.
+#define SPHERE_LODS 4
+static_assert(SPHERE_LODS <= MAX_MESH_LODS && SPHERE_LODS == 4, "the thresholds go to particle-cull.glsl as a vec4");
+
+#define CULL_EARLY 0
+#define CULL_LATE  1
+
+#include "hiz.h"
+#include "ssf.h"
+
+struct SphereLodLevel {
+	u32 rings;
+	u32 segments;
+	f32 min_pixels; // projected radius from which on this level is used
+};
+
+const SphereLodLevel sphere_lods[SPHERE_LODS] = {
+	{ 16, 16, 16.0f }, // 242 vertices
+	{ 10, 12,  8.0f }, // 110
+	{  6,  8,  4.0f }, // 42
+	{  4,  6,  0.0f }, // 20
+};
+
+// glMultiDrawElementsIndirect's layout
+struct DrawElementsCommand {
+	u32 count;
+	u32 instance_count;
+	u32 first_index;
+	u32 base_vertex;
+	u32 base_instance;
+};
+
+// glDrawArraysIndirect's layout
+struct DrawArraysCommand {
+	u32 count;
+	u32 instance_count;
+	u32 first;
+	u32 base_instance;
+};
+
+// what particle-cull.glsl writes, per draw path
+struct LodCommands {
+	DrawElementsCommand draws[2][SPHERE_LODS]; // per phase
+	u32 surface;    // particles left after the interior ones
+	u32 in_frustum; // of those
+};
+
+struct ImpostorCommands {
+	DrawArraysCommand draws[2];
+	u32 surface;
+	u32 in_frustum;
+};
+
+struct ParticleDraw {
+	Buffer<GL_DRAW_INDIRECT_BUFFER> lod_commands;
+	Buffer<GL_DRAW_INDIRECT_BUFFER> impostor_commands;
+	Buffer<GL_SHADER_STORAGE_BUFFER> instances;  // a list of PARTICLE_COUNT ids per phase and LOD, impostors use one per phase
+	Buffer<GL_SHADER_STORAGE_BUFFER> visibility; // per particle, drawn last frame
+	LodCommands lod_reset; // what the commands start each frame as
+	ImpostorCommands impostor_reset;
+	u32 verts[SPHERE_LODS];
+
+	// the commands a few frames late, only for display
+	GpuReadback lod_stats;
+	GpuReadback impostor_stats;
+	LodCommands lod_last;
+	ImpostorCommands impostor_last;
+
+	u32 lod_commands_res;
+	u32 impostor_commands_res;
+	u32 instances_res;
+	u32 visibility_res;
+
+	static ParticleDraw make(FrameGraph& fg, const Mesh& mesh, Buffer<GL_ELEMENT_ARRAY_BUFFER> ibo) {
+		assert(mesh.num_lods == SPHERE_LODS);
+		ParticleDraw d = {};
+		for (u32 phase = 0; phase < 2; ++phase) {
+			for (u32 i = 0; i < SPHERE_LODS; ++i) {
+				const MeshLod& lod = mesh.lods[i];
+				d.lod_reset.draws[phase][i] = { lod.num_indices, 0, (u32)(ibo.offset / sizeof(u32)) + lod.first_index,
+																				lod.base_vertex, (phase * SPHERE_LODS + i) * PARTICLE_COUNT };
+			}
+			d.impostor_reset.draws[phase] = { 4, 0, 0, phase * PARTICLE_COUNT };
+		}
+		for (u32 i = 0; i < SPHERE_LODS; ++i)
+			d.verts[i] = mesh.lods[i].num_verts;
+
+		d.lod_commands = Buffer<GL_DRAW_INDIRECT_BUFFER>::make(&d.lod_reset, sizeof(d.lod_reset));
+		d.impostor_commands = Buffer<GL_DRAW_INDIRECT_BUFFER>::make(&d.impostor_reset, sizeof(d.impostor_reset));
+		d.instances = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, sizeof(u32) * PARTICLE_COUNT * SPHERE_LODS * 2);
+		u32* none = (u32*)calloc(PARTICLE_COUNT, sizeof(u32));
+		d.visibility = Buffer<GL_SHADER_STORAGE_BUFFER>::make(none, sizeof(u32) * PARTICLE_COUNT);
+		free(none);
+		d.lod_stats = GpuReadback::make(sizeof(d.lod_reset));
+		d.impostor_stats = GpuReadback::make(sizeof(d.impostor_reset));
+
+		d.lod_commands_res = fg.addBuffer("lod_commands", d.lod_commands.range());
+		d.impostor_commands_res = fg.addBuffer("impostor_commands", d.impostor_commands.range());
+		d.instances_res = fg.addBuffer("instances", d.instances.range());
+		d.visibility_res = fg.addBuffer("visibility", d.visibility.range());
+		return d;
+	}
+
+	u32 commandsRes(bool impostors) {
+		return impostors ? impostor_commands_res : lod_commands_res;
+	}
+
+	// Of the newest counts read back. Per phase, or both for phase < 0.
+	u32 drawn(bool impostors, i32 phase = -1) {
+		u32 n = 0;
+		for (u32 p = 0; p < 2; ++p) {
+			if (phase >= 0 && (u32)phase != p) continue;
+			if (impostors) {
+				n += impostor_last.draws[p].instance_count;
+			} else {
+				for (u32 i = 0; i < SPHERE_LODS; ++i)
+					n += lod_last.draws[p][i].instance_count;
+			}
+		}
+		return n;
+	}
+
+	u32 inFrustum(bool impostors) {
+		return impostors ? impostor_last.in_frustum : lod_last.in_frustum;
+	}
+
+	u32 surface(bool impostors) {
+		return impostors ? impostor_last.surface : lod_last.surface;
+	}
+
+	u32 lodDrawn(u32 lod) {
+		return lod_last.draws[CULL_EARLY][lod].instance_count + lod_last.draws[CULL_LATE][lod].instance_count;
+	}
+
+	// vertex shader invocations, about
+	u32 vertexCount(bool impostors) {
+		if (impostors) return 4 * drawn(true);
+		u32 n = 0;
+		for (u32 i = 0; i < SPHERE_LODS; ++i)
+			n += lodDrawn(i) * verts[i];
+		return n;
+	}
+
+	void addResetPass(FrameGraph& fg, bool impostors) {
+		ParticleDraw* d = this;
+		lod_stats.read(&lod_last);
+		impostor_stats.read(&impostor_last);
+
+		fg.addPass("cull reset", [=]() {
+			if (impostors)
+				d->impostor_commands.write(&d->impostor_reset);
+			else
+				d->lod_commands.write(&d->lod_reset);
+		})
+		.access(commandsRes(impostors), FG_CPU_WRITE, 0);
+	}
+
+	// the late phase reads hiz, the early one reads what the late one left in
+	// visibility the frame before
+	void addCullPass(FrameGraph& fg, Shader* cull, bool impostors, bool surface_only, u32 phase, HiZ* hiz,
+									 u32 state_res, u32 params_res) {
+		FgPass& pass = fg.addPass(phase == CULL_EARLY ? "cull early" : "cull late", [=]() {
+			if (phase == CULL_LATE) hiz->bind(0);
+			cull->setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
+			cull->setUniform("_view", camera.viewMat());
+			cull->setUniform("_viewport", v2(WINDOW_WIDTH, WINDOW_HEIGHT));
+			cull->setUniform("_lod_min_pixels", v4(sphere_lods[0].min_pixels, sphere_lods[1].min_pixels,
+																						 sphere_lods[2].min_pixels, sphere_lods[3].min_pixels));
+			cull->setUniform("_phase", (i32)phase);
+			cull->setUniform("_surface_only", (i32)surface_only);
+			cull->execute((PARTICLE_COUNT + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 0)
+		.writes(commandsRes(impostors), 1)
+		.writes(instances_res, 2)
+		.writes(visibility_res, 3);
+		if (phase == CULL_LATE)
+			pass.reads(hiz->res, FG_TEXTURE_READ);
+	}
+
+	void addDrawPass(FrameGraph& fg, Shader* shader, bool impostors, u32 phase, GLuint vao,
+									 u32 state_res, u32 params_res, u32 target_res) {
+		ParticleDraw* d = this;
+		fg.addPass(phase == CULL_EARLY ? "particles early" : "particles late", [=]() {
+			shader->setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
+			shader->setUniform("_view", camera.viewMat());
+			gl_state.bindVertexArray(vao);
+			d->draw(shader, impostors, phase);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 1)
+		.reads(commandsRes(impostors), FG_INDIRECT_READ)
+		.reads(instances_res, FG_VERTEX_READ)
+		.renders(target_res);
+	}
+
+	// after the draws, copies the counts for display
+	void addStatsPass(FrameGraph& fg, bool impostors) {
+		ParticleDraw* d = this;
+		fg.addPass("cull stats", [=]() {
+			if (impostors)
+				d->impostor_stats.copy(d->impostor_commands.range());
+			else
+				d->lod_stats.copy(d->lod_commands.range());
+		})
+		.access(commandsRes(impostors), FG_CPU_READ, 0);
+	}
+
+	void draw(Shader* shader, bool impostors, u32 phase) {
+		gl_state.useProgram(shader->id);
+		if (impostors) { // no vertex data, impostor-vs.glsl goes by gl_VertexID
+			impostor_commands.bind();
+			GL(glDrawArraysIndirect(GL_TRIANGLE_STRIP,
+															(void*)(uintptr_t)(impostor_commands.offset + phase * sizeof(DrawArraysCommand))));
+		} else {
+			lod_commands.bind();
+			GL(glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+																		 (void*)(uintptr_t)(lod_commands.offset + phase * sizeof(lod_reset.draws[0])),
+																		 SPHERE_LODS, 0));
+		}
+	}
+
+	void destroy() {
+		impostor_stats.destroy();
+		lod_stats.destroy();
+		visibility.destroy();
+		instances.destroy();
+		impostor_commands.destroy();
+		lod_commands.destroy();
+	}
+};
+
+#include "marching_cubes.h"
+#include "volume.h"
+#include "point_raster.h"
+
+#ifdef __linux__
+// Offscreen context for batch runs, no display or window system needed.
+// Prefers Mesa's surfaceless platform, otherwise whatever the default
+// display is, as long as it can make a context current without a surface.
+bool createHeadlessContext() {
+	EGLDisplay dpy = EGL_NO_DISPLAY;
+	const char* client_exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay && client_exts && strstr(client_exts, "EGL_MESA_platform_surfaceless"))
+		dpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (dpy == EGL_NO_DISPLAY)
+		dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, &major, &minor)) {
+		printf("Failed to initialize EGL!\n");
+		return false;
+	}
+	if (!strstr(eglQueryString(dpy, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context")) {
+		printf("EGL display can't do surfaceless contexts!\n");
+		return false;
+	}
+	eglBindAPI(EGL_OPENGL_API);
+
+	const EGLint config_attrs[] = {
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_SURFACE_TYPE, 0,
+		EGL_NONE,
+	};
+	EGLConfig config;
+	EGLint num_configs = 0;
+	if (!eglChooseConfig(dpy, config_attrs, &config, 1, &num_configs) || !num_configs) {
+		printf("No EGL config for desktop GL!\n");
+		return false;
+	}
+
+	const EGLint ctx_attrs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+#ifndef NDEBUG
+		EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+#endif
+		EGL_NONE,
+	};
+	EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, ctx_attrs);
+	if (ctx == EGL_NO_CONTEXT || !eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx)) {
+		printf("Failed to create a GL 4.5 core context! (EGL error 0x%x)\n", eglGetError());
+		return false;
+	}
+	return true;
+}
+#endif
+
+// CPU solver without any GL at all
+int runHeadlessCpu(u32 steps) {
+	const f64 ticks_to_ms = 1000.0 / SDL_GetPerformanceFrequency();
+
+	static SphParticle particles[PARTICLE_COUNT];
+	initParticles(particles);
+	CpuSph cpu = CpuSph::make(PARTICLE_COUNT);
+	cpu.load(particles);
+	const SimParams params = buildSimParams(v3(10, 10, 10));
+
+	f64 step_min = 1e30, step_max = 0, run_ms = 0;
+	for (u32 step = 0; step < steps; ++step) {
+		const u64 t0 = SDL_GetPerformanceCounter();
+		cpu.step(params, config._periodic);
+		const f64 ms = (SDL_GetPerformanceCounter() - t0) * ticks_to_ms;
+		step_min = min(step_min, ms);
+		step_max = max(step_max, ms);
+		run_ms += ms;
+	}
+
+	printf("%u steps of %u particles on %u cpu threads (%s)\n", steps, PARTICLE_COUNT,
+				 jobs.threads(), simdIsaName(cpu.simd->isa));
+	printf("  run:   %.1f ms, %.2f ms/step, %.1f steps/s\n", run_ms, run_ms / max(steps, 1u),
+				 steps * 1000.0 / max(run_ms, 1e-3));
+	if (steps)
+		printf("  step:  %.3f / %.3f / %.3f ms (min / avg / max)\n", step_min, run_ms / steps, step_max);
+
+	cpu.destroy();
+	return 0;
+}
+
+#define SIMD_BENCH_QUERIES 256
+#define SIMD_BENCH_STEPS 10
+
+// Every SIMD build of the SPH kernels this CPU can run, against the scalar
+// one: first the bare pair loops over all particles, then whole CpuSph steps,
+// whose result is also checked against the scalar run.
+int runSimdBench() {
+	const f64 ticks_to_ms = 1000.0 / SDL_GetPerformanceFrequency();
+
+	static SphParticle initial[PARTICLE_COUNT];
+	static SphParticle result[PARTICLE_COUNT];
+	static SphParticle reference[PARTICLE_COUNT];
+	initParticles(initial);
+	const SimParams params = buildSimParams(v3(10, 10, 10));
+
+	CpuSph cpu = CpuSph::make(PARTICLE_COUNT);
+	cpu.load(initial);
+	cpu.step(params, config._periodic); // realistic densities for the force rows
+	const SphKernelParams& kp = cpu.kernel_params;
+
+	printf("%u particles, %u cpu threads, best isa %s\n", PARTICLE_COUNT, jobs.threads(),
+				 simdIsaName(simdBestIsa()));
+	printf("  isa     width  density ns/pair  force ns/pair   ms/step  speedup  max pos diff\n");
+
+	f64 scalar_ms = 0;
+	for (u32 i = 0; i < SIMD_ISA_COUNT; ++i) {
+		const SimdKernels* simd = simdKernels((SimdIsa)i);
+		if (!simd) continue;
+
+		// bare kernels, every particle against the first SIMD_BENCH_QUERIES
+		const u64 pairs = (u64)SIMD_BENCH_QUERIES * PARTICLE_COUNT;
+		u64 t0 = SDL_GetPerformanceCounter();
+		for (u32 s = 0; s < SIMD_BENCH_QUERIES; ++s) {
+			const f32 q[3] = { cpu.pos[0][s], cpu.pos[1][s], cpu.pos[2][s] };
+			cpu.density[s] = simd->sphDensityRow(kp, cpu.pos, 0, PARTICLE_COUNT, q);
+		}
+		const f64 density_ns = (SDL_GetPerformanceCounter() - t0) * ticks_to_ms * 1e6 / pairs;
+		t0 = SDL_GetPerformanceCounter();
+		for (u32 s = 0; s < SIMD_BENCH_QUERIES; ++s) {
+			const f32 q[3] = { cpu.pos[0][s], cpu.pos[1][s], cpu.pos[2][s] };
+			f32 f[3] = {};
+			simd->sphForceRow(kp, cpu.pos, cpu.density, s + 1, PARTICLE_COUNT, q, 0.0f, f);
+		}
+		const f64 force_ns = (SDL_GetPerformanceCounter() - t0) * ticks_to_ms * 1e6 / pairs;
+
+		// whole steps from the same start
+		CpuSph run = CpuSph::make(PARTICLE_COUNT);
+		run.simd = simd;
+		run.load(initial);
+		t0 = SDL_GetPerformanceCounter();
+		for (u32 step = 0; step < SIMD_BENCH_STEPS; ++step)
+			run.step(params, config._periodic);
+		const f64 step_ms = (SDL_GetPerformanceCounter() - t0) * ticks_to_ms / SIMD_BENCH_STEPS;
+		run.store(i == SIMD_SCALAR ? reference : result);
+		run.destroy();
+
+		f32 diff = 0;
+		if (i == SIMD_SCALAR) {
+			scalar_ms = step_ms;
+		} else {
+			for (u32 p = 0; p < PARTICLE_COUNT; ++p)
+				diff = max(diff, length(result[p].pos - reference[p].pos));
+		}
+		printf("  %-7s %5u  %15.3f  %13.3f  %8.2f  %6.2fx  %g\n", simdIsaName(simd->isa), simd->width,
+					 density_ns, force_ns, step_ms, scalar_ms / step_ms, diff);
+	}
+
+	cpu.destroy();
+	return 0;
+}
+
+#define HEADLESS_TIMER_QUERIES 64
+
+// Batch mode: offscreen context, no window, no ImGui, no events. Runs steps
+// sim steps back to back and prints where the time went.
+int runHeadless(u32 steps, bool cpu_sim, bool cosim) {
+	if (cpu_sim)
+		return runHeadlessCpu(steps);
+#ifdef __linux__
+	const u64 start = SDL_GetPerformanceCounter();
+	const f64 ticks_to_ms = 1000.0 / SDL_GetPerformanceFrequency();
+
+	if (!createHeadlessContext())
+		return 1;
+	auto getProc = [](const char* name) { return (void*)eglGetProcAddress(name); };
+	if (!gladLoadGLLoader(getProc)) {
+		printf("Failed to load OpenGL!\n");
+		return 1;
+	}
+	initGlDebug();
+	initParallelShaderCompile(getProc);
+	gpu_arena.init(1 << 16);
+	program_cache.init();
+
+	static SphParticle particles[PARTICLE_COUNT];
+	initParticles(particles);
+
+	FrameGraph fg = FrameGraph::make();
+	Sim sim = Sim::make(fg, particles, v3(10, 10, 10));
+	CoSim co = {};
+	if (cosim)
+		co = CoSim::make(fg, particles, sim.params);
+
+	// nothing to draw while waiting, so just spin until both are built
+	Shader* force = NULL;
+	Shader* density = NULL;
+	const ShaderDefines sim_defines = simDefines(cosim);
+	while (!force || !density) {
+		shader_cache.poll();
+		force   = shader_cache.compute("compute.glsl", sim_defines, force);
+		density = shader_cache.compute("compute-density.glsl", sim_defines, density);
+		if (!shader_cache.pending() && (!force || !density)) {
+			printf("Failed to build the sim shaders!\n");
+			return 1;
+		}
+	}
+	const u64 setup_end = SDL_GetPerformanceCounter();
+
+	// GPU timestamps around each step, read back HEADLESS_TIMER_QUERIES steps
+	// later so reading never waits on anything but a GPU that's that far behind
+	GLuint queries[HEADLESS_TIMER_QUERIES][2];
+	GL(glGenQueries(HEADLESS_TIMER_QUERIES * 2, &queries[0][0]));
+	f64 gpu_min = 1e30, gpu_max = 0, gpu_sum = 0;
+	auto collect = [&](u32 step) {
+		GLuint64 begin = 0, end = 0;
+		GL(glGetQueryObjectui64v(queries[step % HEADLESS_TIMER_QUERIES][0], GL_QUERY_RESULT, &begin));
+		GL(glGetQueryObjectui64v(queries[step % HEADLESS_TIMER_QUERIES][1], GL_QUERY_RESULT, &end));
+		const f64 ms = (end - begin) / 1e6;
+		gpu_min = min(gpu_min, ms);
+		gpu_max = max(gpu_max, ms);
+		gpu_sum += ms;
+	};
+
+	f64 cosim_cpu_ms = 0, cosim_gpu_ms = 0;
+	f64 cosim_ghosts = 0.0; // both sides' ghosts per particle, summed over the steps
+	f32 cosim_ghosts_max = 0.0f;
+	for (u32 step = 0; step < steps; ++step) {
+		if (step >= HEADLESS_TIMER_QUERIES)
+			collect(step - HEADLESS_TIMER_QUERIES);
+
+		GL(glQueryCounter(queries[step % HEADLESS_TIMER_QUERIES][0], GL_TIMESTAMP));
+		fg.begin();
+		if (cosim)
+			co.addStepPasses(fg, &sim, density, force, false, v3(0, 0, 0));
+		else
+			sim.addStepPasses(fg, density, force);
+		fg.execute();
+		GL(glQueryCounter(queries[step % HEADLESS_TIMER_QUERIES][1], GL_TIMESTAMP));
+		if (cosim) {
+			// each side's time for the step merged just now
+			co.wait();
+			if (co.steps) {
+				cosim_cpu_ms += co.cpu_ms;
+				cosim_gpu_ms += co.gpu_ms;
+			}
+			const f32 ghosts = (f32)(co.cpu_ghosts + co.gpu_ghosts) / PARTICLE_COUNT;
+			cosim_ghosts += ghosts;
+			cosim_ghosts_max = max(cosim_ghosts_max, ghosts);
+		}
+
+		gl_state.endFrame();
+		gpu_arena.endFrame();
+	}
+	for (u32 step = steps > HEADLESS_TIMER_QUERIES ? steps - HEADLESS_TIMER_QUERIES : 0; step < steps; ++step)
+		collect(step);
+	GL(glFinish());
+	const u64 end = SDL_GetPerformanceCounter();
+
+	const f64 run_ms = (end - setup_end) * ticks_to_ms;
+	printf("%u steps of %u particles\n", steps, PARTICLE_COUNT);
+	printf("  setup: %.1f ms (%u programs cached, %u compiled)\n", (setup_end - start) * ticks_to_ms,
+				 program_cache.hits, program_cache.misses + program_cache.rejected);
+	printf("  run:   %.1f ms, %.2f ms/step, %.1f steps/s\n", run_ms, run_ms / max(steps, 1u),
+				 steps * 1000.0 / max(run_ms, 1e-3));
+	if (steps)
+		printf("  gpu:   %.3f / %.3f / %.3f ms/step (min / avg / max)\n",
+					 gpu_min, gpu_sum / steps, gpu_max);
+	if (cosim && co.steps)
+		printf("  cosim: split at x = %.2f, cpu %u + %u ghosts / gpu %u + %u ghosts, "
+					 "cpu %.3f / gpu %.3f ms/step (%u threads, %s)\n",
+					 co.split, co.cpu_owned, co.cpu_ghosts, co.gpu_owned, co.gpu_ghosts,
+					 cosim_cpu_ms / co.steps, cosim_gpu_ms / co.steps, jobs.threads(), simdIsaName(co.cpu.simd->isa));
+	bool ok = true;
+	if (cosim) {
+		// the halo must stay a thin slab, or both sides step nearly everything
+		const f32 avg = steps ? (f32)(cosim_ghosts / steps) : 0.0f;
+		printf("  cosim: %.1f%% extra particles stepped as ghosts (%.1f%% at most)\n", avg * 100.0f,
+					 cosim_ghosts_max * 100.0f);
+		// without walls along x nothing damps the sideways motion, and particles
+		// that fast rightly pull in most of the box
+		if (steps >= COSIM_GHOST_CHECK_STEPS && !config._periodic[0] && avg > COSIM_MAX_GHOSTS) {
+			printf("Co-simulation halo too wide, more than %.0f%% ghosts!\n", COSIM_MAX_GHOSTS * 100.0f);
+			ok = false;
+		}
+	}
+	if (cosim && steps) {
+		// the step still in flight against the same one on the CPU alone
+		static SphParticle reference[PARTICLE_COUNT];
+		co.wait();
+		memcpy(reference, co.all, sizeof(reference));
+		CpuSph cpu = CpuSph::make(PARTICLE_COUNT);
+		cpu.load(co.all);
+		cpu.step(sim.params, config._periodic);
+		cpu.store(reference);
+		cpu.destroy();
+
+		f32 change = 0.0f;
+		for (u32 i = 0; i < PARTICLE_COUNT; ++i)
+			change = max(change, length(reference[i].vel - co.all[i].vel));
+		const f32 err = co.velocityError(reference);
+		printf("  cosim: max velocity error %g against the cpu alone (largest change %g)\n", err, change);
+		if (!(err <= COSIM_MAX_ERROR * change)) {
+			printf("Co-simulation doesn't match a single solver!\n");
+			ok = false;
+		}
+	}
+
+	GL(glDeleteQueries(HEADLESS_TIMER_QUERIES * 2, &queries[0][0]));
+	shader_cache.destroy();
+	if (cosim)
+		co.destroy();
+	sim.destroy();
+	fg.destroy();
+	gpu_arena.destroy();
+	return ok ? 0 : 1;
+#else
+	printf("Headless mode needs EGL, which is only set up on Linux\n");
+	return 1;
+#endif
+}
+
+// final [--cpu | --cosim] [--threads N] [--headless [steps]] [--bench-simd] [--periodic [xyz]]
+//       [--ranks N | --rank R --hosts a,b,..] [--transport shm|tcp] [--port P] [--steps N] [--scaling]
+//       [--check]
+int main(int argc, char** argv) {
+	bool cpu_sim = false;   // step on the CPU solver instead of compute shaders
+	bool cosim = false;     // step on both, split along x, see cosim.h
+	u32 threads = 0;        // job system threads, 0 = all
+	bool headless = false;
+	u32 headless_steps = 1000;
+	bool bench_simd = false;
+	DistOptions dist = defaultDistOptions();
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--cpu")) {
+			cpu_sim = true;
+		} else if (!strcmp(argv[i], "--cosim")) {
+			cosim = true;
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = (u32)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--headless")) {
+			headless = true;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				headless_steps = (u32)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bench-simd")) {
+			bench_simd = true;
+		} else if (!strcmp(argv[i], "--periodic")) {
+			// the axes given, x alone without any
+			const char* axes = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "x";
+			for (u32 k = 0; k < 3; ++k)
+				config._periodic[k] = strchr(axes, 'x' + k) != NULL;
+		} else if (!parseDistArg(argc, argv, &i, &dist)) {
+			printf("usage: %s [--cpu | --cosim] [--threads N] [--headless [steps]] [--bench-simd] [--periodic [xyz]]\n"
+						 "       [--ranks N | --rank R --hosts a,b,..] [--transport shm|tcp] [--port P] [--steps N] [--scaling]\n"
+						 "       [--check]\n",
+						 argv[0]);
+			return 1;
+		}
+	}
+
+	cosim = cosim && !cpu_sim;
+
+	// ranks are separate processes with their own job systems
+	if (distRequested(dist))
+		return runDistributed(dist, threads);
+
+	jobs.init(threads);
+	if (bench_simd || headless) {
+		const int res = bench_simd ? runSimdBench() : runHeadless(headless_steps, cpu_sim, cosim);
+		jobs.destroy();
+		return res;
+	}
+
 	SDL_Init(SDL_INIT_EVERYTHING);
 	SDL_GL_SetAttribute( SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE );
 	SDL_GL_SetAttribute( SDL_GL_CONTEXT_MAJOR_VERSION, 4 );
 	SDL_GL_SetAttribute( SDL_GL_CONTEXT_MINOR_VERSION, 1 );
+#ifndef NDEBUG
+	SDL_GL_SetAttribute( SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG );
+#endif
 	SDL_Window* window = SDL_CreateWindow("imgd 4099 final",
 																				SDL_WINDOWPOS_UNDEFINED,
 																				SDL_WINDOWPOS_UNDEFINED,
-																				1280, 720,
+																				WINDOW_WIDTH, WINDOW_HEIGHT,
 																				SDL_WINDOW_OPENGL);
 	if (!window) {
 		printf("Failed to create window!");
@@ -302,55 +2015,103 @@ int main() {
 		printf("Failed to load OpenGL!\n");
 		return 1;
 	}
+	initGlDebug();
+	initParallelShaderCompile(SDL_GL_GetProcAddress);
+	gpu_arena.init(1 << 20); // scratch per frame, enough to restage the particles
 
 
 	GLuint vao;
 	GL(glCreateVertexArrays(1, &vao));
 
-	Shader compute_shader = Shader::make()
-					 											 .addStage<GL_COMPUTE_SHADER>("compute.glsl")
-					 											 .link();
-
-	Shader compute_shader2 = Shader::make()
-					 											 .addStage<GL_COMPUTE_SHADER>("compute-density.glsl")
-					 											 .link();
-
-
-  Shader render_shader = Shader::make()
-  															.addStage<GL_VERTEX_SHADER>("vertex.glsl")
-  															.addStage<GL_FRAGMENT_SHADER>("pixel.glsl")
-  															.link();
-
-  Shader floor_shader  = Shader::make()
-  															.addStage<GL_VERTEX_SHADER>("floor-vs.glsl")
-  															.addStage<GL_FRAGMENT_SHADER>("floor-ps.glsl")
-  															.link();
-
-	Mesh m = Mesh::makeSphere(0.3f, 16.0f, 16.0f);
-
+	// render programs only need the layout constants, sim programs get a
+	// variant per simDefines() set; all of them are looked up every frame
+	ShaderDefines render_defines = ShaderDefines::make();
+	render_defines.setInt("PARTICLE_COUNT", PARTICLE_COUNT);
+	render_defines.setFloat("PARTICLE_RADIUS", PARTICLE_DRAW_RADIUS);
+	render_defines.setInt("WORKGROUP_SIZE", WORKGROUP_SIZE);
+	ShaderDefines impostor_defines = render_defines;
+	impostor_defines.set("IMPOSTORS");
+	ShaderDefines ssf_defines = render_defines;
+	ssf_defines.set("ALL_PARTICLES");
+	ShaderDefines ssf_thickness_defines = ssf_defines;
+	ssf_thickness_defines.set("THICKNESS");
+
+	// Programs currently in use. They start out NULL and the passes that need
+	// them are skipped until the first build lands, so the window is up and
+	// responsive while shaders compile in the background.
+	Shader* compute_shader  = NULL;
+	Shader* compute_shader2 = NULL;
+	Shader* render_shader   = NULL;
+	Shader* impostor_shader = NULL;
+	Shader* cull_shader     = NULL; // + sphere mesh LODs
+	Shader* cull_impostor_shader = NULL;
+	Shader* hiz_shader      = NULL;
+	Shader* floor_shader    = NULL;
+	Shader* ssf_depth_shader     = NULL;
+	Shader* ssf_thickness_shader = NULL;
+	Shader* ssf_smooth_shader    = NULL;
+	Shader* ssf_composite_shader = NULL;
+	Shader* mc_splat_shader    = NULL;
+	Shader* mc_mark_shader     = NULL;
+	Shader* mc_freeze_shader   = NULL;
+	Shader* mc_count_shader    = NULL;
+	Shader* mc_scan_shader     = NULL;
+	Shader* mc_generate_shader = NULL;
+	Shader* mc_draw_shader     = NULL;
+	Shader* vol_resolve_shader = NULL;
+	Shader* vol_march_shader   = NULL;
+	Shader* point_raster_shader  = NULL; // the depth pass without 64-bit atomics
+	Shader* point_id_shader      = NULL;
+	Shader* point_resolve_shader = NULL;
+
+	program_cache.init();
+	const u64 shader_start = SDL_GetPerformanceCounter();
+	f64 shader_startup_ms = -1.0; // until everything requested at startup is built
+	bool warm_start = false;
+
+	// CPU-side setup, side by side on the job system
+	Mesh m;
+	static SphParticle particles[PARTICLE_COUNT];
+	Job* setup = jobs.create(JobFn());
+	jobs.run(jobs.create([&]() {
+		Mesh levels[SPHERE_LODS];
+		for (u32 i = 0; i < SPHERE_LODS; ++i)
+			levels[i] = Mesh::makeSphere(PARTICLE_DRAW_RADIUS, sphere_lods[i].rings, sphere_lods[i].segments);
+		m = Mesh::makeLods(levels, SPHERE_LODS);
+	}, setup));
+	jobs.run(jobs.create([&]() { initParticles(particles); }, setup));
+	jobs.run(setup);
+	jobs.wait(setup);
+	auto vbo = m.buildVbo();
+	auto ibo = m.buildIbo();
 
 	Vec3 box_size = v3(10, 10, 10);
 
-	Buffer<GL_SHADER_STORAGE_BUFFER> state_bufs[2];
-
-	SphParticle particles[PARTICLE_COUNT];
-	{ // initial state
-
-		auto rand01 =[]() {
-			return (rand()/float(RAND_MAX));
-		};
-
-		for (u32 idx=0; idx<PARTICLE_COUNT; ++idx) {
-			particles[idx] = {
-				.pos = v3(rand01(),rand01(),rand01()) * v3(4,4,4), // + v3(rand()%10-5,rand()%10-5,rand()%10-5)/v3(25.0),
-				.vel = v3(0,0,0),
-			};
-		}
-		for (u32 i=0; i<ARRAY_SIZE(state_bufs); ++i)
-			state_bufs[i] = Buffer<GL_SHADER_STORAGE_BUFFER>::make(particles, sizeof(particles));
+	FrameGraph fg = FrameGraph::make();
+	Sim sim = Sim::make(fg, particles, box_size);
+	CpuSph cpu = {};
+	static SphParticle cpu_staging[PARTICLE_COUNT]; // written by the CPU step job
+	if (cpu_sim) {
+		cpu = CpuSph::make(PARTICLE_COUNT);
+		cpu.load(particles);
 	}
-
-	glEnable(GL_DEPTH_TEST);
+	CoSim co = {};
+	if (cosim)
+		co = CoSim::make(fg, particles, sim.params);
+	StateRing& ring = sim.ring;
+	ParticleDraw particle_draw = ParticleDraw::make(fg, m, ibo);
+	HiZ hiz = HiZ::make(fg);
+	ScreenSpaceFluid ssf = ScreenSpaceFluid::make(fg, config._ssf_scale);
+	MarchingCubes mc = MarchingCubes::make(fg);
+	DensityVolume vol = DensityVolume::make(fg);
+	PointRaster points = PointRaster::make(fg);
+	ShaderDefines point_defines = render_defines;
+	if (points.atomic64) point_defines.set("ATOMIC_INT64");
+	ShaderDefines point_id_defines = render_defines;
+	point_id_defines.set("ID_PASS");
+	const u32 backbuffer_res = fg.addBuffer("backbuffer", {});
+
+	gl_state.enable(GL_DEPTH_TEST, true);
 
 
 	// Initialize IMGUI
@@ -363,7 +2124,18 @@ int main() {
 	ImGui_ImplSDL2_InitForOpenGL(window, glctx);
 	ImGui_ImplOpenGL3_Init();
 
-	auto vbo = m.buildVbo();
+	// vertex layout is VAO state, set it up once
+	gl_state.bindVertexArray(vao);
+	vbo.bind();
+	GL(glEnableVertexAttribArray(0));
+	GL(glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, (void*)(uintptr_t)vbo.offset));
+	GL(glVertexArrayElementBuffer(vao, ibo.id));
+	// particle ids, one per instance, from the visible lists
+	gl_state.bindBuffer(GL_ARRAY_BUFFER, particle_draw.instances.id);
+	GL(glEnableVertexAttribArray(1));
+	GL(glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, 0, (void*)(uintptr_t)particle_draw.instances.offset));
+	GL(glVertexAttribDivisor(1, 1));
+	u64 drawn_step = 0;
 	bool running = true;
 	while (running) {
 
@@ -405,12 +2177,138 @@ int main() {
 		if (ImGui::Begin("Config!")) {
 			ImGui::SliderFloat("_sph_mass", &config._sph_mass, 0.1f, 5.0f);
 			ImGui::SliderFloat("_sph_radius", &config._sph_radius, 0.1f, 2.0f);
+			sph_radius_dragging = ImGui::IsItemActive();
 			ImGui::SliderFloat("_target_density", &config._target_density, 0.1f, 5.0f);
 			ImGui::SliderFloat("_pressure_mul", &config._pressure_mul, 0.1f, 1000.f);
 
 			ImGui::SliderFloat("_box_size_x", &box_size.x, 1.0f, 40.f);
 			ImGui::SliderFloat("_box_size_y", &box_size.y, 1.0f, 40.f);
 			ImGui::SliderFloat("_box_size_z", &box_size.z, 1.0f, 40.f);
+
+			ImGui::Checkbox("_periodic_x", &config._periodic[0]);
+			ImGui::Checkbox("_periodic_y", &config._periodic[1]);
+			ImGui::Checkbox("_periodic_z", &config._periodic[2]);
+
+			ImGui::Checkbox("_specialize_radius", &config._specialize_radius);
+			ImGui::Checkbox("_impostors", &config._impostors);
+			ImGui::Checkbox("_surface_only", &config._surface_only);
+			ImGui::RadioButton("spheres", &config._render_mode, RENDER_SPHERES);
+			ImGui::SameLine();
+			ImGui::RadioButton("fluid surface", &config._render_mode, RENDER_FLUID);
+			ImGui::SameLine();
+			ImGui::RadioButton("mesh", &config._render_mode, RENDER_MESH);
+			ImGui::SameLine();
+			ImGui::RadioButton("volume", &config._render_mode, RENDER_VOLUME);
+			ImGui::SameLine();
+			ImGui::RadioButton("points", &config._render_mode, RENDER_POINTS);
+			ImGui::SliderFloat("_ssf_scale", &config._ssf_scale, 0.25f, 1.0f);
+			ImGui::SliderInt("_mc_cells", &config._mc_cells, MC_BLOCK, MC_MAX_CELLS);
+			ImGui::SliderFloat("_mc_threshold", &config._mc_threshold, 0.0f, 0.5f);
+			ImGui::SliderInt("_vol_cells", &config._vol_cells, VOL_BRICK, VOL_MAX_CELLS);
+			ImGui::SliderFloat("_vol_extinction", &config._vol_extinction, 0.1f, 20.0f);
+
+			ImGui::RadioButton("low latency", &config._pipeline_mode, PIPELINE_LATENCY);
+			ImGui::SameLine();
+			ImGui::RadioButton("throughput", &config._pipeline_mode, PIPELINE_THROUGHPUT);
+			if (ImGui::Button("save snapshot")) {
+				u64 step;
+				if (ring.readFinished(particles, &step)) {
+					char path[64];
+					snprintf(path, sizeof(path), "snapshot-%llu.bin", (unsigned long long)step);
+					FILE* f = fopen(path, "wb");
+					if (f) {
+						fwrite(particles, sizeof(particles), 1, f);
+						fclose(f);
+						printf("Saved %s\n", path);
+					}
+				} else {
+					printf("No finished sim step to snapshot yet\n");
+				}
+			}
+			if (config._render_mode == RENDER_MESH) {
+				ImGui::SameLine();
+				if (ImGui::Button("save mesh")) {
+					char path[64];
+					snprintf(path, sizeof(path), "mesh-%llu.obj", (unsigned long long)drawn_step);
+					if (mc.writeObj(path))
+						printf("Saved %s\n", path);
+				}
+			}
+
+			if (shader_startup_ms < 0)
+				ImGui::Text("compiling %u shader programs...", shader_cache.pending());
+			else
+				ImGui::Text("shader startup: %.1f ms (%s)", shader_startup_ms, warm_start ? "warm" : "cold");
+			if (shader_cache.failed())
+				ImGui::Text("%u shader programs failed to link, kept the previous ones", shader_cache.failed());
+			ImGui::Text("program binaries: %u cached, %u compiled, %u rejected",
+									program_cache.hits, program_cache.misses + program_cache.rejected,
+									program_cache.rejected);
+			ImGui::Text("gl state calls: %u issued, %u elided",
+									gl_state.last_frame.issued, gl_state.last_frame.elided);
+			if (config._render_mode == RENDER_SPHERES) {
+				const bool imp = config._impostors;
+				const u32 surface = particle_draw.surface(imp);
+				const u32 in_view = particle_draw.inFrustum(imp);
+				const u32 drawn_now = particle_draw.drawn(imp);
+				ImGui::Text("particles: %u / %u drawn (%u early, %u late), %u vertices", drawn_now, PARTICLE_COUNT,
+										particle_draw.drawn(imp, CULL_EARLY), particle_draw.drawn(imp, CULL_LATE),
+										particle_draw.vertexCount(imp));
+				ImGui::Text("  culled: %u interior, %u frustum, %u occluded", PARTICLE_COUNT - surface,
+										surface - in_view, in_view > drawn_now ? in_view - drawn_now : 0);
+				if (!imp)
+					ImGui::Text("  lods: %u / %u / %u / %u", particle_draw.lodDrawn(0), particle_draw.lodDrawn(1),
+											particle_draw.lodDrawn(2), particle_draw.lodDrawn(3));
+			} else if (config._render_mode == RENDER_MESH) {
+				ImGui::Text("mesh: %u triangles, %u / %u blocks extracted", mc.triangles(), mc.last.dirty_blocks,
+										mc.blockCount());
+			} else if (config._render_mode == RENDER_POINTS) {
+				ImGui::Text("points: %s", points.atomic64 ? "64-bit atomicMin" : "depth, then id (no 64-bit atomics)");
+			}
+			ImGui::Text("frame graph: %u passes, %u levels, %u barriers",
+									fg.stats.passes, fg.stats.levels, fg.stats.barriers);
+			if (ImGui::TreeNode("gpu time per pass")) {
+				f32 total = 0.0f;
+				for (u32 i = 0; i < fg.timings.count; ++i) {
+					ImGui::Text("%-16s %6.3f ms", fg.timings.names[i], fg.timings.ms[i]);
+					total += fg.timings.ms[i];
+				}
+				ImGui::Text("%-16s %6.3f ms", "total", total);
+				ImGui::TreePop();
+			}
+			if (cpu_sim) {
+				ImGui::Text("sim: cpu, %u threads, %s", jobs.threads(), simdIsaName(cpu.simd->isa));
+			} else if (cosim) {
+				ImGui::Text("sim: cpu below x = %.2f (%.0f%%), gpu above", co.split, co.cpu_share * 100.0f);
+				ImGui::Text("  cpu: %u + %u ghosts, %.2f ms, %u threads, %s", co.cpu_owned, co.cpu_ghosts, co.cpu_ms,
+										jobs.threads(), simdIsaName(co.cpu.simd->isa));
+				ImGui::Text("  gpu: %u + %u ghosts, %.2f ms", co.gpu_owned, co.gpu_ghosts, co.gpu_ms);
+			} else
+				ImGui::Text("sim: gpu");
+			for (u32 i = 0; i < jobs.threads(); ++i)
+				ImGui::Text("%s %u: %3.0f%% busy, %u jobs, %u stolen", i ? "worker" : "main", i,
+										jobs.last[i].utilization * 100.0f, jobs.last[i].jobs, jobs.last[i].steals);
+			ImGui::Text("state ring: drawing step %llu, newest %llu",
+									(unsigned long long)drawn_step, (unsigned long long)ring.steps[ring.head]);
+#ifndef NDEBUG
+			if (gl_debug.enabled) {
+				bool sync = gl_debug.sync;
+				if (ImGui::Checkbox("synchronous gl errors", &sync))
+					setGlDebugSync(sync);
+
+				const GLenum severities[] = { GL_DEBUG_SEVERITY_HIGH, GL_DEBUG_SEVERITY_MEDIUM,
+																			GL_DEBUG_SEVERITY_LOW, GL_DEBUG_SEVERITY_NOTIFICATION };
+				const char* names[] = { "high", "medium", "low", "all" };
+				int sev = 0;
+				while (severities[sev] != gl_debug.min_severity) ++sev;
+				if (ImGui::Combo("gl debug severity", &sev, names, ARRAY_SIZE(names)))
+					setGlDebugMinSeverity(severities[sev]);
+				ImGui::Text("gl errors: %u", gl_debug.errors);
+			}
+#endif
+			ImGui::Text("gpu memory: %.2f / %.2f MB (peak %.2f / %.2f MB)",
+									gpu_arena.used() / (1024.0 * 1024.0), gpu_arena.total / (1024.0 * 1024.0),
+									gpu_arena.peak_used / (1024.0 * 1024.0), gpu_arena.peak_total / (1024.0 * 1024.0));
 		}
 		ImGui::End();
 
@@ -422,27 +2320,6 @@ int main() {
 
 
 
-		auto swapBuf = [&]() {
-			for (u32 i=0; i<ARRAY_SIZE(state_bufs); ++i)
-				state_bufs[i].bindSsbo(i);
-
-			// pingpong
-			auto c = state_bufs[1];
-			state_bufs[1] = state_bufs[0];
-			state_bufs[0] = c;
-		};
-
-
-		if (key_state['t']) {
-			state_bufs[0].read(particles);
-			for (int i = 0; i < PARTICLE_COUNT; i++) {
-				particles[i].vel += (particles[i].pos - camera.at) / v3(dot((particles[i].pos - camera.at),(particles[i].pos - camera.at))) * v3(3.0);
-			}
-			state_bufs[0].write(particles);				
-		}
-
-		swapBuf();
-
 		if (key_state['x']) box_size.x += 0.1f;
 		if (key_state['u']) box_size.x -= 0.1f;
 
@@ -450,77 +2327,198 @@ int main() {
 		if (key_state['z']) box_size.z += 0.1f;
 		if (key_state['v']) box_size.z -= 0.1f;
 
-
-		compute_shader2.setUniform("_sph_mass", config._sph_mass);
-		compute_shader2.setUniform("_sph_radius", config._sph_radius);
-		compute_shader2.setUniform("_target_density", config._target_density);
-		compute_shader2.setUniform("_pressure_mul", config._pressure_mul);
-		compute_shader2.setUniform("_particle_count", PARTICLE_COUNT);
-
-
-		compute_shader2.execute(PARTICLE_COUNT, 1, 1);
-
-
-		swapBuf();
-
-
-		compute_shader.setUniform("_sph_mass", config._sph_mass);
-		compute_shader.setUniform("_sph_radius", config._sph_radius);
-		compute_shader.setUniform("_target_density", config._target_density);
-		compute_shader.setUniform("_pressure_mul", config._pressure_mul);
-
-		compute_shader.setUniform("_bbox_size", box_size);
-		compute_shader.setUniform("_particle_count", PARTICLE_COUNT);
-		// compute_shader.execute(PARTICLE_COUNT / (WORKGROUP_SIZE * WORKGROUP_SIZE) + (PARTICLE_COUNT % (WORKGROUP_SIZE * WORKGROUP_SIZE) > 0) , 1, 1);
-	
-		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-		compute_shader.execute(PARTICLE_COUNT, 1, 1);
-
-
-		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		sim.updateParams(box_size);
 
 
-		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		shader_cache.poll();
 
-		render_shader.setUniform("_sph_mass", config._sph_mass);
-		render_shader.setUniform("_sph_radius", config._sph_radius);
-		render_shader.setUniform("_target_density", config._target_density);
-		render_shader.setUniform("_pressure_mul", config._pressure_mul);
-
-		render_shader.setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
-		render_shader.setUniform("_view", camera.viewMat());
-
-
-		GL(glBindVertexArray(vao));
+		if (!cpu_sim) {
+			const ShaderDefines sim_defines = simDefines(cosim);
+			Shader* force   = shader_cache.compute("compute.glsl", sim_defines, compute_shader);
+			Shader* density = shader_cache.compute("compute-density.glsl", sim_defines, compute_shader2);
+			// the two sim passes only switch together, so they always agree on the variant
+			if ((force != compute_shader) == (density != compute_shader2)) {
+				compute_shader = force;
+				compute_shader2 = density;
+			}
+		}
+		{
+			render_shader = shader_cache.graphics("vertex.glsl", "pixel.glsl", render_defines, render_shader);
+			impostor_shader = shader_cache.graphics("impostor-vs.glsl", "impostor-ps.glsl", render_defines, impostor_shader);
+			cull_shader = shader_cache.compute("particle-cull.glsl", render_defines, cull_shader);
+			cull_impostor_shader = shader_cache.compute("particle-cull.glsl", impostor_defines, cull_impostor_shader);
+			hiz_shader    = shader_cache.compute("hiz-build.glsl", render_defines, hiz_shader);
+			floor_shader  = shader_cache.graphics("floor-vs.glsl", "floor-ps.glsl", render_defines, floor_shader);
+			ssf_depth_shader = shader_cache.graphics("impostor-vs.glsl", "ssf-splat-ps.glsl", ssf_defines, ssf_depth_shader);
+			ssf_thickness_shader = shader_cache.graphics("impostor-vs.glsl", "ssf-splat-ps.glsl", ssf_thickness_defines,
+																									 ssf_thickness_shader);
+			ssf_smooth_shader = shader_cache.compute("ssf-smooth.glsl", render_defines, ssf_smooth_shader);
+			ssf_composite_shader = shader_cache.graphics("fullscreen-vs.glsl", "ssf-composite-ps.glsl", render_defines,
+																									 ssf_composite_shader);
+			mc_splat_shader    = shader_cache.compute("mc-splat.glsl", render_defines, mc_splat_shader);
+			mc_mark_shader     = shader_cache.compute("mc-mark.glsl", render_defines, mc_mark_shader);
+			mc_freeze_shader   = shader_cache.compute("mc-freeze.glsl", render_defines, mc_freeze_shader);
+			mc_count_shader    = shader_cache.compute("mc-count.glsl", render_defines, mc_count_shader);
+			mc_scan_shader     = shader_cache.compute("mc-scan.glsl", render_defines, mc_scan_shader);
+			mc_generate_shader = shader_cache.compute("mc-generate.glsl", render_defines, mc_generate_shader);
+			mc_draw_shader     = shader_cache.graphics("mc-vs.glsl", "mc-ps.glsl", render_defines, mc_draw_shader);
+			vol_resolve_shader = shader_cache.compute("vol-resolve.glsl", render_defines, vol_resolve_shader);
+			vol_march_shader   = shader_cache.graphics("fullscreen-vs.glsl", "vol-march-ps.glsl", render_defines,
+																								 vol_march_shader);
+			point_raster_shader = shader_cache.compute("point-raster.glsl", point_defines, point_raster_shader);
+			if (!points.atomic64)
+				point_id_shader = shader_cache.compute("point-raster.glsl", point_id_defines, point_id_shader);
+			point_resolve_shader = shader_cache.graphics("fullscreen-vs.glsl", "point-resolve-ps.glsl", render_defines,
+																									 point_resolve_shader);
+		}
 
-		GL(glEnableVertexAttribArray(0));
-		GL(glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0));
-		draw(vbo, render_shader, vbo.size / sizeof(MeshVertex), PARTICLE_COUNT);
+		if (shader_startup_ms < 0 && !shader_cache.pending()) {
+			shader_startup_ms = (SDL_GetPerformanceCounter() - shader_start) * 1000.0
+													/ SDL_GetPerformanceFrequency();
+			// warm = every program came out of the binary cache
+			warm_start = program_cache.hits > 0 && program_cache.misses + program_cache.rejected == 0;
+			printf("Shaders ready in %.1f ms (%s start: %u cached, %u compiled, %u rejected)\n",
+						 shader_startup_ms, warm_start ? "warm" : "cold",
+						 program_cache.hits, program_cache.misses + program_cache.rejected,
+						 program_cache.rejected);
+		}
 
-		floor_shader.setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
-		floor_shader.setUniform("_view", camera.viewMat());
-		floor_shader.setUniform("_bbox_size", box_size);
+		const bool stepping = cpu_sim ? sim.cpuStepDone()
+													: compute_shader && compute_shader2 && (!cosim || co.ready());
+
+		// this frame's step goes from ring slot in to out; in throughput mode
+		// the particles are drawn from whatever finished last, so the draw
+		// doesn't depend on (and isn't ordered behind) the step
+		const u32 in = ring.head;
+		const u32 out = ring.next();
+		u32 drawn = stepping ? out : in;
+		if (config._pipeline_mode == PIPELINE_THROUGHPUT && !ring.newestFinished(&drawn))
+			drawn = in;
+
+		// Passes in semantic order. The graph binds the SSBOs/UBO and places
+		// the barriers.
+		fg.begin();
+
+		// the CPU solver pushes in its own step job, see kickCpuStep(), the
+		// co-simulation when it splits the state up
+		if (key_state['t'] && !cpu_sim && !cosim) {
+			fg.addPass("push", [&]() {
+				auto& buf = ring.slots[in];
+				buf.read(particles);
+				pushParticles(particles, camera.at);
+				buf.write(particles);
+			})
+			.access(sim.state_res[in], FG_CPU_READ, 0)
+			.access(sim.state_res[in], FG_CPU_WRITE, 0);
+		}
 
+		if (cpu_sim && stepping)
+			sim.addCpuStepPass(fg, cpu_staging);
+		else if (cosim && stepping)
+			co.addStepPasses(fg, &sim, compute_shader2, compute_shader, key_state['t'], camera.at);
+		else if (stepping)
+			sim.addStepPasses(fg, compute_shader2, compute_shader);
+
+		fg.addPass("clear", [&]() {
+			glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		})
+		.renders(backbuffer_res);
+
+		const bool impostors = config._impostors;
+		Shader* particle_shader = impostors ? impostor_shader : render_shader;
+		Shader* particle_cull = impostors ? cull_impostor_shader : cull_shader;
+		const bool fluid = config._render_mode == RENDER_FLUID;
+		const bool fluid_ready = ssf_depth_shader && ssf_thickness_shader && ssf_smooth_shader && ssf_composite_shader;
+		const bool mesh_ready = mc_splat_shader && mc_mark_shader && mc_freeze_shader && mc_count_shader &&
+														mc_scan_shader && mc_generate_shader && mc_draw_shader;
+		const bool volume = config._render_mode == RENDER_VOLUME;
+		const bool volume_ready = mc_splat_shader && vol_resolve_shader && vol_march_shader;
+		const bool points_ready = point_raster_shader && point_resolve_shader && (points.atomic64 || point_id_shader);
+		if (fluid && fluid_ready) {
+			ssf.setScale(config._ssf_scale);
+			ssf.addSplatPasses(fg, ssf_depth_shader, ssf_thickness_shader, ssf_smooth_shader, vao,
+												 sim.state_res[drawn], sim.params_res);
+		} else if (config._render_mode == RENDER_MESH && mesh_ready) {
+			mc.setGrid(config._mc_cells, box_size);
+			mc.addExtractPasses(fg, mc_splat_shader, mc_mark_shader, mc_freeze_shader, mc_count_shader, mc_scan_shader,
+													mc_generate_shader, config._mc_threshold, sim.state_res[drawn], sim.params_res);
+			mc.addDrawPass(fg, mc_draw_shader, vao, backbuffer_res);
+		} else if (volume && volume_ready) {
+			vol.setGrid(config._vol_cells, box_size);
+			vol.addSplatPasses(fg, mc_splat_shader, vol_resolve_shader, sim.state_res[drawn], sim.params_res);
+		} else if (config._render_mode == RENDER_POINTS && points_ready) {
+			points.addRasterPasses(fg, point_raster_shader, point_id_shader, config._surface_only, sim.state_res[drawn],
+														 sim.params_res);
+			points.addResolvePass(fg, point_resolve_shader, vao, sim.state_res[drawn], sim.params_res, backbuffer_res);
+		} else if (config._render_mode == RENDER_SPHERES && particle_shader && particle_cull && hiz_shader) {
+			const u32 state = sim.state_res[drawn];
+			particle_draw.addResetPass(fg, impostors);
+			particle_draw.addCullPass(fg, particle_cull, impostors, config._surface_only, CULL_EARLY, &hiz, state, sim.params_res);
+			particle_draw.addDrawPass(fg, particle_shader, impostors, CULL_EARLY, vao, state, sim.params_res, backbuffer_res);
+			hiz.addBuildPass(fg, hiz_shader, backbuffer_res);
+			particle_draw.addCullPass(fg, particle_cull, impostors, config._surface_only, CULL_LATE, &hiz, state, sim.params_res);
+			particle_draw.addDrawPass(fg, particle_shader, impostors, CULL_LATE, vao, state, sim.params_res, backbuffer_res);
+			particle_draw.addStatsPass(fg, impostors);
+		}
 
-		GL(glEnableVertexAttribArray(0));
-		GL(glUseProgram(floor_shader.id));
-		GL(glDrawArrays(GL_TRIANGLES, 0, 6));
+		if (floor_shader) {
+			fg.addPass("floor", [&]() {
+				floor_shader->setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
+				floor_shader->setUniform("_view", camera.viewMat());
+
+				gl_state.bindVertexArray(vao);
+				gl_state.useProgram(floor_shader->id);
+				GL(glDrawArrays(GL_TRIANGLES, 0, 6));
+			})
+			.reads(sim.params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+			.renders(backbuffer_res);
+		}
 
-		u32 err = glGetError();
-		if (err != 0)
-			printf("GL error: %u\n", err);
+		// after everything opaque, it blends over it
+		if (fluid && fluid_ready)
+			ssf.addCompositePass(fg, ssf_composite_shader, vao, backbuffer_res);
+		else if (volume && volume_ready)
+			vol.addMarchPass(fg, vol_march_shader, vao, config._vol_extinction, sim.params_res, backbuffer_res);
 
+		fg.execute();
+		drawn_step = ring.steps[drawn];
+		if (cpu_sim)
+			sim.kickCpuStep(&cpu, cpu_staging, key_state['t'], camera.at);
 
 
 		// Graphics
 		ImGui::Render();
 		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
+		gl_state.endFrame();
+		gpu_arena.endFrame();
+		jobs.endFrame();
 		SDL_GL_SwapWindow(window);
 	}
 
 
+	shader_cache.destroy();
+
+	if (cosim)
+		co.destroy();
+	sim.destroy();
+	if (cpu_sim)
+		cpu.destroy();
+	jobs.destroy();
+	points.destroy();
+	vol.destroy();
+	mc.destroy();
+	ssf.destroy();
+	hiz.destroy();
+	particle_draw.destroy();
+	fg.destroy();
+	ibo.destroy();
+	vbo.destroy();
+	gpu_arena.destroy();
+	GL(glDeleteVertexArrays(1, &vao));
+	m.destroy();
+
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplSDL2_Shutdown();
 
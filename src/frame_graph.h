@@ -0,0 +1,331 @@
+#pragma once
+
+// Per-frame pass scheduling with automatic barriers.
+//
+// Passes are re-declared every frame, each listing the buffers it touches and
+// how. From that the graph:
+//  - orders passes by dependency level; passes on the same level don't share
+//    a written resource, so they run back to back behind a single barrier
+//  - tracks, per physical buffer (an arena range), which glMemoryBarrier bits are still owed
+//    since the last shader write, and only issues those bits, only right
+//    before a pass that actually consumes the buffer that way
+//  - resolves ping-pong resources: a write goes to the back buffer, which
+//    becomes the current version once the pass has run
+// Buffer state persists across frames, so hazards between the end of one
+// frame and the start of the next are covered too.
+//
+// Every pass is also timed on the GPU with timestamps around it. Results are
+// picked up FG_TIMER_FRAMES - 1 frames later, without ever waiting on them.
+//
+// Needs GlState (gl_state) from final.cc and GpuRange from gpu_arena.h.
+
+#include <functional>
+
+enum FgUsage : u32 {
+	FG_SSBO_READ,
+	FG_SSBO_WRITE,   // shader storage write (incoherent)
+	FG_UBO_READ,
+	FG_VERTEX_READ,  // vertex attribute fetch
+	FG_INDIRECT_READ,
+	FG_CPU_READ,     // glGetBufferSubData / mapping
+	FG_CPU_WRITE,    // glBufferSubData
+	FG_COLOR_WRITE,  // render target writes; orders draws, never needs a barrier
+	FG_COLOR_READ,   // render target copied out; ordered after the draws, no barrier
+	// textures get an empty range and are bound by the pass itself
+	FG_IMAGE_WRITE,  // image store (incoherent)
+	FG_TEXTURE_READ, // texel fetch or sampling
+};
+
+// barrier bit a consumer needs after an incoherent shader write
+inline GLbitfield fgBarrierBit(FgUsage usage) {
+	switch (usage) {
+		case FG_SSBO_READ:     return GL_SHADER_STORAGE_BARRIER_BIT;
+		case FG_SSBO_WRITE:    return GL_SHADER_STORAGE_BARRIER_BIT; // write after write
+		case FG_UBO_READ:      return GL_UNIFORM_BARRIER_BIT;
+		case FG_VERTEX_READ:   return GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT;
+		case FG_INDIRECT_READ: return GL_COMMAND_BARRIER_BIT;
+		case FG_CPU_READ:
+		case FG_CPU_WRITE:     return GL_BUFFER_UPDATE_BARRIER_BIT;
+		case FG_COLOR_WRITE:
+		case FG_COLOR_READ:    return 0;
+		case FG_IMAGE_WRITE:   return GL_SHADER_IMAGE_ACCESS_BARRIER_BIT; // write after write
+		case FG_TEXTURE_READ:  return GL_TEXTURE_FETCH_BARRIER_BIT;
+	}
+	return 0;
+}
+
+// every bit a shader write can make necessary
+constexpr GLbitfield FG_ALL_CONSUMER_BITS = GL_SHADER_STORAGE_BARRIER_BIT |
+																						GL_UNIFORM_BARRIER_BIT |
+																						GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+																						GL_COMMAND_BARRIER_BIT |
+																						GL_BUFFER_UPDATE_BARRIER_BIT |
+																						GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+																						GL_TEXTURE_FETCH_BARRIER_BIT;
+
+// running out of any of these is fatal, in every build
+#define FG_MAX_RESOURCES 64
+#define FG_MAX_PASSES 32
+#define FG_MAX_ACCESSES 8
+#define FG_TIMER_FRAMES 3
+
+inline void fgOverflow(const char* what, const char* limit) {
+	printf("Frame graph ran out of %s, raise %s!\n", what, limit);
+	fflush(stdout);
+	abort();
+}
+
+struct FgResource {
+	const char* name;
+	GpuRange buffers[2];
+	GLbitfield dirty[2]; // barrier bits still owed per physical buffer
+	u32 num_buffers;     // 2 = ping-pong
+	u32 current;         // which physical buffer holds the latest version
+};
+
+struct FgPass {
+	const char* name;
+	struct {
+		u32 res;
+		FgUsage usage;
+		u32 binding;
+	} accesses[FG_MAX_ACCESSES];
+	u32 num_accesses;
+	std::function<void()> run;
+	u32 level;
+
+	FgPass& access(u32 res, FgUsage usage, u32 binding) {
+		if (num_accesses == FG_MAX_ACCESSES) fgOverflow("accesses in a pass", "FG_MAX_ACCESSES");
+		accesses[num_accesses++] = { res, usage, binding };
+		return *this;
+	}
+
+	FgPass& reads(u32 res, FgUsage usage, u32 binding = 0) { return access(res, usage, binding); }
+	FgPass& writes(u32 res, u32 binding) { return access(res, FG_SSBO_WRITE, binding); }
+	FgPass& renders(u32 target) { return access(target, FG_COLOR_WRITE, 0); }
+
+	bool writesTo(u32 res) {
+		for (u32 i = 0; i < num_accesses; ++i)
+			if (accesses[i].res == res &&
+					(accesses[i].usage == FG_SSBO_WRITE ||
+					 accesses[i].usage == FG_CPU_WRITE ||
+					 accesses[i].usage == FG_COLOR_WRITE ||
+					 accesses[i].usage == FG_IMAGE_WRITE))
+				return true;
+		return false;
+	}
+
+	bool touches(u32 res) {
+		for (u32 i = 0; i < num_accesses; ++i)
+			if (accesses[i].res == res) return true;
+		return false;
+	}
+};
+
+// GPU time per pass of one frame, in execution order
+struct FgTimings {
+	const char* names[FG_MAX_PASSES];
+	f32 ms[FG_MAX_PASSES];
+	u32 count;
+};
+
+struct FrameGraph {
+	FgResource resources[FG_MAX_RESOURCES];
+	u32 num_resources;
+
+	FgPass passes[FG_MAX_PASSES];
+	u32 num_passes;
+
+	// last executed frame
+	struct {
+		u32 passes;
+		u32 levels;
+		u32 barriers;
+		GLbitfield bits;
+	} stats;
+
+	// timestamps before the first pass and after each, per frame in flight
+	GLuint queries[FG_TIMER_FRAMES][FG_MAX_PASSES + 1];
+	const char* query_passes[FG_TIMER_FRAMES][FG_MAX_PASSES];
+	u32 num_queried[FG_TIMER_FRAMES];
+	u64 frame;
+	FgTimings timings; // newest frame read back
+
+	static FrameGraph make() {
+		FrameGraph fg;
+		fg.num_resources = 0;
+		fg.num_passes = 0;
+		fg.stats = {};
+		GL(glGenQueries(FG_TIMER_FRAMES * (FG_MAX_PASSES + 1), &fg.queries[0][0]));
+		for (u32 i = 0; i < FG_TIMER_FRAMES; ++i)
+			fg.num_queried[i] = 0;
+		fg.frame = 0;
+		fg.timings = {};
+		return fg;
+	}
+
+	u32 addResource(const char* name, const GpuRange* buffers, u32 count) {
+		assert(count >= 1 && count <= 2);
+		if (num_resources == FG_MAX_RESOURCES) fgOverflow("resources", "FG_MAX_RESOURCES");
+		FgResource& r = resources[num_resources];
+		r.name = name;
+		r.num_buffers = count;
+		r.current = 0;
+		for (u32 i = 0; i < count; ++i) {
+			r.buffers[i] = buffers[i];
+			r.dirty[i] = 0;
+		}
+		return num_resources++;
+	}
+
+	u32 addBuffer(const char* name, GpuRange buffer) {
+		return addResource(name, &buffer, 1);
+	}
+
+	u32 addPingPong(const char* name, GpuRange front, GpuRange back) {
+		GpuRange bufs[2] = { front, back };
+		return addResource(name, bufs, 2);
+	}
+
+	// index of the physical buffer holding the latest version
+	u32 current(u32 res) {
+		return resources[res].current;
+	}
+
+	void begin() {
+		for (u32 i = 0; i < num_passes; ++i)
+			passes[i].run = nullptr;
+		num_passes = 0;
+	}
+
+	FgPass& addPass(const char* name, std::function<void()> run) {
+		if (num_passes == FG_MAX_PASSES) fgOverflow("passes", "FG_MAX_PASSES");
+		FgPass& p = passes[num_passes++];
+		p.name = name;
+		p.num_accesses = 0;
+		p.run = run;
+		p.level = 0;
+		return p;
+	}
+
+	// Declaration order is the semantic order. A pass depends on every earlier
+	// pass it shares a resource with when either of them writes it.
+	void computeLevels() {
+		for (u32 j = 0; j < num_passes; ++j) {
+			passes[j].level = 0;
+			for (u32 i = 0; i < j; ++i) {
+				bool dep = false;
+				for (u32 r = 0; r < num_resources && !dep; ++r)
+					dep = (passes[i].writesTo(r) && passes[j].touches(r)) ||
+								(passes[j].writesTo(r) && passes[i].touches(r));
+				if (dep)
+					passes[j].level = max(passes[j].level, passes[i].level + 1);
+			}
+		}
+	}
+
+	// physical buffer an access resolves to, before the pass has run
+	u32 physical(const FgPass& p, u32 access) {
+		const FgResource& r = resources[p.accesses[access].res];
+		u32 idx = r.current;
+		if (p.accesses[access].usage == FG_SSBO_WRITE && r.num_buffers == 2)
+			idx ^= 1;
+		return idx;
+	}
+
+	// the frame that last used slot, unless the GPU isn't done with it yet
+	void readTimings(u32 slot) {
+		const u32 n = num_queried[slot];
+		if (!n) return;
+		GLint available = 0;
+		GL(glGetQueryObjectiv(queries[slot][n], GL_QUERY_RESULT_AVAILABLE, &available));
+		if (!available) return;
+
+		GLuint64 prev = 0;
+		GL(glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &prev));
+		for (u32 i = 0; i < n; ++i) {
+			GLuint64 t = 0;
+			GL(glGetQueryObjectui64v(queries[slot][i + 1], GL_QUERY_RESULT, &t));
+			timings.names[i] = query_passes[slot][i];
+			timings.ms[i] = (t - prev) / 1e6f;
+			prev = t;
+		}
+		timings.count = n;
+	}
+
+	void execute() {
+		computeLevels();
+
+		const u32 slot = frame++ % FG_TIMER_FRAMES;
+		readTimings(slot);
+		num_queried[slot] = 0;
+		if (num_passes) GL(glQueryCounter(queries[slot][0], GL_TIMESTAMP));
+
+		u32 max_level = 0;
+		for (u32 i = 0; i < num_passes; ++i)
+			max_level = max(max_level, passes[i].level);
+
+		stats = {};
+		stats.passes = num_passes;
+		stats.levels = num_passes ? max_level + 1 : 0;
+
+		for (u32 level = 0; level <= max_level && num_passes; ++level) {
+			// one barrier for the whole level, only with the bits owed
+			GLbitfield barrier = 0;
+			for (u32 i = 0; i < num_passes; ++i) {
+				FgPass& p = passes[i];
+				if (p.level != level) continue;
+				for (u32 a = 0; a < p.num_accesses; ++a) {
+					FgResource& r = resources[p.accesses[a].res];
+					barrier |= r.dirty[physical(p, a)] & fgBarrierBit(p.accesses[a].usage);
+				}
+			}
+
+			if (barrier) {
+				GL(glMemoryBarrier(barrier));
+				stats.barriers++;
+				stats.bits |= barrier;
+				for (u32 r = 0; r < num_resources; ++r)
+					for (u32 b = 0; b < resources[r].num_buffers; ++b)
+						resources[r].dirty[b] &= ~barrier;
+			}
+
+			for (u32 i = 0; i < num_passes; ++i) {
+				FgPass& p = passes[i];
+				if (p.level != level) continue;
+
+				for (u32 a = 0; a < p.num_accesses; ++a) {
+					const FgResource& r = resources[p.accesses[a].res];
+					const GpuRange buf = r.buffers[physical(p, a)];
+					switch (p.accesses[a].usage) {
+						case FG_SSBO_READ:
+						case FG_SSBO_WRITE:
+							gl_state.bindBufferRange(GL_SHADER_STORAGE_BUFFER, p.accesses[a].binding, buf);
+							break;
+						case FG_UBO_READ:
+							gl_state.bindBufferRange(GL_UNIFORM_BUFFER, p.accesses[a].binding, buf);
+							break;
+						default: // VAO, indirect, texture and CPU accesses are bound by the pass itself
+							break;
+					}
+				}
+
+				if (p.run) p.run();
+				query_passes[slot][num_queried[slot]] = p.name;
+				GL(glQueryCounter(queries[slot][++num_queried[slot]], GL_TIMESTAMP));
+
+				for (u32 a = 0; a < p.num_accesses; ++a) {
+					if (p.accesses[a].usage != FG_SSBO_WRITE && p.accesses[a].usage != FG_IMAGE_WRITE) continue;
+					FgResource& r = resources[p.accesses[a].res];
+					const u32 idx = physical(p, a);
+					r.dirty[idx] = FG_ALL_CONSUMER_BITS;
+					r.current = idx;
+				}
+			}
+		}
+	}
+
+	void destroy() {
+		GL(glDeleteQueries(FG_TIMER_FRAMES * (FG_MAX_PASSES + 1), &queries[0][0]));
+	}
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+// GL error reporting through KHR_debug (core in 4.3) instead of a
+// glGetError() after every call, which can force a CPU-GPU round trip.
+//
+// Debug builds ask for a debug context, GL() records its call site, and the
+// driver reports errors/warnings to glDebugCallback(). Output is
+// asynchronous by default, so the site printed is the last GL() issued, not
+// necessarily the culprit. With setGlDebugSync(true) the driver reports from
+// inside the offending call and errors assert, like the old per-call check.
+//
+// Release builds (NDEBUG) compile GL(x) to plain x and install nothing.
+
+#ifdef NDEBUG
+
+#define GL(x) do { x; } while(0)
+
+// brackets calls that are allowed to fail, e.g. loading a stale binary;
+// their errors are drained so nothing later gets blamed for them
+#define GL_QUIET_BEGIN(name)
+#define GL_QUIET_END() do { while (glGetError() != GL_NO_ERROR) {} } while(0)
+
+inline void initGlDebug() {}
+
+#else
+
+struct GlDebug {
+	bool enabled;
+	bool sync;
+	GLenum min_severity; // GL_DEBUG_SEVERITY_*, lower ones are filtered by the driver
+	u32 errors;          // since startup
+
+	// last GL() call site
+	const char* file;
+	int line;
+	const char* expr;
+};
+
+GlDebug gl_debug;
+
+#define GL(x) do { \
+		gl_debug.file = __FILE__; \
+		gl_debug.line = __LINE__; \
+		gl_debug.expr = #x; \
+		{ x; } \
+	} while(0)
+
+#define GL_QUIET_BEGIN(name) do { \
+		glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name); \
+		glDebugMessageControl(GL_DEBUG_SOURCE_API, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_FALSE); \
+	} while(0)
+#define GL_QUIET_END() do { \
+		while (glGetError() != GL_NO_ERROR) {} \
+		glPopDebugGroup(); \
+	} while(0)
+
+inline const char* glDebugTypeName(GLenum type) {
+	switch (type) {
+		case GL_DEBUG_TYPE_ERROR:               return "error";
+		case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+		case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return "undefined behavior";
+		case GL_DEBUG_TYPE_PORTABILITY:         return "portability";
+		case GL_DEBUG_TYPE_PERFORMANCE:         return "performance";
+		default:                                return "other";
+	}
+}
+
+inline const char* glDebugSeverityName(GLenum severity) {
+	switch (severity) {
+		case GL_DEBUG_SEVERITY_HIGH:   return "high";
+		case GL_DEBUG_SEVERITY_MEDIUM: return "medium";
+		case GL_DEBUG_SEVERITY_LOW:    return "low";
+		default:                       return "note";
+	}
+}
+
+void APIENTRY glDebugCallback(GLenum /*source*/, GLenum type, GLuint /*id*/, GLenum severity,
+															GLsizei /*length*/, const GLchar* message, const void* /*user*/) {
+	if (type == GL_DEBUG_TYPE_PUSH_GROUP || type == GL_DEBUG_TYPE_POP_GROUP) return;
+
+	printf("GL %s (%s): %s\n", glDebugTypeName(type), glDebugSeverityName(severity), message);
+	if (gl_debug.file)
+		printf("  %s %s:%d: %s\n", gl_debug.sync ? "at" : "after",
+					 gl_debug.file, gl_debug.line, gl_debug.expr);
+
+	if (type == GL_DEBUG_TYPE_ERROR) {
+		gl_debug.errors++;
+		fflush(stdout);
+		assert(!gl_debug.sync && "GL error, see above");
+	}
+}
+
+void setGlDebugSync(bool sync) {
+	if (!gl_debug.enabled) return;
+	gl_debug.sync = sync;
+	if (sync) {
+		glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+	} else {
+		glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+	}
+}
+
+// everything at or above min_severity gets through
+void setGlDebugMinSeverity(GLenum min_severity) {
+	if (!gl_debug.enabled) return;
+	gl_debug.min_severity = min_severity;
+
+	const GLenum order[] = {
+		GL_DEBUG_SEVERITY_NOTIFICATION,
+		GL_DEBUG_SEVERITY_LOW,
+		GL_DEBUG_SEVERITY_MEDIUM,
+		GL_DEBUG_SEVERITY_HIGH,
+	};
+	bool on = false;
+	for (u32 i = 0; i < ARRAY_SIZE(order); ++i) {
+		on |= order[i] == min_severity;
+		glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, order[i], 0, NULL, on);
+	}
+}
+
+// needs a debug context to be guaranteed any output, see main()
+void initGlDebug() {
+	gl_debug = {};
+	if (!GLAD_GL_VERSION_4_3) {
+		printf("No KHR_debug, GL errors won't be reported\n");
+		return;
+	}
+	GLint flags = 0;
+	glGetIntegerv(GL_CONTEXT_FLAGS, &flags);
+	if (!(flags & GL_CONTEXT_FLAG_DEBUG_BIT))
+		printf("Not a debug context, GL error reporting is up to the driver\n");
+
+	gl_debug.enabled = true;
+	glEnable(GL_DEBUG_OUTPUT);
+	glDebugMessageCallback(glDebugCallback, NULL);
+	setGlDebugMinSeverity(GL_DEBUG_SEVERITY_LOW);
+	setGlDebugSync(false);
+}
+
+#endif
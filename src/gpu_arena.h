@@ -0,0 +1,193 @@
+#pragma once
+
+// GPU memory arena. Buffers are sub-allocated out of a few big immutable
+// GL buffers instead of one glCreateBuffers + glNamedBufferStorage each:
+//  - persistent ranges bump-allocate from blocks. They're released LIFO,
+//    or all at once when the scope they were made in is popped
+//  - per-frame scratch comes out of a persistently mapped ring split into
+//    one segment per frame in flight, each reused only once its fence passed
+// Every range is aligned so it can be bound with glBindBufferRange as an
+// SSBO or UBO.
+//
+// Needs the GL() macro from gl_debug.h.
+
+// deleted names must be dropped from the binding cache, defined in final.cc
+void forgetBufferBindings(u32 id);
+
+struct GpuRange {
+	u32 id;
+	u32 offset;
+	u32 size;
+};
+
+// everything allocated after a pushScope(), see popScope()
+struct GpuScope {
+	u32 num_blocks;
+	u32 top;
+};
+
+#define GPU_ARENA_BLOCK_SIZE (8u << 20)
+#define GPU_ARENA_MAX_BLOCKS 32
+#define GPU_SCRATCH_FRAMES 3
+
+struct GpuArena {
+	struct {
+		u32 id;
+		u32 size;
+		u32 top;
+	} blocks[GPU_ARENA_MAX_BLOCKS];
+	u32 num_blocks;
+	u32 align;
+
+	// scratch ring, one segment per frame in flight
+	u32 ring_id;
+	u8* ring_ptr;
+	u32 segment_size;
+	u32 segment;      // the one this frame writes to
+	u32 segment_head;
+	GLsync fences[GPU_SCRATCH_FRAMES];
+
+	// bytes of device memory, peaks since init
+	u64 total;
+	u64 peak_total;
+	u64 peak_used;
+
+	void init(u32 scratch_per_frame) {
+		num_blocks = 0;
+		total = peak_total = peak_used = 0;
+
+		GLint ssbo_align = 1, ubo_align = 1;
+		GL(glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_align));
+		GL(glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_align));
+		align = max<u32>(max<u32>(ssbo_align, ubo_align), 16);
+
+		segment_size = alignUp(scratch_per_frame);
+		const u32 ring_size = segment_size * GPU_SCRATCH_FRAMES;
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		GL(glCreateBuffers(1, &ring_id));
+		GL(glNamedBufferStorage(ring_id, ring_size, NULL, flags));
+		GL(ring_ptr = (u8*)glMapNamedBufferRange(ring_id, 0, ring_size, flags));
+		segment = 0;
+		segment_head = 0;
+		for (u32 i = 0; i < GPU_SCRATCH_FRAMES; ++i)
+			fences[i] = 0;
+
+		total += ring_size;
+		peak_total = total;
+	}
+
+	u32 alignUp(u32 size) {
+		return (size + align - 1) / align * align;
+	}
+
+	u64 used() {
+		u64 n = (u64)segment_size * GPU_SCRATCH_FRAMES;
+		for (u32 i = 0; i < num_blocks; ++i)
+			n += blocks[i].top;
+		return n;
+	}
+
+	void addBlock(u32 size) {
+		assert(num_blocks < GPU_ARENA_MAX_BLOCKS);
+		auto& b = blocks[num_blocks++];
+		b.size = size;
+		b.top = 0;
+		GL(glCreateBuffers(1, &b.id));
+		GL(glNamedBufferStorage(b.id, size, NULL, GL_DYNAMIC_STORAGE_BIT));
+
+		total += size;
+		peak_total = max(peak_total, total);
+	}
+
+	GpuRange alloc(u32 size, const void* data) {
+		const u32 aligned = alignUp(size);
+		if (!num_blocks || blocks[num_blocks - 1].top + aligned > blocks[num_blocks - 1].size)
+			addBlock(max(aligned, GPU_ARENA_BLOCK_SIZE));
+
+		auto& b = blocks[num_blocks - 1];
+		GpuRange r = { b.id, b.top, size };
+		b.top += aligned;
+		peak_used = max(peak_used, used());
+
+		if (data)
+			GL(glNamedBufferSubData(r.id, r.offset, size, data));
+		return r;
+	}
+
+	// only the most recent allocation actually gives memory back, anything
+	// else is reclaimed when its scope is popped
+	void free(GpuRange r) {
+		if (!num_blocks) return;
+		auto& b = blocks[num_blocks - 1];
+		if (b.id == r.id && r.offset + alignUp(r.size) == b.top)
+			b.top = r.offset;
+	}
+
+	GpuScope pushScope() {
+		return { num_blocks, num_blocks ? blocks[num_blocks - 1].top : 0 };
+	}
+
+	void popScope(GpuScope scope) {
+		while (num_blocks > scope.num_blocks) {
+			auto& b = blocks[--num_blocks];
+			total -= b.size;
+			forgetBufferBindings(b.id);
+			GL(glDeleteBuffers(1, &b.id));
+		}
+		if (num_blocks)
+			blocks[num_blocks - 1].top = scope.top;
+	}
+
+	struct Scratch {
+		GpuRange range;
+		u8* ptr; // write-only, coherent
+	};
+
+	// valid until the end of the frame; ptr is NULL if the segment is full
+	Scratch scratch(u32 size) {
+		const u32 aligned = alignUp(size);
+		if (segment_head + aligned > segment_size)
+			return { { ring_id, 0, 0 }, NULL };
+
+		const u32 offset = segment * segment_size + segment_head;
+		segment_head += aligned;
+		return { { ring_id, offset, size }, ring_ptr + offset };
+	}
+
+	// staged write into a range, falls back to glNamedBufferSubData when the
+	// scratch segment is full
+	void upload(GpuRange dst, const void* data) {
+		Scratch s = scratch(dst.size);
+		if (!s.ptr) {
+			GL(glNamedBufferSubData(dst.id, dst.offset, dst.size, data));
+			return;
+		}
+		memcpy(s.ptr, data, dst.size);
+		GL(glCopyNamedBufferSubData(s.range.id, dst.id, s.range.offset, dst.offset, dst.size));
+	}
+
+	// fence this frame's segment and move on to the oldest one
+	void endFrame() {
+		fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		segment = (segment + 1) % GPU_SCRATCH_FRAMES;
+		segment_head = 0;
+
+		if (fences[segment]) {
+			glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, ~0ull);
+			glDeleteSync(fences[segment]);
+			fences[segment] = 0;
+		}
+	}
+
+	void destroy() {
+		popScope({ 0, 0 });
+		for (u32 i = 0; i < GPU_SCRATCH_FRAMES; ++i)
+			if (fences[i]) glDeleteSync(fences[i]);
+		forgetBufferBindings(ring_id);
+		GL(glUnmapNamedBuffer(ring_id));
+		GL(glDeleteBuffers(1, &ring_id));
+		total = 0;
+	}
+};
+
+GpuArena gpu_arena;
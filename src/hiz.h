@@ -0,0 +1,71 @@
+#pragma once
+
+// Hierarchical depth for occlusion culling. The depth buffer is copied into a
+// texture and reduced into a pyramid holding the farthest depth per texel,
+// level 0 at half resolution and every level halving again. Level 0 is
+// rounded up to powers of two, so texel x of level l covers exactly pixels
+// [x << (l + 1), (x + 1) << (l + 1)), and a rect no wider than that overlaps
+// at most 2x2 texels of the level. See occluded() in particle-cull.glsl.
+//
+// Needs Shader and WINDOW_WIDTH/WINDOW_HEIGHT from final.cc.
+
+#define HIZ_GROUP_SIZE 8 // must match hiz-build.glsl
+
+struct HiZ {
+	GLuint depth;   // copy of the depth buffer
+	GLuint pyramid; // R32F
+	u32 width, height; // of level 0
+	u32 levels;        // down to 1x1
+
+	u32 res;
+
+	static HiZ make(FrameGraph& fg) {
+		HiZ h = {};
+		h.width = h.height = 1;
+		while (h.width * 2 < WINDOW_WIDTH) h.width *= 2;
+		while (h.height * 2 < WINDOW_HEIGHT) h.height *= 2;
+		h.levels = 1;
+		while ((max(h.width, h.height) >> (h.levels - 1)) > 1) h.levels++;
+
+		GL(glCreateTextures(GL_TEXTURE_2D, 1, &h.depth));
+		GL(glTextureStorage2D(h.depth, 1, GL_DEPTH_COMPONENT32F, WINDOW_WIDTH, WINDOW_HEIGHT));
+		GL(glCreateTextures(GL_TEXTURE_2D, 1, &h.pyramid));
+		GL(glTextureStorage2D(h.pyramid, h.levels, GL_R32F, h.width, h.height));
+
+		h.res = fg.addBuffer("hiz", {});
+		return h;
+	}
+
+	// From what has been drawn into target so far. Levels depend on each
+	// other, so they get barriers of their own inside the pass.
+	void addBuildPass(FrameGraph& fg, Shader* build, u32 target_res) {
+		HiZ* h = this;
+		fg.addPass("hiz build", [=]() {
+			GL(glCopyTextureSubImage2D(h->depth, 0, 0, 0, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT));
+			GL(glBindTextureUnit(0, h->depth));
+			for (u32 l = 0; l < h->levels; ++l) {
+				if (l > 0) {
+					GL(glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT));
+					GL(glBindImageTexture(0, h->pyramid, l - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F));
+				}
+				GL(glBindImageTexture(1, h->pyramid, l, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F));
+				build->setUniform("_level", (i32)l);
+				const u32 w = max(h->width >> l, 1u);
+				const u32 hh = max(h->height >> l, 1u);
+				build->execute((w + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (hh + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+			}
+		})
+		.access(target_res, FG_COLOR_READ, 0)
+		.access(res, FG_IMAGE_WRITE, 0);
+	}
+
+	// for passes reading res
+	void bind(u32 unit) {
+		GL(glBindTextureUnit(unit, pyramid));
+	}
+
+	void destroy() {
+		GL(glDeleteTextures(1, &pyramid));
+		GL(glDeleteTextures(1, &depth));
+	}
+};
@@ -0,0 +1,315 @@
+#pragma once
+
+// Work-stealing job system for CPU work. Every job thread (the main thread
+// plus the workers) owns a deque of ready jobs: it pushes and pops its own
+// at the bottom, idle threads steal from the top of someone else's, so
+// recently split work stays local and big old chunks get taken.
+//
+//  - create() makes a job, optionally as a child of another: a job is only
+//    done once its children are, so waiting on a parent waits for the tree
+//  - dependsOn() holds a job back until another is done, for task graphs
+//  - run() hands a job over; it starts as soon as its dependencies are done
+//  - wait() runs other jobs instead of blocking, so waiting from inside a
+//    job is fine
+//
+// Only the main thread and the workers may create or run jobs. Job handles
+// come from a per-thread ring and are recycled JOB_POOL_SIZE jobs later, so
+// don't hold on to them for long. Wrapping around onto a job that isn't done
+// yet is fatal, in every build.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#define MAX_JOB_THREADS 64 // workers + main
+#define JOB_POOL_SIZE 4096
+#define JOB_DEQUE_SIZE 4096
+#define JOB_MAX_DEPENDENTS 8
+
+typedef std::function<void()> JobFn;
+typedef std::function<void(u32 begin, u32 end)> RangeFn;
+
+struct Job {
+	JobFn fn;
+	Job* parent;
+	std::atomic<i32> unfinished; // itself + children
+	std::atomic<i32> blockers;   // dependencies not done, +1 until run()
+	Job* dependents[JOB_MAX_DEPENDENTS];
+	u32 num_dependents;
+};
+
+struct JobDeque {
+	std::mutex mutex;
+	Job* jobs[JOB_DEQUE_SIZE];
+	u32 top;    // steal end
+	u32 bottom; // owner end
+
+	bool push(Job* job) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (bottom - top == JOB_DEQUE_SIZE) return false;
+		jobs[bottom++ % JOB_DEQUE_SIZE] = job;
+		return true;
+	}
+
+	Job* pop() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (bottom == top) return NULL;
+		return jobs[--bottom % JOB_DEQUE_SIZE];
+	}
+
+	Job* steal() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (bottom == top) return NULL;
+		return jobs[top++ % JOB_DEQUE_SIZE];
+	}
+};
+
+// per thread, counted since init
+struct JobThreadStats {
+	std::atomic<u64> jobs;
+	std::atomic<u64> steals;
+	std::atomic<u64> busy_ns;
+};
+
+// one endFrame() to the next
+struct JobFrameStats {
+	u32 jobs;
+	u32 steals;
+	f32 utilization; // share of the frame spent running jobs
+};
+
+thread_local u32 job_thread_index = 0; // main is 0
+thread_local u32 job_depth = 0;        // nested execute() calls
+
+inline u64 jobNowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct JobSystem {
+	std::thread workers[MAX_JOB_THREADS - 1];
+	u32 num_workers;
+
+	// per job thread
+	JobDeque* deques;
+	Job* pools[MAX_JOB_THREADS];
+	u32 pool_next[MAX_JOB_THREADS];
+	JobThreadStats* stats;
+
+	// sleeping workers wait for ready jobs
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	std::atomic<u32> ready;
+	bool quit;
+
+	// for endFrame()
+	JobFrameStats last[MAX_JOB_THREADS];
+	u64 frame_start_ns;
+	u64 frame_jobs[MAX_JOB_THREADS];
+	u64 frame_steals[MAX_JOB_THREADS];
+	u64 frame_busy[MAX_JOB_THREADS];
+
+	// threads counts the main thread; 0 uses every hardware thread but
+	// always at least one worker, so jobs run while the main thread draws
+	void init(u32 threads) {
+		if (!threads) threads = max(std::thread::hardware_concurrency(), 2u);
+		num_workers = min<u32>(threads, MAX_JOB_THREADS) - 1;
+		deques = new JobDeque[num_workers + 1]();
+		stats = new JobThreadStats[num_workers + 1]();
+		for (u32 i = 0; i <= num_workers; ++i) {
+			pools[i] = new Job[JOB_POOL_SIZE]();
+			pool_next[i] = 0;
+			frame_jobs[i] = frame_steals[i] = frame_busy[i] = 0;
+			last[i] = {};
+		}
+		ready = 0;
+		quit = false;
+		frame_start_ns = jobNowNs();
+		job_thread_index = 0;
+		for (u32 i = 0; i < num_workers; ++i)
+			workers[i] = std::thread([this, i]() { workerLoop(i + 1); });
+	}
+
+	u32 threads() {
+		return num_workers + 1;
+	}
+
+	Job* create(JobFn fn, Job* parent = NULL) {
+		const u32 t = job_thread_index;
+		Job* job = &pools[t][pool_next[t]++ % JOB_POOL_SIZE];
+		if (job->unfinished != 0) {
+			printf("Job pool of thread %u wrapped around onto a running job, raise JOB_POOL_SIZE!\n", t);
+			fflush(stdout);
+			abort();
+		}
+		job->fn = fn;
+		job->parent = parent;
+		job->unfinished = 1;
+		job->blockers = 1;
+		job->num_dependents = 0;
+		if (parent) parent->unfinished++;
+		return job;
+	}
+
+	// job won't start before dep is done; call before running either of them
+	void dependsOn(Job* job, Job* dep) {
+		assert(dep->num_dependents < JOB_MAX_DEPENDENTS);
+		dep->dependents[dep->num_dependents++] = job;
+		job->blockers++;
+	}
+
+	void run(Job* job) {
+		if (--job->blockers == 0)
+			schedule(job);
+	}
+
+	bool done(Job* job) {
+		return job->unfinished == 0;
+	}
+
+	// runs other jobs until job is done
+	void wait(Job* job) {
+		while (!done(job)) {
+			if (Job* next = find(job_thread_index))
+				execute(next);
+			else
+				std::this_thread::yield();
+		}
+	}
+
+	// f over [0, n) in chunks of about grain, returns when all are done.
+	// Ranges are split in halves, one half pushed for stealing and the other
+	// kept, so thieves take big pieces and the owner works through small ones.
+	void parallelFor(u32 n, u32 grain, const RangeFn& f) {
+		if (!n) return;
+		grain = max(grain, 1u);
+		if (!num_workers || n <= grain) {
+			f(0, n);
+			return;
+		}
+		Job* root = create(JobFn());
+		splitRange(root, 0, n, grain, &f);
+		run(root);
+		wait(root);
+	}
+
+	void splitRange(Job* parent, u32 begin, u32 end, u32 grain, const RangeFn* f) {
+		while (end - begin > grain) {
+			const u32 mid = begin + (end - begin) / 2;
+			run(create([this, parent, mid, end, grain, f]() { splitRange(parent, mid, end, grain, f); }, parent));
+			end = mid;
+		}
+		(*f)(begin, end);
+	}
+
+	void schedule(Job* job) {
+		// counted before it can be found, or a thief's ready-- could wrap it
+		ready++;
+		if (!num_workers || !deques[job_thread_index].push(job)) {
+			ready--;
+			execute(job); // nobody to hand it to
+			return;
+		}
+		{ std::lock_guard<std::mutex> lock(sleep_mutex); }
+		wake.notify_one();
+	}
+
+	// own jobs newest first, then the oldest of someone else's
+	Job* find(u32 self) {
+		if (Job* job = deques[self].pop()) {
+			ready--;
+			return job;
+		}
+		for (u32 i = 1; i <= num_workers; ++i) {
+			const u32 victim = (self + i) % (num_workers + 1);
+			if (Job* job = deques[victim].steal()) {
+				ready--;
+				stats[self].steals++;
+				return job;
+			}
+		}
+		return NULL;
+	}
+
+	void execute(Job* job) {
+		const u64 start = job_depth ? 0 : jobNowNs();
+		job_depth++;
+		{
+			// moved out, the job may be recycled once finish() publishes it
+			JobFn fn = std::move(job->fn);
+			job->fn = JobFn();
+			if (fn) fn();
+		}
+		job_depth--;
+		auto& s = stats[job_thread_index];
+		s.jobs++;
+		if (!job_depth) s.busy_ns += jobNowNs() - start;
+		finish(job);
+	}
+
+	void finish(Job* job) {
+		// copy out before the decrement: once it reaches 0 the owner may
+		// recycle job in create() or free the pool in destroy(). Parent and
+		// dependents are fixed by the time anything runs.
+		Job* parent = job->parent;
+		Job* dependents[JOB_MAX_DEPENDENTS];
+		const u32 num_dependents = job->num_dependents;
+		for (u32 i = 0; i < num_dependents; ++i)
+			dependents[i] = job->dependents[i];
+		if (--job->unfinished > 0) return;
+
+		for (u32 i = 0; i < num_dependents; ++i)
+			run(dependents[i]);
+		if (parent) finish(parent);
+	}
+
+	void workerLoop(u32 index) {
+		job_thread_index = index;
+		for (;;) {
+			if (Job* job = find(index)) {
+				execute(job);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			wake.wait(lock, [&]() { return quit || ready > 0; });
+			if (quit) return;
+		}
+	}
+
+	// snapshots per-thread stats into last, call once per frame
+	void endFrame() {
+		const u64 now = jobNowNs();
+		const f64 frame_ns = max<f64>(now - frame_start_ns, 1.0);
+		frame_start_ns = now;
+		for (u32 i = 0; i <= num_workers; ++i) {
+			const u64 jobs = stats[i].jobs, steals = stats[i].steals, busy = stats[i].busy_ns;
+			last[i].jobs = (u32)(jobs - frame_jobs[i]);
+			last[i].steals = (u32)(steals - frame_steals[i]);
+			last[i].utilization = min((busy - frame_busy[i]) / frame_ns, 1.0);
+			frame_jobs[i] = jobs;
+			frame_steals[i] = steals;
+			frame_busy[i] = busy;
+		}
+	}
+
+	// everything run() must be done by now
+	void destroy() {
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (u32 i = 0; i < num_workers; ++i)
+			workers[i].join();
+		for (u32 i = 0; i <= num_workers; ++i)
+			delete[] pools[i];
+		delete[] deques;
+		delete[] stats;
+		num_workers = 0;
+	}
+};
+
+JobSystem jobs;
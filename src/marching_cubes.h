@@ -0,0 +1,362 @@
+#pragma once
+
+// Surface mesh of the fluid, extracted on the GPU with marching cubes. Every
+// frame the particles splat their SPH density (the smoothingFunc() kernel,
+// same as the density pass) onto the nodes of a grid over the box. The grid
+// is split into blocks of MC_BLOCK^3 cells. Only blocks where some node moved
+// more than a threshold since it was last extracted get extracted again;
+// everyone else's triangles are copied over as they are:
+//  - mark:     nodes that changed flag every block they're a corner in
+//  - freeze:   nodes whose blocks all re-extract take the new density
+//  - count:    triangles per dirty block
+//  - scan:     prefix sum of the block counts, the mesh offset per block
+//  - generate: dirty blocks write their triangles at their offset, clean
+//              ones copy theirs from last frame's mesh, hence two of them
+// The mesh is drawn with one glDrawArraysIndirect, mc-vs.glsl pulls the
+// vertices out of the SSBO.
+//
+// Extraction never reads the splatted density directly, only the per node
+// reference the freeze pass keeps. A node shared with a clean block keeps
+// the value that block was extracted with, so both sides of every block
+// face always agree and the mesh stays watertight. A node that moves past
+// the threshold marks all of its blocks, so none lags behind by more.
+//
+// Needs Shader, Buffer, GpuReadback and DrawArraysCommand from final.cc.
+
+#define MC_BLOCK 4                  // cells per block and axis, must match mc-common.glsl
+#define MC_MAX_CELLS 96             // per axis
+#define MC_MAX_TRIANGLES (1u << 17) // past that the rest of the mesh is dropped
+#define MC_MAX_CASE_TRIS 5          // per cell, must match mc-common.glsl
+#define MC_SCAN_GROUP 256           // must match mc-scan.glsl
+
+// corner and edge numbering of a cell, same as in mc-common.glsl
+static const u8 MC_CORNERS[8][3] = {
+	{ 0, 0, 0 }, { 1, 0, 0 }, { 1, 1, 0 }, { 0, 1, 0 },
+	{ 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 },
+};
+static const u8 MC_EDGES[12][2] = {
+	{ 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 },
+	{ 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 4 },
+	{ 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 },
+};
+static const u8 MC_FACES[6][4] = { // corners going around each face
+	{ 0, 1, 2, 3 }, { 4, 5, 6, 7 }, { 0, 1, 5, 4 },
+	{ 1, 2, 6, 5 }, { 2, 3, 7, 6 }, { 3, 0, 4, 7 },
+};
+
+static u32 mcEdge(u32 a, u32 b) {
+	for (u32 e = 0; e < 12; ++e)
+		if ((MC_EDGES[e][0] == a && MC_EDGES[e][1] == b) || (MC_EDGES[e][0] == b && MC_EDGES[e][1] == a))
+			return e;
+	assert(false);
+	return 0;
+}
+
+// bit per face both of the edge's corners are on
+static u32 mcEdgeFaces(u32 e) {
+	u32 faces = 0;
+	for (u32 f = 0; f < 6; ++f) {
+		u32 on = 0;
+		for (u32 k = 0; k < 4; ++k)
+			on += MC_FACES[f][k] == MC_EDGES[e][0] || MC_FACES[f][k] == MC_EDGES[e][1];
+		if (on == 2) faces |= 1u << f;
+	}
+	return faces;
+}
+
+// Triangles per cell case (bit i set = corner i inside), as edge numbers,
+// worked out at startup rather than pasted in. The crossed edges are joined
+// into loops face by face. A face with its inside corners on one diagonal
+// always gets them cut off separately, and both cells sharing the face agree
+// on that, so the surface has no cracks. Each loop is fanned into triangles
+// facing away from its inside corners, from a vertex that keeps the fan's
+// diagonals off the cell faces.
+struct McTable {
+	u32 tri_count[256];
+	i32 tri_edges[256][MC_MAX_CASE_TRIS * 3];
+
+	static McTable make() {
+		McTable t = {};
+		for (u32 c = 0; c < 256; ++c) {
+			auto inside = [c](u32 corner) { return (c >> corner) & 1; };
+
+			u32 links[12][2];
+			u32 degree[12] = {};
+			auto link = [&](u32 a, u32 b) {
+				links[a][degree[a]++] = b;
+				links[b][degree[b]++] = a;
+			};
+			for (u32 f = 0; f < 6; ++f) {
+				const u8* fc = MC_FACES[f];
+				u32 crossed[4], n = 0;
+				for (u32 k = 0; k < 4; ++k)
+					if (inside(fc[k]) != inside(fc[(k + 1) % 4]))
+						crossed[n++] = mcEdge(fc[k], fc[(k + 1) % 4]);
+				if (n == 2)
+					link(crossed[0], crossed[1]);
+				else if (n == 4)
+					for (u32 k = 0; k < 4; ++k)
+						if (inside(fc[k]))
+							link(mcEdge(fc[(k + 3) % 4], fc[k]), mcEdge(fc[k], fc[(k + 1) % 4]));
+			}
+
+			bool seen[12] = {};
+			for (u32 s = 0; s < 12; ++s) {
+				if (!degree[s] || seen[s]) continue;
+				u32 loop[12], len = 0;
+				u32 prev = s, cur = s;
+				do {
+					loop[len++] = cur;
+					seen[cur] = true;
+					const u32 next = links[cur][0] == prev ? links[cur][1] : links[cur][0];
+					prev = cur;
+					cur = next;
+				} while (cur != s);
+
+				// outwards is from the inside corner of each edge to the other one;
+				// the loop's own normal (Newell's, through the edge midpoints) has
+				// to agree
+				Vec3 out = v3(0, 0, 0), normal = v3(0, 0, 0);
+				for (u32 i = 0; i < len; ++i) {
+					const u8* e = MC_EDGES[loop[i]];
+					const u8* a = MC_CORNERS[inside(e[0]) ? e[0] : e[1]];
+					const u8* b = MC_CORNERS[inside(e[0]) ? e[1] : e[0]];
+					out = out + v3(b[0] - a[0], b[1] - a[1], b[2] - a[2]);
+
+					const u8* f = MC_EDGES[loop[(i + 1) % len]];
+					const Vec3 p = v3(MC_CORNERS[e[0]][0] + MC_CORNERS[e[1]][0], MC_CORNERS[e[0]][1] + MC_CORNERS[e[1]][1],
+														MC_CORNERS[e[0]][2] + MC_CORNERS[e[1]][2]);
+					const Vec3 q = v3(MC_CORNERS[f[0]][0] + MC_CORNERS[f[1]][0], MC_CORNERS[f[0]][1] + MC_CORNERS[f[1]][1],
+														MC_CORNERS[f[0]][2] + MC_CORNERS[f[1]][2]);
+					normal = normal + v3((p.y - q.y) * (p.z + q.z), (p.z - q.z) * (p.x + q.x), (p.x - q.x) * (p.y + q.y));
+				}
+				const bool flip = dot(out, normal) < 0.0f;
+
+				u32 best = 0, best_flat = ~0u;
+				for (u32 r = 0; r < len; ++r) {
+					u32 flat = 0;
+					for (u32 i = 2; i + 1 < len; ++i)
+						flat += (mcEdgeFaces(loop[r]) & mcEdgeFaces(loop[(r + i) % len])) != 0;
+					if (flat < best_flat) {
+						best = r;
+						best_flat = flat;
+					}
+				}
+
+				for (u32 i = 1; i + 1 < len; ++i) {
+					assert(t.tri_count[c] < MC_MAX_CASE_TRIS);
+					i32* tri = t.tri_edges[c] + t.tri_count[c]++ * 3;
+					tri[0] = loop[best];
+					tri[flip ? 2 : 1] = loop[(best + i) % len];
+					tri[flip ? 1 : 2] = loop[(best + i + 1) % len];
+				}
+			}
+		}
+		return t;
+	}
+};
+
+// scan writes the draw, plus how many blocks were extracted this frame
+struct McCommand {
+	DrawArraysCommand draw;
+	u32 dirty_blocks;
+};
+
+struct MarchingCubes {
+	Buffer<GL_SHADER_STORAGE_BUFFER> table;
+	Buffer<GL_SHADER_STORAGE_BUFFER> density;   // fixed point, see mc-splat.glsl
+	Buffer<GL_SHADER_STORAGE_BUFFER> reference; // density each node was last extracted with
+	Buffer<GL_SHADER_STORAGE_BUFFER> blocks;    // dirty flag, triangles and offsets per block
+	Buffer<GL_DRAW_INDIRECT_BUFFER> command;
+	Buffer<GL_SHADER_STORAGE_BUFFER> vertices[2]; // this frame's mesh and last frame's
+	GpuReadback stats;
+	McCommand last;
+
+	u32 cells; // per axis, a multiple of MC_BLOCK
+	Vec3 box;
+	bool force; // extract every block, the grid changed
+	u32 current; // vertices the newest extraction writes
+
+	u32 table_res;
+	u32 density_res;
+	u32 reference_res;
+	u32 blocks_res;
+	u32 command_res;
+	u32 vertices_res[2];
+
+	static MarchingCubes make(FrameGraph& fg) {
+		MarchingCubes mc = {};
+		McTable t = McTable::make();
+		const u32 nodes = (MC_MAX_CELLS + 1) * (MC_MAX_CELLS + 1) * (MC_MAX_CELLS + 1);
+		const u32 max_blocks = (MC_MAX_CELLS / MC_BLOCK) * (MC_MAX_CELLS / MC_BLOCK) * (MC_MAX_CELLS / MC_BLOCK);
+		McCommand none = {};
+
+		mc.table = Buffer<GL_SHADER_STORAGE_BUFFER>::make(&t, sizeof(t));
+		mc.density = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, sizeof(u32) * nodes);
+		mc.reference = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, sizeof(f32) * nodes);
+		mc.blocks = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, sizeof(u32) * 4 * max_blocks);
+		mc.command = Buffer<GL_DRAW_INDIRECT_BUFFER>::make(&none, sizeof(none));
+		for (u32 i = 0; i < 2; ++i)
+			mc.vertices[i] = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, sizeof(Vec4) * 2 * 3 * MC_MAX_TRIANGLES);
+		mc.stats = GpuReadback::make(sizeof(McCommand));
+
+		mc.table_res = fg.addBuffer("mc_table", mc.table.range());
+		mc.density_res = fg.addBuffer("mc_density", mc.density.range());
+		mc.reference_res = fg.addBuffer("mc_reference", mc.reference.range());
+		mc.blocks_res = fg.addBuffer("mc_blocks", mc.blocks.range());
+		mc.command_res = fg.addBuffer("mc_command", mc.command.range());
+		mc.vertices_res[0] = fg.addBuffer("mc_vertices", mc.vertices[0].range());
+		mc.vertices_res[1] = fg.addBuffer("mc_vertices", mc.vertices[1].range());
+		mc.force = true;
+		return mc;
+	}
+
+	u32 blockCount() {
+		const u32 n = cells / MC_BLOCK;
+		return n * n * n;
+	}
+
+	// between frames; anything else than last time extracts everything again
+	void setGrid(u32 c, Vec3 box_size) {
+		c = clamp(c / MC_BLOCK * MC_BLOCK, (u32)MC_BLOCK, (u32)MC_MAX_CELLS);
+		if (c != cells || box_size.x != box.x || box_size.y != box.y || box_size.z != box.z)
+			force = true;
+		cells = c;
+		box = box_size;
+	}
+
+	// threshold is in units of the iso level's density
+	void addExtractPasses(FrameGraph& fg, Shader* splat, Shader* mark, Shader* freeze, Shader* count, Shader* scan,
+												Shader* generate, f32 threshold, u32 state_res, u32 params_res) {
+		MarchingCubes* mc = this;
+		const u32 prev = current;
+		current ^= 1;
+		const u32 cur = current;
+		const bool all = force;
+		force = false;
+		const u32 n = cells;
+		const u32 nodes_groups = (n + 1 + MC_BLOCK - 1) / MC_BLOCK;
+
+		stats.read(&last);
+
+		fg.addPass("mc splat", [=]() {
+			GL(glClearNamedBufferSubData(mc->density.id, GL_R32UI, mc->density.offset,
+																	 sizeof(u32) * (n + 1) * (n + 1) * (n + 1), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL));
+			splat->setUniform("_cells", (i32)n);
+			splat->execute((PARTICLE_COUNT + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 0)
+		.writes(density_res, 1);
+
+		fg.addPass("mc mark", [=]() {
+			mark->setUniform("_cells", (i32)n);
+			mark->setUniform("_force", (i32)all);
+			mark->setUniform("_threshold", threshold);
+			mark->execute(nodes_groups, nodes_groups, nodes_groups);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(density_res, FG_SSBO_READ, 1)
+		.reads(reference_res, FG_SSBO_READ, 2)
+		.writes(blocks_res, 3);
+
+		fg.addPass("mc freeze", [=]() {
+			freeze->setUniform("_cells", (i32)n);
+			freeze->execute(nodes_groups, nodes_groups, nodes_groups);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(density_res, FG_SSBO_READ, 1)
+		.writes(reference_res, 2)
+		.reads(blocks_res, FG_SSBO_READ, 3);
+
+		fg.addPass("mc count", [=]() {
+			count->setUniform("_cells", (i32)n);
+			count->execute(mc->blockCount(), 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(reference_res, FG_SSBO_READ, 2)
+		.reads(table_res, FG_SSBO_READ, 5)
+		.writes(blocks_res, 3);
+
+		fg.addPass("mc scan", [=]() {
+			scan->setUniform("_cells", (i32)n);
+			scan->setUniform("_max_triangles", (i32)MC_MAX_TRIANGLES);
+			scan->execute(1, 1, 1);
+		})
+		.writes(blocks_res, 3)
+		.writes(command_res, 4);
+
+		fg.addPass("mc generate", [=]() {
+			generate->setUniform("_cells", (i32)n);
+			generate->setUniform("_max_triangles", (i32)MC_MAX_TRIANGLES);
+			generate->execute(mc->blockCount(), 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(reference_res, FG_SSBO_READ, 2)
+		.writes(blocks_res, 3)
+		.reads(table_res, FG_SSBO_READ, 5)
+		.reads(vertices_res[prev], FG_SSBO_READ, 6)
+		.writes(vertices_res[cur], 7);
+	}
+
+	void addDrawPass(FrameGraph& fg, Shader* shader, GLuint vao, u32 target_res) {
+		MarchingCubes* mc = this;
+		fg.addPass("mc draw", [=]() {
+			shader->setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
+			shader->setUniform("_view", camera.viewMat());
+			gl_state.bindVertexArray(vao); // no vertex data, mc-vs.glsl goes by gl_VertexID
+			gl_state.useProgram(shader->id);
+			mc->command.bind();
+			GL(glDrawArraysIndirect(GL_TRIANGLES, (void*)(uintptr_t)mc->command.offset));
+		})
+		.reads(vertices_res[current], FG_SSBO_READ, 0)
+		.reads(command_res, FG_INDIRECT_READ)
+		.renders(target_res);
+
+		// copies the counts for display
+		fg.addPass("mc stats", [=]() {
+			mc->stats.copy(mc->command.range());
+		})
+		.access(command_res, FG_CPU_READ, 0);
+	}
+
+	// of the newest stats read back
+	u32 triangles() { return last.draw.count / 3; }
+
+	// Wavefront OBJ of the newest mesh, straight from the GPU. Waits on it,
+	// it's only for the occasional export.
+	bool writeObj(const char* path) {
+		GL(glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT));
+		McCommand c;
+		command.read(&c);
+		const u32 verts = c.draw.count;
+		Vec4* v = (Vec4*)malloc(sizeof(Vec4) * 2 * max(verts, 1u));
+		GL(glGetNamedBufferSubData(vertices[current].id, vertices[current].offset, sizeof(Vec4) * 2 * verts, v));
+
+		FILE* f = fopen(path, "w");
+		if (!f) {
+			free(v);
+			return false;
+		}
+		for (u32 i = 0; i < verts; ++i)
+			fprintf(f, "v %f %f %f\n", v[2 * i].x, v[2 * i].y, v[2 * i].z);
+		for (u32 i = 0; i < verts; ++i)
+			fprintf(f, "vn %f %f %f\n", v[2 * i + 1].x, v[2 * i + 1].y, v[2 * i + 1].z);
+		for (u32 i = 0; i < verts; i += 3)
+			fprintf(f, "f %u//%u %u//%u %u//%u\n", i + 1, i + 1, i + 2, i + 2, i + 3, i + 3);
+		fclose(f);
+		free(v);
+		return true;
+	}
+
+	void destroy() {
+		stats.destroy();
+		vertices[1].destroy();
+		vertices[0].destroy();
+		command.destroy();
+		blocks.destroy();
+		reference.destroy();
+		density.destroy();
+		table.destroy();
+	}
+};
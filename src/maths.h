@@ -816,3 +816,301 @@ Vec3 right(Mat4 mat) {
 	return col;
 }
 
+
+
+////
+// SIMD batches
+//
+// F32xN holds N floats, M32xN the matching lane mask:
+//   F32x1  scalar fallback, any platform
+//   F32x4  SSE2, always there on x86-64
+//   F32x8  AVX2 + FMA
+//   F32x16 AVX-512F
+// Nothing needs -mavx2 etc. The wider types are compiled inside
+// SIMD_TARGET_BEGIN/END regions and only ever called after simdBestIsa()
+// says the CPU has them. Generic code over a batch type (Vec3 batches, the
+// SPH kernels) lives in maths_batch.h, included once per ISA into its own
+// namespace, since a template instantiated outside a target region can't
+// use the wider types.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+#define SIMD_STR(x) #x
+#if defined(__clang__)
+#define SIMD_TARGET_BEGIN(t) _Pragma(SIMD_STR(clang attribute push(__attribute__((target(t))), apply_to = function)))
+#define SIMD_TARGET_END() _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#define SIMD_TARGET_BEGIN(t) _Pragma("GCC push_options") _Pragma(SIMD_STR(GCC target(t)))
+#define SIMD_TARGET_END() _Pragma("GCC pop_options")
+#else // MSVC lets any function use any intrinsic
+#define SIMD_TARGET_BEGIN(t)
+#define SIMD_TARGET_END()
+#endif
+
+enum SimdIsa : u32 {
+	SIMD_SCALAR,
+	SIMD_SSE,
+	SIMD_AVX2,
+	SIMD_AVX512,
+	SIMD_ISA_COUNT,
+};
+
+const char* simdIsaName(SimdIsa isa) {
+	const char* names[] = { "scalar", "sse", "avx2", "avx512" };
+	return names[isa];
+}
+
+// widest ISA both the build and the CPU (and OS) support
+SimdIsa simdBestIsa() {
+#if SIMD_X86 && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+	return SIMD_SSE;
+#elif SIMD_X86
+	return SIMD_SSE; // no cpuid probing on MSVC yet
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+// scalar
+
+struct M32x1 {
+	bool v;
+	static M32x1 firstN(u32 n) { return { n > 0 }; }
+};
+
+struct F32x1 {
+	f32 v;
+	static constexpr u32 WIDTH = 1;
+	static F32x1 set(f32 x) { return { x }; }
+	static F32x1 load(const f32* p) { return { *p }; }
+	static F32x1 loadPartial(const f32* p, u32 n) { return { n ? *p : 0.0f }; }
+};
+
+inline F32x1 operator+(F32x1 a, F32x1 b) { return { a.v + b.v }; }
+inline F32x1 operator-(F32x1 a, F32x1 b) { return { a.v - b.v }; }
+inline F32x1 operator*(F32x1 a, F32x1 b) { return { a.v * b.v }; }
+inline F32x1 operator/(F32x1 a, F32x1 b) { return { a.v / b.v }; }
+inline M32x1 operator<(F32x1 a, F32x1 b) { return { a.v < b.v }; }
+inline M32x1 operator>=(F32x1 a, F32x1 b) { return { a.v >= b.v }; }
+inline M32x1 operator&(M32x1 a, M32x1 b) { return { a.v && b.v }; }
+inline F32x1 select(M32x1 m, F32x1 a, F32x1 b) { return m.v ? a : b; }
+inline F32x1 sqrt(F32x1 a) { return { sqrtf(a.v) }; }
+inline F32x1 round(F32x1 a) { return { rintf(a.v) }; } // to nearest even, like the wide ones
+inline bool any(M32x1 m) { return m.v; }
+inline f32 reduceAdd(F32x1 a) { return a.v; }
+inline f32 reduceMin(F32x1 a) { return a.v; }
+inline f32 reduceMax(F32x1 a) { return a.v; }
+
+#if SIMD_X86
+
+// SSE2
+
+struct M32x4 {
+	__m128 v;
+	static M32x4 firstN(u32 n) { return { _mm_cmplt_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps((f32)n)) }; }
+};
+
+struct F32x4 {
+	__m128 v;
+	static constexpr u32 WIDTH = 4;
+	static F32x4 set(f32 x) { return { _mm_set1_ps(x) }; }
+	static F32x4 load(const f32* p) { return { _mm_loadu_ps(p) }; }
+	static F32x4 loadPartial(const f32* p, u32 n) {
+		if (n >= 4) return load(p);
+		f32 tmp[4] = {};
+		for (u32 i = 0; i < n; ++i) tmp[i] = p[i];
+		return load(tmp);
+	}
+};
+
+inline F32x4 operator+(F32x4 a, F32x4 b) { return { _mm_add_ps(a.v, b.v) }; }
+inline F32x4 operator-(F32x4 a, F32x4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline F32x4 operator*(F32x4 a, F32x4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline F32x4 operator/(F32x4 a, F32x4 b) { return { _mm_div_ps(a.v, b.v) }; }
+inline M32x4 operator<(F32x4 a, F32x4 b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+inline M32x4 operator>=(F32x4 a, F32x4 b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+inline M32x4 operator&(M32x4 a, M32x4 b) { return { _mm_and_ps(a.v, b.v) }; }
+inline F32x4 select(M32x4 m, F32x4 a, F32x4 b) {
+	return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) };
+}
+inline F32x4 sqrt(F32x4 a) { return { _mm_sqrt_ps(a.v) }; }
+inline F32x4 round(F32x4 a) { return { _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)) }; } // SSE4.1 has no place here
+inline bool any(M32x4 m) { return _mm_movemask_ps(m.v) != 0; }
+
+inline f32 reduceAdd(F32x4 a) {
+	__m128 s = _mm_add_ps(a.v, _mm_movehl_ps(a.v, a.v));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+inline f32 reduceMin(F32x4 a) {
+	__m128 s = _mm_min_ps(a.v, _mm_movehl_ps(a.v, a.v));
+	s = _mm_min_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+inline f32 reduceMax(F32x4 a) {
+	__m128 s = _mm_max_ps(a.v, _mm_movehl_ps(a.v, a.v));
+	s = _mm_max_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+// AVX2
+
+SIMD_TARGET_BEGIN("avx2,fma")
+
+struct M32x8 {
+	__m256 v;
+	static M32x8 firstN(u32 n) {
+		return { _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))) };
+	}
+};
+
+struct F32x8 {
+	__m256 v;
+	static constexpr u32 WIDTH = 8;
+	static F32x8 set(f32 x) { return { _mm256_set1_ps(x) }; }
+	static F32x8 load(const f32* p) { return { _mm256_loadu_ps(p) }; }
+	// masked-off lanes aren't touched, so reading past the end is fine
+	static F32x8 loadPartial(const f32* p, u32 n) {
+		if (n >= 8) return load(p);
+		return { _mm256_maskload_ps(p, _mm256_castps_si256(M32x8::firstN(n).v)) };
+	}
+};
+
+inline F32x8 operator+(F32x8 a, F32x8 b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline F32x8 operator-(F32x8 a, F32x8 b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline F32x8 operator*(F32x8 a, F32x8 b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline F32x8 operator/(F32x8 a, F32x8 b) { return { _mm256_div_ps(a.v, b.v) }; }
+inline M32x8 operator<(F32x8 a, F32x8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline M32x8 operator>=(F32x8 a, F32x8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+inline M32x8 operator&(M32x8 a, M32x8 b) { return { _mm256_and_ps(a.v, b.v) }; }
+inline F32x8 select(M32x8 m, F32x8 a, F32x8 b) { return { _mm256_blendv_ps(b.v, a.v, m.v) }; }
+inline F32x8 sqrt(F32x8 a) { return { _mm256_sqrt_ps(a.v) }; }
+inline F32x8 round(F32x8 a) { return { _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) }; }
+inline bool any(M32x8 m) { return _mm256_movemask_ps(m.v) != 0; }
+
+inline f32 reduceAdd(F32x8 a) {
+	return reduceAdd(F32x4 { _mm_add_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1)) });
+}
+inline f32 reduceMin(F32x8 a) {
+	return reduceMin(F32x4 { _mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1)) });
+}
+inline f32 reduceMax(F32x8 a) {
+	return reduceMax(F32x4 { _mm_max_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1)) });
+}
+
+SIMD_TARGET_END()
+
+// AVX-512
+
+SIMD_TARGET_BEGIN("avx512f")
+
+struct M32x16 {
+	__mmask16 v;
+	static M32x16 firstN(u32 n) { return { (__mmask16)(n >= 16 ? 0xffff : (1u << n) - 1) }; }
+};
+
+struct F32x16 {
+	__m512 v;
+	static constexpr u32 WIDTH = 16;
+	static F32x16 set(f32 x) { return { _mm512_set1_ps(x) }; }
+	static F32x16 load(const f32* p) { return { _mm512_loadu_ps(p) }; }
+	static F32x16 loadPartial(const f32* p, u32 n) {
+		return { _mm512_maskz_loadu_ps(M32x16::firstN(n).v, p) };
+	}
+};
+
+inline F32x16 operator+(F32x16 a, F32x16 b) { return { _mm512_add_ps(a.v, b.v) }; }
+inline F32x16 operator-(F32x16 a, F32x16 b) { return { _mm512_sub_ps(a.v, b.v) }; }
+inline F32x16 operator*(F32x16 a, F32x16 b) { return { _mm512_mul_ps(a.v, b.v) }; }
+inline F32x16 operator/(F32x16 a, F32x16 b) { return { _mm512_div_ps(a.v, b.v) }; }
+inline M32x16 operator<(F32x16 a, F32x16 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+inline M32x16 operator>=(F32x16 a, F32x16 b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+inline M32x16 operator&(M32x16 a, M32x16 b) { return { (__mmask16)(a.v & b.v) }; }
+inline F32x16 select(M32x16 m, F32x16 a, F32x16 b) { return { _mm512_mask_blend_ps(m.v, b.v, a.v) }; }
+inline F32x16 sqrt(F32x16 a) { return { _mm512_sqrt_ps(a.v) }; }
+inline F32x16 round(F32x16 a) { return { _mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) }; }
+inline bool any(M32x16 m) { return m.v != 0; }
+inline f32 reduceAdd(F32x16 a) { return _mm512_reduce_add_ps(a.v); }
+inline f32 reduceMin(F32x16 a) { return _mm512_reduce_min_ps(a.v); }
+inline f32 reduceMax(F32x16 a) { return _mm512_reduce_max_ps(a.v); }
+
+SIMD_TARGET_END()
+
+#endif // SIMD_X86
+
+// everything the batched SPH kernels need, see maths_batch.h
+struct SphKernelParams {
+	f32 radius;
+	f32 norm;      // smoothingFunc
+	f32 der_norm;  // smoothingFuncDer
+	f32 mass;
+	f32 target_density;
+	f32 pressure_mul;
+	f32 box[3];
+	bool periodic[3];
+};
+
+// one ISA's build of the kernels in maths_batch.h
+struct SimdKernels {
+	SimdIsa isa;
+	u32 width;
+	f32  (*sphDensityRow)(const SphKernelParams& p, const f32* const* pos, u32 begin, u32 end, const f32* q);
+	void (*sphForceRow)(const SphKernelParams& p, const f32* const* pos, const f32* density,
+											u32 begin, u32 end, const f32* q, f32 pressure, f32* force);
+};
+
+namespace simd_scalar {
+typedef F32x1 F;
+typedef M32x1 M;
+#include "maths_batch.h"
+}
+typedef simd_scalar::Vec3B Vec3x1;
+
+#if SIMD_X86
+namespace simd_sse {
+typedef F32x4 F;
+typedef M32x4 M;
+#include "maths_batch.h"
+}
+typedef simd_sse::Vec3B Vec3x4;
+
+SIMD_TARGET_BEGIN("avx2,fma")
+namespace simd_avx2 {
+typedef F32x8 F;
+typedef M32x8 M;
+#include "maths_batch.h"
+}
+SIMD_TARGET_END()
+typedef simd_avx2::Vec3B Vec3x8;
+
+SIMD_TARGET_BEGIN("avx512f")
+namespace simd_avx512 {
+typedef F32x16 F;
+typedef M32x16 M;
+#include "maths_batch.h"
+}
+SIMD_TARGET_END()
+typedef simd_avx512::Vec3B Vec3x16;
+#endif
+
+// NULL if the build or the CPU can't run isa
+const SimdKernels* simdKernels(SimdIsa isa) {
+	if (isa > simdBestIsa()) return NULL;
+	switch (isa) {
+		case SIMD_SCALAR: return &simd_scalar::kernels;
+#if SIMD_X86
+		case SIMD_SSE:    return &simd_sse::kernels;
+		case SIMD_AVX2:   return &simd_avx2::kernels;
+		case SIMD_AVX512: return &simd_avx512::kernels;
+#endif
+		default:          return NULL;
+	}
+}
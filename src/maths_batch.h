@@ -0,0 +1,103 @@
+// Generic code over one SIMD batch type. No #pragma once: maths.h includes
+// this once per ISA, inside that ISA's target region and namespace, with F
+// (N floats) and M (N lane mask) typedef'd to its batch types.
+
+static constexpr u32 WIDTH = F::WIDTH;
+
+// 3-vectors, N at a time
+struct Vec3B {
+	F x, y, z;
+
+	static Vec3B set(const f32* v) { return { F::set(v[0]), F::set(v[1]), F::set(v[2]) }; }
+	// from SoA arrays, n lanes starting at i, the rest zero
+	static Vec3B loadPartial(const f32* const* soa, u32 i, u32 n) {
+		return { F::loadPartial(soa[0] + i, n), F::loadPartial(soa[1] + i, n), F::loadPartial(soa[2] + i, n) };
+	}
+};
+
+inline Vec3B operator+(Vec3B a, Vec3B b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+inline Vec3B operator-(Vec3B a, Vec3B b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+inline Vec3B operator*(Vec3B a, F s) { return { a.x * s, a.y * s, a.z * s }; }
+inline F dot(Vec3B a, Vec3B b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline F length2(Vec3B a) { return dot(a, a); }
+
+// lanes whose vector is strictly inside radius
+inline M inRadius(Vec3B d, F radius) {
+	return length2(d) < radius * radius;
+}
+
+// nearest periodic image, per axis
+inline F minImage(F d, f32 box, bool periodic) {
+	if (!periodic) return d;
+	const F b = F::set(box);
+	return d - b * round(d / b);
+}
+
+inline Vec3B minImage(Vec3B d, const SphKernelParams& p) {
+	return {
+		minImage(d.x, p.box[0], p.periodic[0]),
+		minImage(d.y, p.box[1], p.periodic[1]),
+		minImage(d.z, p.box[2], p.periodic[2]),
+	};
+}
+
+// sph.glsl kernels, zero at and beyond radius
+inline F smoothingFunc(F dst, const SphKernelParams& p) {
+	const F r = F::set(p.radius);
+	return select(dst < r, (r - dst) * (r - dst) * F::set(p.norm), F::set(0.0f));
+}
+
+inline F smoothingFuncDer(F dst, const SphKernelParams& p) {
+	const F r = F::set(p.radius);
+	return select(dst < r, (dst - r) * F::set(p.der_norm), F::set(0.0f));
+}
+
+inline F densityToPressure(F d, const SphKernelParams& p) {
+	return (d - F::set(p.target_density)) * F::set(p.pressure_mul);
+}
+
+// sum of mass * W(|pos[t] - q|) over the SoA range [begin, end)
+f32 sphDensityRow(const SphKernelParams& p, const f32* const* pos, u32 begin, u32 end, const f32* q) {
+	const Vec3B qv = Vec3B::set(q);
+	const F r = F::set(p.radius);
+	F sum = F::set(0.0f);
+	for (u32 t = begin; t < end; t += WIDTH) {
+		const u32 n = min(end - t, WIDTH);
+		const Vec3B d = minImage(Vec3B::loadPartial(pos, t, n) - qv, p);
+		const M m = M::firstN(n) & inRadius(d, r);
+		if (!any(m)) continue;
+		sum = sum + select(m, smoothingFunc(sqrt(length2(d)), p), F::set(0.0f));
+	}
+	return reduceAdd(sum) * p.mass;
+}
+
+// adds the pressure force from [begin, end) on a particle at q to force;
+// the particle itself must not be in the range
+void sphForceRow(const SphKernelParams& p, const f32* const* pos, const f32* density,
+								 u32 begin, u32 end, const f32* q, f32 pressure, f32* force) {
+	const Vec3B qv = Vec3B::set(q);
+	const F r = F::set(p.radius);
+	const F pres = F::set(pressure);
+	Vec3B f = { F::set(0.0f), F::set(0.0f), F::set(0.0f) };
+	for (u32 t = begin; t < end; t += WIDTH) {
+		const u32 n = min(end - t, WIDTH);
+		const Vec3B d = minImage(Vec3B::loadPartial(pos, t, n) - qv, p);
+		const M m = M::firstN(n) & inRadius(d, r);
+		if (!any(m)) continue;
+		const F dist = sqrt(length2(d));
+		const F dj = F::loadPartial(density + t, n);
+		const F w = (pres + densityToPressure(dj, p)) * F::set(0.5f)
+							* smoothingFuncDer(dist, p) * F::set(p.mass) / dj;
+		f = f + d * select(m, w / dist, F::set(0.0f));
+	}
+	force[0] += reduceAdd(f.x);
+	force[1] += reduceAdd(f.y);
+	force[2] += reduceAdd(f.z);
+}
+
+static const SimdKernels kernels = {
+	(SimdIsa)(WIDTH == 1 ? SIMD_SCALAR : WIDTH == 4 ? SIMD_SSE : WIDTH == 8 ? SIMD_AVX2 : SIMD_AVX512),
+	WIDTH,
+	sphDensityRow,
+	sphForceRow,
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+// Software rasterization of the particles in compute, for counts where the
+// hardware path drowns in pixel sized triangles. Every particle projects
+// itself and covers a small disk (up to POINT_MAX_RADIUS pixels) of a
+// visibility buffer holding the nearest depth and the particle id per pixel,
+// and a full screen pass shades from that id straight out of the particle
+// state, ray casting the sphere for normal and depth like the impostors.
+//
+// With 64-bit atomics the depth goes in the high word and the id in the low
+// one, and one atomicMin per pixel keeps the nearest particle. Without them
+// (most drivers that aren't NVIDIA's) it takes two passes over the
+// particles: atomicMin on the depth alone, then whoever matches the stored
+// depth writes its id. Both use the same buffer layout, see point-raster.glsl.
+//
+// Needs Shader, Buffer, hasGlExtension(), WINDOW_WIDTH/WINDOW_HEIGHT and the
+// frame graph from final.cc.
+
+#define POINT_MAX_RADIUS 8 // pixels, must match point-raster.glsl
+
+struct PointRaster {
+	Buffer<GL_SHADER_STORAGE_BUFFER> visibility; // (id, depth bits) per pixel
+	bool atomic64;
+
+	u32 visibility_res;
+
+	static PointRaster make(FrameGraph& fg) {
+		PointRaster r = {};
+		r.atomic64 = hasGlExtension("GL_ARB_gpu_shader_int64") && hasGlExtension("GL_NV_shader_atomic_int64");
+		r.visibility = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, sizeof(u32) * 2 * WINDOW_WIDTH * WINDOW_HEIGHT);
+		r.visibility_res = fg.addBuffer("point_visibility", r.visibility.range());
+		if (!r.atomic64)
+			printf("No 64-bit atomics, the point rasterizer goes over the particles twice\n");
+		return r;
+	}
+
+	static void setRasterUniforms(Shader* s, bool surface_only) {
+		s->setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
+		s->setUniform("_view", camera.viewMat());
+		s->setUniform("_viewport", v2(WINDOW_WIDTH, WINDOW_HEIGHT));
+		s->setUniform("_surface_only", (i32)surface_only);
+	}
+
+	// raster is the depth pass without atomic64, id is only used then
+	void addRasterPasses(FrameGraph& fg, Shader* raster, Shader* id, bool surface_only, u32 state_res,
+											 u32 params_res) {
+		PointRaster* r = this;
+
+		fg.addPass(atomic64 ? "point raster" : "point depth", [=]() {
+			const u32 empty = ~0u; // farther than any depth
+			GL(glClearNamedBufferSubData(r->visibility.id, GL_R32UI, r->visibility.offset, r->visibility.size,
+																	 GL_RED_INTEGER, GL_UNSIGNED_INT, &empty));
+			setRasterUniforms(raster, surface_only);
+			raster->execute((PARTICLE_COUNT + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 1)
+		.writes(visibility_res, 0);
+
+		if (atomic64) return;
+
+		fg.addPass("point id", [=]() {
+			setRasterUniforms(id, surface_only);
+			id->execute((PARTICLE_COUNT + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 1)
+		.writes(visibility_res, 0);
+	}
+
+	void addResolvePass(FrameGraph& fg, Shader* resolve, GLuint vao, u32 state_res, u32 params_res, u32 target_res) {
+		fg.addPass("point resolve", [=]() {
+			const Mat4 proj = perspMat(0.25, 1920.0/1080.0, .1, 1000.0);
+			resolve->setUniform("_proj", proj);
+			resolve->setUniform("_inv_proj", inverse(proj));
+			resolve->setUniform("_view", camera.viewMat());
+			resolve->setUniform("_viewport", v2(WINDOW_WIDTH, WINDOW_HEIGHT));
+			gl_state.bindVertexArray(vao);
+			gl_state.useProgram(resolve->id);
+			GL(glDrawArrays(GL_TRIANGLES, 0, 3));
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(visibility_res, FG_SSBO_READ, 0)
+		.reads(state_res, FG_SSBO_READ, 1)
+		.renders(target_res);
+	}
+
+	void destroy() {
+		visibility.destroy();
+	}
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+// GLSL source preprocessing, done on the CPU before glShaderSource:
+//  - #include "file" is expanded in place (each file at most once)
+//  - defines from a ShaderDefines set are injected right after #version
+// #line directives are emitted so compile errors still point at the right
+// file (source string number = include order, 0 is the root file).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "maths.h"
+
+char* loadTextFile(const char* path);
+
+struct StrBuf {
+	char* data;
+	size_t len;
+	size_t cap;
+
+	static StrBuf make() {
+		StrBuf buf;
+		buf.cap = 4096;
+		buf.len = 0;
+		buf.data = (char*)malloc(buf.cap);
+		buf.data[0] = 0;
+		return buf;
+	}
+
+	void append(const char* str, size_t n) {
+		if (len + n + 1 > cap) {
+			while (len + n + 1 > cap) cap *= 2;
+			data = (char*)realloc(data, cap);
+		}
+		memcpy(data + len, str, n);
+		len += n;
+		data[len] = 0;
+	}
+
+	void append(const char* str) {
+		append(str, strlen(str));
+	}
+
+	void appendf(const char* fmt, ...) {
+		char tmp[256];
+		va_list args;
+		va_start(args, fmt);
+		int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+		va_end(args);
+		append(tmp, min<size_t>(n, sizeof(tmp) - 1));
+	}
+};
+
+#define MAX_SHADER_DEFINES 16
+
+// A set of #defines identifying one shader permutation. Kept sorted by name
+// so the same set always hashes the same regardless of insertion order.
+struct ShaderDefines {
+	struct {
+		char name[32];
+		char value[32];
+	} defs[MAX_SHADER_DEFINES];
+	u32 count;
+
+	static ShaderDefines make() {
+		ShaderDefines d;
+		d.count = 0;
+		return d;
+	}
+
+	ShaderDefines& set(const char* name, const char* value = "1") {
+		u32 i = 0;
+		while (i < count && strcmp(defs[i].name, name) < 0) ++i;
+
+		if (i == count || strcmp(defs[i].name, name)) {
+			if (count == MAX_SHADER_DEFINES) {
+				printf("Too many shader defines, dropping %s!\n", name);
+				return *this;
+			}
+			memmove(&defs[i + 1], &defs[i], (count - i) * sizeof(defs[0]));
+			count++;
+			snprintf(defs[i].name, sizeof(defs[i].name), "%s", name);
+		}
+		snprintf(defs[i].value, sizeof(defs[i].value), "%s", value);
+		return *this;
+	}
+
+	ShaderDefines& setInt(const char* name, i32 value) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%d", value);
+		return set(name, buf);
+	}
+
+	// always printed with an exponent so GLSL parses it as a float literal
+	ShaderDefines& setFloat(const char* name, f32 value) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.9e", value);
+		return set(name, buf);
+	}
+
+	u64 hash(u64 seed) const {
+		u64 h = seed;
+		for (u32 i = 0; i < count; ++i) {
+			h = hashStr(h, defs[i].name);
+			h = hashStr(h, "=");
+			h = hashStr(h, defs[i].value);
+			h = hashStr(h, ";");
+		}
+		return h;
+	}
+
+	// FNV-1a
+	static u64 hashStr(u64 h, const char* str) {
+		for (; *str; ++str) {
+			h ^= (u8)*str;
+			h *= 0x100000001b3ull;
+		}
+		return h;
+	}
+};
+
+constexpr u64 HASH_SEED = 0xcbf29ce484222325ull;
+
+#define MAX_SHADER_INCLUDES 16
+
+struct IncludeState {
+	char files[MAX_SHADER_INCLUDES][128];
+	u32 num_files;
+};
+
+static bool preprocessFile(StrBuf* out, const char* path,
+													 const ShaderDefines* defines, IncludeState* st) {
+	if (st->num_files == MAX_SHADER_INCLUDES) {
+		printf("%s: too many includes!\n", path);
+		return false;
+	}
+	const u32 file_idx = st->num_files++;
+	snprintf(st->files[file_idx], sizeof(st->files[0]), "%s", path);
+
+	char* src = loadTextFile(path);
+	if (!src) return false;
+
+	bool ok = true;
+	u32 line_no = 1;
+	for (char* line = src; *line; ++line_no) {
+		char* end = strchr(line, '\n');
+		size_t line_len = end ? (size_t)(end - line + 1) : strlen(line);
+
+		char* p = line;
+		while (*p == ' ' || *p == '\t') ++p;
+
+		if (!strncmp(p, "#include", 8)) {
+			char* open = strchr(p, '"');
+			char* close = open ? strchr(open + 1, '"') : NULL;
+			if (!close || (end && close > end)) {
+				printf("%s:%u: malformed #include\n", path, line_no);
+				ok = false;
+				break;
+			}
+
+			char inc[128];
+			snprintf(inc, sizeof(inc), "%.*s", (int)(close - open - 1), open + 1);
+
+			bool seen = false;
+			for (u32 i = 0; i < st->num_files; ++i)
+				if (!strcmp(st->files[i], inc)) seen = true;
+
+			if (!seen) {
+				out->appendf("#line 1 %u\n", st->num_files);
+				if (!preprocessFile(out, inc, NULL, st)) {
+					printf("  included from %s:%u\n", path, line_no);
+					ok = false;
+					break;
+				}
+			}
+			out->appendf("\n#line %u %u\n", line_no + 1, file_idx);
+		} else {
+			out->append(line, line_len);
+
+			// defines must come after #version, which has to be the first thing
+			if (defines && !strncmp(p, "#version", 8)) {
+				if (!end) out->append("\n");
+				for (u32 i = 0; i < defines->count; ++i)
+					out->appendf("#define %s %s\n", defines->defs[i].name, defines->defs[i].value);
+				out->appendf("#line %u %u\n", line_no + 1, file_idx);
+				defines = NULL;
+			}
+		}
+
+		line += line_len;
+	}
+
+	free(src);
+	return ok;
+}
+
+// Returns malloc'd, fully expanded source for the stage at path, or NULL.
+char* preprocessShader(const char* path, const ShaderDefines* defines) {
+	IncludeState st;
+	st.num_files = 0;
+
+	StrBuf out = StrBuf::make();
+	if (!preprocessFile(&out, path, defines, &st)) {
+		free(out.data);
+		return NULL;
+	}
+	return out.data;
+}
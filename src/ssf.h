@@ -0,0 +1,174 @@
+#pragma once
+
+// Screen-space fluid rendering. Instead of shading every sphere, the
+// particles only go into two offscreen targets at a fraction of the window
+// resolution:
+//  - depth: view space z of the nearest sphere surface per pixel
+//  - thickness: how much fluid the eye ray goes through, additively
+// The depth is smoothed with a separable bilateral filter, which blends
+// neighbouring spheres into one surface without smearing it over
+// silhouettes, and a full screen pass reconstructs normals from it and
+// composites the fluid over the scene, absorbing by thickness. Past the
+// splatting, every pass costs per target pixel, whatever the particle count.
+//
+// Needs Shader, WINDOW_WIDTH/WINDOW_HEIGHT and the frame graph from final.cc.
+
+#define SSF_GROUP_SIZE 8 // must match ssf-smooth.glsl
+
+struct ScreenSpaceFluid {
+	GLuint fbo_depth;
+	GLuint fbo_thickness;
+	GLuint depth;      // R32F view space z, 0 where no fluid
+	GLuint zbuffer;    // for the depth pass' depth test
+	GLuint thickness;  // R16F
+	GLuint smooth[2];  // R32F, after the horizontal and the vertical filter
+	u32 width, height;
+	f32 scale; // of the window resolution
+
+	u32 depth_res;
+	u32 thickness_res;
+	u32 smooth_res;
+
+	static ScreenSpaceFluid make(FrameGraph& fg, f32 scale) {
+		ScreenSpaceFluid s = {};
+		s.createTargets(scale);
+		s.depth_res = fg.addBuffer("ssf_depth", {});
+		s.thickness_res = fg.addBuffer("ssf_thickness", {});
+		s.smooth_res = fg.addBuffer("ssf_smooth", {});
+		return s;
+	}
+
+	static GLuint makeTarget(GLenum format, u32 w, u32 h) {
+		GLuint t;
+		GL(glCreateTextures(GL_TEXTURE_2D, 1, &t));
+		GL(glTextureStorage2D(t, 1, format, w, h));
+		return t;
+	}
+
+	void createTargets(f32 s) {
+		scale = s;
+		width = max((u32)(WINDOW_WIDTH * s), 1u);
+		height = max((u32)(WINDOW_HEIGHT * s), 1u);
+
+		depth = makeTarget(GL_R32F, width, height);
+		zbuffer = makeTarget(GL_DEPTH_COMPONENT32F, width, height);
+		thickness = makeTarget(GL_R16F, width, height);
+		smooth[0] = makeTarget(GL_R32F, width, height);
+		smooth[1] = makeTarget(GL_R32F, width, height);
+
+		GL(glCreateFramebuffers(1, &fbo_depth));
+		GL(glNamedFramebufferTexture(fbo_depth, GL_COLOR_ATTACHMENT0, depth, 0));
+		GL(glNamedFramebufferTexture(fbo_depth, GL_DEPTH_ATTACHMENT, zbuffer, 0));
+		GL(glCreateFramebuffers(1, &fbo_thickness));
+		GL(glNamedFramebufferTexture(fbo_thickness, GL_COLOR_ATTACHMENT0, thickness, 0));
+		if (glCheckNamedFramebufferStatus(fbo_depth, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE ||
+				glCheckNamedFramebufferStatus(fbo_thickness, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			printf("Screen-space fluid targets incomplete!\n");
+	}
+
+	void destroyTargets() {
+		GL(glDeleteFramebuffers(1, &fbo_thickness));
+		GL(glDeleteFramebuffers(1, &fbo_depth));
+		GLuint textures[] = { depth, zbuffer, thickness, smooth[0], smooth[1] };
+		GL(glDeleteTextures(ARRAY_SIZE(textures), textures));
+	}
+
+	// only between frames, the passes hold on to the targets
+	void setScale(f32 s) {
+		if (s == scale) return;
+		destroyTargets();
+		createTargets(s);
+	}
+
+	// Offscreen half: splat the particles into depth and thickness and filter
+	// the depth. Both splats are impostor quads for every particle, see
+	// ssf-splat-ps.glsl.
+	void addSplatPasses(FrameGraph& fg, Shader* splat_depth, Shader* splat_thickness, Shader* smooth_shader,
+											GLuint vao, u32 state_res, u32 params_res) {
+		ScreenSpaceFluid* s = this;
+
+		fg.addPass("ssf depth", [=]() {
+			const f32 empty[4] = {};
+			GL(glBindFramebuffer(GL_FRAMEBUFFER, s->fbo_depth));
+			GL(glViewport(0, 0, s->width, s->height));
+			GL(glClearNamedFramebufferfv(s->fbo_depth, GL_COLOR, 0, empty));
+			GL(glClearNamedFramebufferfi(s->fbo_depth, GL_DEPTH_STENCIL, 0, 1.0f, 0));
+			s->splat(splat_depth, vao);
+			GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+			GL(glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT));
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 1)
+		.renders(depth_res);
+
+		fg.addPass("ssf thickness", [=]() {
+			const f32 empty[4] = {};
+			GL(glBindFramebuffer(GL_FRAMEBUFFER, s->fbo_thickness));
+			GL(glViewport(0, 0, s->width, s->height));
+			GL(glClearNamedFramebufferfv(s->fbo_thickness, GL_COLOR, 0, empty));
+			// no depth attachment, every sphere along the ray adds up
+			gl_state.enable(GL_BLEND, true);
+			GL(glBlendFunc(GL_ONE, GL_ONE));
+			s->splat(splat_thickness, vao);
+			gl_state.enable(GL_BLEND, false);
+			GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+			GL(glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT));
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 1)
+		.renders(thickness_res);
+
+		// the second direction reads what the first stored, hence the barrier
+		fg.addPass("ssf smooth", [=]() {
+			const GLuint src[2] = { s->depth, s->smooth[0] };
+			const i32 dirs[2][2] = { { 1, 0 }, { 0, 1 } };
+			for (u32 i = 0; i < 2; ++i) {
+				if (i > 0) GL(glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT));
+				GL(glBindTextureUnit(0, src[i]));
+				GL(glBindImageTexture(0, s->smooth[i], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F));
+				smooth_shader->setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
+				smooth_shader->setUniform("_dir", v2(dirs[i][0], dirs[i][1]));
+				smooth_shader->execute((s->width + SSF_GROUP_SIZE - 1) / SSF_GROUP_SIZE,
+															 (s->height + SSF_GROUP_SIZE - 1) / SSF_GROUP_SIZE, 1);
+			}
+		})
+		.reads(depth_res, FG_TEXTURE_READ)
+		.access(smooth_res, FG_IMAGE_WRITE, 0);
+	}
+
+	void splat(Shader* shader, GLuint vao) {
+		shader->setUniform("_proj", perspMat(0.25, 1920.0/1080.0, .1, 1000.0));
+		shader->setUniform("_view", camera.viewMat());
+		gl_state.bindVertexArray(vao);
+		gl_state.useProgram(shader->id);
+		GL(glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, PARTICLE_COUNT));
+	}
+
+	// onto whatever target_res holds, depth tested against it
+	void addCompositePass(FrameGraph& fg, Shader* composite, GLuint vao, u32 target_res) {
+		ScreenSpaceFluid* s = this;
+		fg.addPass("ssf composite", [=]() {
+			const Mat4 proj = perspMat(0.25, 1920.0/1080.0, .1, 1000.0);
+			composite->setUniform("_proj", proj);
+			composite->setUniform("_inv_proj", inverse(proj));
+			composite->setUniform("_view", camera.viewMat());
+			composite->setUniform("_viewport", v2(WINDOW_WIDTH, WINDOW_HEIGHT));
+			GL(glBindTextureUnit(0, s->smooth[1]));
+			GL(glBindTextureUnit(1, s->thickness));
+
+			gl_state.enable(GL_BLEND, true);
+			GL(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
+			gl_state.bindVertexArray(vao);
+			gl_state.useProgram(composite->id);
+			GL(glDrawArrays(GL_TRIANGLES, 0, 3));
+			gl_state.enable(GL_BLEND, false);
+		})
+		.reads(smooth_res, FG_TEXTURE_READ)
+		.reads(thickness_res, FG_TEXTURE_READ)
+		.renders(target_res);
+	}
+
+	void destroy() {
+		destroyTargets();
+	}
+};
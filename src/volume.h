@@ -0,0 +1,131 @@
+#pragma once
+
+// Volume rendering of the particle density. The particles are splatted into
+// a node grid over the box with the SPH kernel, the same way as for the
+// marching cubes (mc-splat.glsl), and the grid goes into a 3D texture for
+// trilinear sampling. Along with it every brick of VOL_BRICK^3 cells gets the
+// highest density of its nodes in a coarse occupancy texture. A full screen
+// pass then marches a ray per pixel through the box, absorbing by density,
+// and jumps over whole bricks whose occupancy says there is nothing to see.
+// Past the splat the cost is per pixel and step, whatever the particle count.
+//
+// Needs Shader, Buffer, WINDOW_WIDTH/WINDOW_HEIGHT and the frame graph from
+// final.cc.
+
+#define VOL_BRICK 4        // cells per occupancy texel and axis, must match vol-resolve.glsl
+#define VOL_MAX_CELLS 128
+
+struct DensityVolume {
+	Buffer<GL_SHADER_STORAGE_BUFFER> density; // fixed point, see mc-splat.glsl
+	GLuint volume;    // R16F, a texel per grid node
+	GLuint occupancy; // R16F, highest density per brick
+	u32 cells; // per axis, a multiple of VOL_BRICK
+	Vec3 box;
+
+	u32 density_res;
+	u32 volume_res;
+	u32 occupancy_res;
+
+	static DensityVolume make(FrameGraph& fg) {
+		DensityVolume v = {};
+		const u32 nodes = (VOL_MAX_CELLS + 1) * (VOL_MAX_CELLS + 1) * (VOL_MAX_CELLS + 1);
+		v.density = Buffer<GL_SHADER_STORAGE_BUFFER>::make(NULL, sizeof(u32) * nodes);
+		v.density_res = fg.addBuffer("vol_density", v.density.range());
+		v.volume_res = fg.addBuffer("vol_volume", {});
+		v.occupancy_res = fg.addBuffer("vol_occupancy", {});
+		return v;
+	}
+
+	void createTextures() {
+		const u32 n = cells + 1;
+		const u32 bricks = cells / VOL_BRICK;
+		GL(glCreateTextures(GL_TEXTURE_3D, 1, &volume));
+		GL(glTextureStorage3D(volume, 1, GL_R16F, n, n, n));
+		GL(glTextureParameteri(volume, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+		GL(glTextureParameteri(volume, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GL(glTextureParameteri(volume, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+		GL(glTextureParameteri(volume, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+		GL(glTextureParameteri(volume, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+		GL(glCreateTextures(GL_TEXTURE_3D, 1, &occupancy));
+		GL(glTextureStorage3D(occupancy, 1, GL_R16F, bricks, bricks, bricks));
+	}
+
+	void destroyTextures() {
+		if (!cells) return;
+		GLuint textures[] = { volume, occupancy };
+		GL(glDeleteTextures(ARRAY_SIZE(textures), textures));
+	}
+
+	// only between frames, the passes hold on to the textures
+	void setGrid(u32 c, Vec3 box_size) {
+		c = clamp(c / VOL_BRICK * VOL_BRICK, (u32)VOL_BRICK, (u32)VOL_MAX_CELLS);
+		box = box_size;
+		if (c == cells) return;
+		destroyTextures();
+		cells = c;
+		createTextures();
+	}
+
+	// splat is mc-splat.glsl, resolve turns its sums into the two textures
+	void addSplatPasses(FrameGraph& fg, Shader* splat, Shader* resolve, u32 state_res, u32 params_res) {
+		DensityVolume* v = this;
+		const u32 n = cells;
+
+		fg.addPass("vol splat", [=]() {
+			GL(glClearNamedBufferSubData(v->density.id, GL_R32UI, v->density.offset,
+																	 sizeof(u32) * (n + 1) * (n + 1) * (n + 1), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL));
+			splat->setUniform("_cells", (i32)n);
+			splat->execute((PARTICLE_COUNT + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(state_res, FG_SSBO_READ, 0)
+		.writes(density_res, 1);
+
+		// a workgroup per brick, nodes on the brick faces get stored twice
+		fg.addPass("vol resolve", [=]() {
+			GL(glBindImageTexture(0, v->volume, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16F));
+			GL(glBindImageTexture(1, v->occupancy, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16F));
+			resolve->setUniform("_cells", (i32)n);
+			resolve->execute(n / VOL_BRICK, n / VOL_BRICK, n / VOL_BRICK);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(density_res, FG_SSBO_READ, 1)
+		.access(volume_res, FG_IMAGE_WRITE, 0)
+		.access(occupancy_res, FG_IMAGE_WRITE, 0);
+	}
+
+	// blends over whatever target_res holds, after everything opaque
+	void addMarchPass(FrameGraph& fg, Shader* march, GLuint vao, f32 extinction, u32 params_res, u32 target_res) {
+		DensityVolume* v = this;
+		fg.addPass("vol march", [=]() {
+			const Mat4 proj = perspMat(0.25, 1920.0/1080.0, .1, 1000.0);
+			const Mat4 view = camera.viewMat();
+			march->setUniform("_proj", proj);
+			march->setUniform("_view", view);
+			march->setUniform("_inv_proj", inverse(proj));
+			march->setUniform("_inv_view", inverse(view));
+			march->setUniform("_viewport", v2(WINDOW_WIDTH, WINDOW_HEIGHT));
+			march->setUniform("_cells", (i32)v->cells);
+			march->setUniform("_step", 0.5f * min(v->box.x, min(v->box.y, v->box.z)) / v->cells); // half a cell
+			march->setUniform("_extinction", extinction);
+			GL(glBindTextureUnit(0, v->volume));
+			GL(glBindTextureUnit(1, v->occupancy));
+
+			gl_state.enable(GL_BLEND, true);
+			GL(glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA)); // premultiplied
+			gl_state.bindVertexArray(vao);
+			gl_state.useProgram(march->id);
+			GL(glDrawArrays(GL_TRIANGLES, 0, 3));
+			gl_state.enable(GL_BLEND, false);
+		})
+		.reads(params_res, FG_UBO_READ, SIM_PARAMS_BINDING)
+		.reads(volume_res, FG_TEXTURE_READ)
+		.reads(occupancy_res, FG_TEXTURE_READ)
+		.renders(target_res);
+	}
+
+	void destroy() {
+		destroyTextures();
+		density.destroy();
+	}
+};
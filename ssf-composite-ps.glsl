@@ -0,0 +1,70 @@
+#version 430
+
+// Shades the smoothed screen-space fluid depth (see ssf.h) over the scene.
+// Normals come from the view space positions of the neighbouring texels,
+// taking the side with the smaller depth step so silhouettes don't bend the
+// surface. Thicker fluid absorbs more of what's behind it.
+
+uniform mat4 _proj;
+uniform mat4 _inv_proj;
+uniform mat4 _view;
+uniform vec2 _viewport;
+
+layout(binding = 0) uniform sampler2D _depth;     // view space z, 0 where no fluid
+layout(binding = 1) uniform sampler2D _thickness;
+
+#define FLUID_COLOR vec3(0.1, 0.35, 0.8)
+#define SKY_COLOR vec3(0.6, 0.7, 0.8)
+#define ABSORPTION 1.5 // per unit of thickness
+
+out vec4 color;
+
+layout(depth_any) out float gl_FragDepth;
+
+vec3 viewPos(ivec2 t, float z) {
+	vec2 ndc = (vec2(t) + 0.5) / vec2(textureSize(_depth, 0)) * 2.0 - 1.0;
+	vec4 r = vec4(ndc, 1.0, 1.0) * _inv_proj;
+	vec3 ray = r.xyz / r.w;
+	return ray * (z / ray.z);
+}
+
+// towards the neighbour on step's side with the smaller depth step,
+// flat (facing the eye) if there is no fluid on either side
+vec3 slope(ivec2 t, vec3 p, ivec2 step) {
+	ivec2 size = textureSize(_depth, 0);
+	ivec2 a = clamp(t + step, ivec2(0), size - 1);
+	ivec2 b = clamp(t - step, ivec2(0), size - 1);
+	float za = texelFetch(_depth, a, 0).r;
+	float zb = texelFetch(_depth, b, 0).r;
+	if (za > 0.0 && (zb <= 0.0 || abs(za - p.z) < abs(zb - p.z)))
+		return viewPos(a, za) - p;
+	if (zb > 0.0)
+		return p - viewPos(b, zb);
+	return vec3(step, 0.0);
+}
+
+void main() {
+	ivec2 t = ivec2(gl_FragCoord.xy / _viewport * vec2(textureSize(_depth, 0)));
+	float z = texelFetch(_depth, t, 0).r;
+	if (z <= 0.0) discard;
+
+	vec3 p = viewPos(t, z);
+	vec3 n = normalize(cross(slope(t, p, ivec2(1, 0)), slope(t, p, ivec2(0, 1))));
+	if (dot(n, p) > 0.0) n = -n;
+
+	// world space, lit like the spheres
+	vec3 wn = mat3(_view) * n;
+	vec3 v = mat3(_view) * normalize(-p);
+	vec3 l = normalize(vec3(1));
+	float diffuse = max(dot(wn, l), 0.0) * 0.7 + 0.3;
+	float fresnel = 0.02 + 0.98 * pow(1.0 - max(dot(wn, v), 0.0), 5.0);
+	float specular = pow(max(dot(wn, normalize(l + v)), 0.0), 64.0);
+
+	float thickness = texelFetch(_thickness, t, 0).r;
+	float alpha = 1.0 - exp(-ABSORPTION * thickness);
+	color.rgb = mix(FLUID_COLOR * diffuse, SKY_COLOR, fresnel) + specular;
+	color.a = clamp(alpha + fresnel, 0.0, 1.0);
+
+	vec4 clip = vec4(p,1) * _proj;
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+}
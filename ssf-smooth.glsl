@@ -0,0 +1,53 @@
+#version 430
+
+// One direction of the separable bilateral filter over the screen-space fluid
+// depth (see ssf.h). Gaussian over the texels, times a falloff in depth, so
+// neighbouring spheres blend into one surface while fluid in front of other
+// fluid keeps its silhouette. The filter covers FILTER_RADIUS in view space,
+// projected at the texel's depth, but never more than MAX_TAPS texels each
+// way, so the cost per texel is bounded however close the camera gets.
+
+uniform mat4 _proj;
+uniform vec2 _dir; // (1,0) or (0,1)
+
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS 0.3
+#endif
+
+#define FILTER_RADIUS (2.0 * PARTICLE_RADIUS)
+#define DEPTH_FALLOFF PARTICLE_RADIUS
+#define MAX_TAPS 12
+
+layout(binding = 0) uniform sampler2D _src; // view space z, 0 where no fluid
+layout(binding = 0, r32f) uniform writeonly image2D _dst;
+
+layout (local_size_x = 8, local_size_y = 8) in;
+
+void main() {
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = textureSize(_src, 0);
+	if (any(greaterThanEqual(p, size))) return;
+
+	float z = texelFetch(_src, p, 0).r;
+	if (z <= 0.0) {
+		imageStore(_dst, p, vec4(0.0));
+		return;
+	}
+
+	float radius = clamp(FILTER_RADIUS * _proj[1][1] * 0.5 * float(size.y) / z, 1.0, float(MAX_TAPS));
+	int taps = int(ceil(radius));
+	float sigma = radius * 0.5;
+
+	float sum = 0.0;
+	float weights = 0.0;
+	for (int i = -taps; i <= taps; ++i) {
+		ivec2 q = clamp(p + ivec2(_dir) * i, ivec2(0), size - 1);
+		float s = texelFetch(_src, q, 0).r;
+		if (s <= 0.0) continue;
+		float dz = (s - z) / DEPTH_FALLOFF;
+		float w = exp(-float(i * i) / (2.0 * sigma * sigma) - dz * dz);
+		sum += s * w;
+		weights += w;
+	}
+	imageStore(_dst, p, vec4(sum / weights));
+}
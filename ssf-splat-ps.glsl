@@ -0,0 +1,38 @@
+#version 430
+
+uniform mat4 _proj;
+uniform mat4 _view;
+
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS 0.3
+#endif
+
+in vec3 v_color;
+in vec3 v_center;
+in vec3 v_quad;
+
+// Particle spheres into the screen-space fluid targets, see ssf.h. Same ray
+// cast as impostor-ps.glsl, but what comes out is the view space z of the
+// nearest hit or, with THICKNESS, the length of the ray inside the sphere.
+#ifdef THICKNESS
+out float thickness;
+#else
+out float view_z;
+layout(depth_less) out float gl_FragDepth;
+#endif
+
+void main() {
+	vec3 dir = normalize(v_quad);
+	float b = dot(dir, v_center);
+	float h = b * b - dot(v_center, v_center) + PARTICLE_RADIUS * PARTICLE_RADIUS;
+	if (h < 0.0) discard;
+
+#ifdef THICKNESS
+	thickness = 2.0 * sqrt(h);
+#else
+	vec3 hit = dir * (b - sqrt(h));
+	view_z = hit.z;
+	vec4 clip = vec4(hit,1) * _proj;
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+#endif
+}
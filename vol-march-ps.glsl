@@ -0,0 +1,85 @@
+#version 430
+
+// Marches the eye ray through the density volume (see volume.h), absorbing
+// in proportion to the density and lighting every sample by how fast the
+// density falls off towards the light. Bricks whose occupancy is below
+// VOL_CUTOFF are skipped in one go, to where the ray leaves them.
+
+#include "common.glsl"
+
+uniform mat4 _proj;
+uniform mat4 _view;
+uniform mat4 _inv_proj;
+uniform mat4 _inv_view;
+uniform vec2 _viewport;
+uniform int _cells;        // per axis, over _bbox_size
+uniform float _step;       // along the ray
+uniform float _extinction; // per unit length, at the target density
+
+layout(binding = 0) uniform sampler3D _volume;
+layout(binding = 1) uniform sampler3D _occupancy;
+
+#define VOL_BRICK 4
+#define VOL_CUTOFF (0.05 * _target_density)
+#define VOL_MAX_STEPS 1024
+#define FLUID_COLOR vec3(0.1, 0.35, 0.8)
+
+out vec4 color;
+
+layout(depth_any) out float gl_FragDepth;
+
+float densityAt(vec3 p) {
+	vec3 nodes = p / _bbox_size * float(_cells);
+	return texture(_volume, (nodes + 0.5) / float(_cells + 1)).r;
+}
+
+void main() {
+	vec2 ndc = gl_FragCoord.xy / _viewport * 2.0 - 1.0;
+	vec4 r = vec4(ndc, 1.0, 1.0) * _inv_proj;
+	vec3 o = (vec4(0, 0, 0, 1) * _inv_view).xyz;
+	vec3 d = normalize((vec4(r.xyz / r.w, 0.0) * _inv_view).xyz);
+	vec3 inv_d = 1.0 / (d + vec3(equal(d, vec3(0.0))) * 1e-6);
+
+	// into the box
+	vec3 ta = -o * inv_d;
+	vec3 tb = (_bbox_size - o) * inv_d;
+	vec3 tmin = min(ta, tb), tmax = max(ta, tb);
+	float t0 = max(max(tmin.x, tmin.y), max(tmin.z, 0.0));
+	float t1 = min(tmax.x, min(tmax.y, tmax.z));
+	if (t1 <= t0) discard;
+
+	// interleaved gradient noise on the start, trades banding for grain
+	float t = t0 + _step * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+	vec3 brick = _bbox_size / float(_cells / VOL_BRICK);
+	ivec3 bricks = ivec3(_cells / VOL_BRICK);
+	vec3 l = normalize(vec3(1));
+	float probe = 0.5 * _sph_radius;
+
+	vec3 rgb = vec3(0.0);
+	float transmittance = 1.0;
+	float hit = -1.0; // first sample with any fluid, for the depth test
+	for (int i = 0; i < VOL_MAX_STEPS && t < t1 && transmittance > 0.01; ++i) {
+		vec3 p = o + d * t;
+		ivec3 b = clamp(ivec3(p / brick), ivec3(0), bricks - 1);
+		if (texelFetch(_occupancy, b, 0).r < VOL_CUTOFF) {
+			vec3 exit = (vec3(b + ivec3(greaterThan(d, vec3(0.0)))) * brick - o) * inv_d;
+			t += _step * max(ceil((min(exit.x, min(exit.y, exit.z)) - t) / _step), 1.0);
+			continue;
+		}
+
+		float density = densityAt(p);
+		float a = 1.0 - exp(-_extinction * density / _target_density * _step);
+		if (a > 0.001) {
+			float lit = clamp((density - densityAt(p + l * probe)) / (0.5 * _target_density), 0.0, 1.0);
+			rgb += transmittance * a * FLUID_COLOR * (0.3 + 0.7 * lit);
+			transmittance *= 1.0 - a;
+			if (hit < 0.0) hit = t;
+		}
+		t += _step;
+	}
+	if (transmittance > 0.999) discard;
+
+	color = vec4(rgb, 1.0 - transmittance);
+	vec4 clip = vec4(o + d * hit, 1.0) * _view * _proj;
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+}
@@ -0,0 +1,32 @@
+#version 430
+
+// Splatted densities (mc-splat.glsl) into the volume texture, and the highest
+// of them per brick into the occupancy texture, see volume.h. A workgroup
+// covers a brick's nodes including the far faces, those are the ones
+// trilinear sampling inside the brick touches.
+
+#include "mc-common.glsl"
+
+#define VOL_BRICK 4
+#define VOL_GROUP 5 // VOL_BRICK + 1, layout() wants a literal
+
+layout(binding = 0, r16f) uniform writeonly image3D _volume;
+layout(binding = 1, r16f) uniform writeonly image3D _occupancy;
+
+layout (local_size_x = VOL_GROUP, local_size_y = VOL_GROUP, local_size_z = VOL_GROUP) in;
+
+shared uint peak; // float bits, all densities are positive
+
+void main() {
+	if (gl_LocalInvocationIndex == 0u) peak = 0u;
+	barrier();
+
+	ivec3 n = ivec3(gl_WorkGroupID) * VOL_BRICK + ivec3(gl_LocalInvocationID);
+	float d = densityAt(n);
+	imageStore(_volume, n, vec4(d));
+	atomicMax(peak, floatBitsToUint(d));
+	barrier();
+
+	if (gl_LocalInvocationIndex == 0u)
+		imageStore(_occupancy, ivec3(gl_WorkGroupID), vec4(uintBitsToFloat(peak)));
+}